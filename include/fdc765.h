@@ -44,6 +44,34 @@ typedef struct {
 }
 u765_TrackInfoBlock;
 
+typedef struct u765_TrackCopy u765_TrackCopy;   // private copy of a track written while the image is shared
+typedef struct u765_SharedDisk u765_SharedDisk; // disk image shared between cloned controllers
+typedef struct u765_AsyncInsert u765_AsyncInsert; // disk being loaded on a worker thread
+
+// what an image decoder set with u765_SetImageDecoder is given to read the compressed file, up
+// to Len bytes at a time and 0 at its end, and to append to the image, false if it can't grow,
+// which it doesn't past the largest DSK image
+typedef size_t (*u765_DecoderRead)(void* Stream, void* Buffer, size_t Len);
+typedef bool (*u765_DecoderWrite)(void* Stream, void const* Data, size_t Len);
+typedef bool (*u765_ImageDecoder)(void* User, void* Stream, u765_DecoderRead Read, u765_DecoderWrite Write);
+
+typedef struct {
+    uint32_t TrackOffset; // offset of the Track-Info block in DiskArrayPtr
+    uint32_t TrackLength; // bytes of track data available at TrackOffset, 0 if beyond the image
+    uint16_t FirstSector; // first entry for this track in SectorIndex
+    uint8_t  NumSectors;  // number of sectors indexed for this track
+    bool     Dirty;       // track has been written since the disk was last flushed
+    bool     Written;     // track has been written since the disk was inserted
+    u765_TrackCopy* Copy; // this unit's copy of the track, NULL while it is read from DiskArrayPtr
+}
+u765_TrackIndex;
+
+typedef struct {
+    uint32_t DataOffset; // offset of the sector data from the start of SectorData
+    uint32_t CHRN;       // sector ID as read from the SectorInfoList
+}
+u765_SectorIndex;
+
 typedef struct {
     FILE* DiskFileHandle;    // DWORD ?         ; filehandle of inserted disk
     void* DiskArrayPtr;      // DWORD ?         ; pointer to allocated memory   
@@ -53,21 +81,32 @@ typedef struct {
     bool    WriteProtect;      // BYTE  ?         ; TRUE if disk is write protected
     bool    EDSK;              // BYTE  ?         ; TRUE if this unit has an EDSK file; FALSE for DSK
     bool    DriveStateChanged; // BYTE  ?         ; TRUE if this drive's state has changed
+    bool    DiskMapped;        //                 ; TRUE if DiskArrayPtr is a mapping of the disk file
+    bool    DiskBorrowed;      //                 ; TRUE if DiskArrayPtr is an application buffer we don't own
+    bool    LayoutChanged;     //                 ; TRUE if Format Track moved the tracks, the whole image is written back
     uint8_t CTK;               // BYTE  ?         ; current physical track the head is over
     uint8_t CHEAD;             // BYTE  ?         ; current head in operation for this command
     uint8_t CSR;               // BYTE  ?         ; current sector the head is over
     bool    SeekDone;          // BYTE  ?         ; TRUE if this drive has just completed a SEEK command
-    char    Filename[260];     // BYTE 260 dup(?) ; Null-terminated filename open on this unit
 
-    u765_DiskInfoBlock  DiskBlock;  // TDSKInfoBlock   <>
-    u765_TrackInfoBlock TrackBlock; // TTRKInfoBlock   <>
+    u765_TrackIndex*  TrackIndex;  // per-track offsets into DiskArrayPtr, built on insert
+    u765_SectorIndex* SectorIndex; // per-sector data offsets and IDs for all indexed tracks
+    uint16_t NumTrackSlots;        // number of entries in TrackIndex
+    uint16_t TrackSlot;            // TrackIndex entry of the track last located for this unit
+    uint16_t CachedTrackSlot;      // TrackIndex entry held in TrackBlock, 0xffff if none
+    u765_SharedDisk* SharedDisk;   // owner of DiskArrayPtr once it's shared with a clone, NULL before
+
+    u765_TrackInfoBlock* TrackBlock; // TTRKInfoBlock   <> ; allocated with the first disk inserted in this unit
+    u765_DiskInfoBlock   DiskBlock;  // TDSKInfoBlock   <>
+    char Filename[260];              // BYTE 260 dup(?) ; Null-terminated filename open on this unit
 }
 u765_DiskUnit;
 
 typedef enum {
     u765_FDCReadData,
     u765_FDCReadDeletedData,
-    u765_FDCReadTrack
+    u765_FDCReadTrack,
+    u765_FDCScanData
 }
 u765_ReadMode;
 
@@ -77,7 +116,72 @@ typedef enum {
 }
 u765_WriteMode;
 
+typedef enum {
+    u765_InsertDefault      = 0,
+    u765_InsertMapped       = 1, // map the disk file into memory instead of reading it
+    u765_InsertBorrow       = 2, // use the application buffer in place, written tracks are copied
+    u765_InsertWriteProtect = 4, // insert the disk write protected
+    u765_InsertCached       = 8  // share the image read with the units that inserted the same unchanged file with this flag
+}
+u765_InsertFlags;
+
+typedef enum {
+    u765_EngineDefault = 0, // every port access goes through the label dispatcher
+    u765_EngineDirect  = 1  // data and status bytes are moved by direct handlers, commands are dispatched as before
+}
+u765_Engine;
+
+typedef enum {
+    u765_StateDefault   = 0, // disks are referenced, the same images must be in the units on load
+    u765_StateDiskDelta = 1  // also save the tracks written since each disk was inserted
+}
+u765_StateFlags;
+
+typedef enum {
+    u765_TraceDefault = 0,
+    u765_TraceCycles  = 1  // stamp the records with the host cycle given to u765_SetTraceCycle
+}
+u765_TraceFlags;
+
+// A trace file is "U7TR", a version word, the u765_TraceFlags and the number of units, then records.
+// A record is its type byte, with bit 7 set when the cycles since the previous stamped record
+// follow, then what is listed below. Cycles and lengths are 7 bits per byte, low bits first,
+// bit 7 set when more bytes follow. The trace starts with the inserted disks and a state saved
+// with u765_StateDiskDelta, so a fresh controller can replay it.
+typedef enum {
+    u765_TraceStatusRead     = 1,  // value read
+    u765_TraceDataRead       = 2,  // value read
+    u765_TraceDataWrite      = 3,  // value written
+    u765_TraceDataReadBlock  = 4,  // MaxLen, length read, the bytes read
+    u765_TraceDataWriteBlock = 5,  // Len, length written, the Len bytes given
+    u765_TraceMotorState     = 6,  // value
+    u765_TraceResetDevice    = 7,
+    u765_TraceRandomMethod   = 8,  // value
+    u765_TraceInsertDisk     = 9,  // unit, u765_InsertFlags, length, the image (length 0 if none was inserted)
+    u765_TraceEjectDisk      = 10, // unit
+    u765_TraceLoadState      = 11  // length, the state
+}
+u765_TraceRecord;
+
+// counters kept per command when the library is built with U765_STATS. The controller always
+// has room for them, so that its layout is the same whether the header is included with
+// U765_STATS defined or not
+typedef struct {
+    uint32_t Commands;      // times the command was issued
+    uint32_t Revolutions;   // index holes passed looking for sectors
+    uint32_t OverRuns;      // execution phases ended by an overrun
+    uint32_t TrackCopies;   // tracks copied into TrackBlock or written back from it
+    uint64_t Bytes;         // execution phase bytes moved through the data port
+    uint64_t Nanoseconds;   // time spent in the port functions
+}
+u765_CommandStats;
+
 typedef struct {
+    u765_CommandStats Command[32];  // indexed by command code, as LastFDCCmd
+}
+u765_Stats;
+
+typedef struct u765_Controller {
     uint8_t* FDC_RCVDLoc;       // DWORD ?
     uint8_t* FDC_SENDLoc;       // DWORD ?
     uint32_t CurrentSectorSize; // DWORD ?
@@ -97,9 +201,6 @@ typedef struct {
 
     uint32_t BytesSaved; // DWORD ?
 
-    void (*ActiveCallback)(void);                     // DWORD ?     ; application callback when disk system becomes active
-    void (*CommandCallback)(uint8_t const*, uint8_t); // DWORD   ?   ; application callback when FDC command/parameters have been received
-
     uint32_t PhysicalSectorSize;  // DWORD   ?   ; 128 Shl N
     uint32_t AvailableSectorData; // DWORD   ?   ; available bytes of sector data
     uint32_t MultipleSectorPick;  // DWORD   ?
@@ -146,10 +247,8 @@ typedef struct {
 
     uint8_t CurrentSectorNumber; // BYTE ?
     uint8_t DskRndMethod;        // BYTE ?
-
-    // structures for 2 available drive units
-    u765_DiskUnit FDDUnit0; // TFDDUnit    <>
-    u765_DiskUnit FDDUnit1; // TFDDUnit    <>
+    uint8_t Engine;              //         ; u765_Engine the controller was initialised with
+    uint8_t NumUnits;            //         ; drive units the controller was initialised with, 1 to 4
 
     // current read mode in operation
     //ReadMode            BYTE ? //RESETENUM
@@ -162,7 +261,44 @@ typedef struct {
     uint8_t FDCCommandByte;       // BYTE    ?               ; command received by FDC
     uint8_t FDCParameters[32];    // BYTE    32      dup(?)  ; parameters for each command
     uint8_t FDCResults[32];       // BYTE    32      dup(?)  ; command result bytes for each command
-    uint8_t FDCRandomData[16384]; // BYTE    16384   dup(?)  ; buffer for random bytes
+
+    // the callbacks and the drive units are kept clear of the registers polled above
+    void (*ActiveCallback)(void);                     // DWORD ?     ; application callback when disk system becomes active
+    void (*CommandCallback)(uint8_t const*, uint8_t); // DWORD   ?   ; application callback when FDC command/parameters have been received
+    void (*WriteBackCallback)(uint8_t, void const*, size_t); //      ; application callback to save a changed in-memory disk
+
+    // the same callbacks given the pointer they were set with, only one of each pair is set
+    void (*ActiveCallbackEx)(void*);
+    void (*CommandCallbackEx)(void*, uint8_t const*, uint8_t);
+    void (*WriteBackCallbackEx)(void*, uint8_t, void const*, size_t);
+    void* ActiveUser;
+    void* CommandUser;
+    void* WriteBackUser;
+
+    uint32_t (*SectorCallback)(void*, uint8_t*, uint32_t, bool);    // takes the sector data of the execution phase itself
+    void* SectorUser;
+    uint32_t TransferRun;        // counts the transfers started, command bytes included
+    uint32_t TransferRunOffered; // TransferRun when SectorCallback was last called
+
+    FILE* TraceFile;         // records are written here while a trace is running, NULL otherwise
+    uint8_t* TraceBuffer;    // records not written out yet
+    uint32_t TraceLength;    // bytes in TraceBuffer
+    uint32_t TraceFlags;     // u765_TraceFlags the trace was started with
+    uint64_t TraceCycle;     // host cycle set with u765_SetTraceCycle
+    uint64_t TraceLastCycle; // cycle the last stamped record was written at
+
+    uint8_t* FDCRandomData; // BYTE    16384   dup(?)  ; buffer for random bytes, allocated when first needed
+    uint8_t* FDCScanData;   // bytes the Scan commands receive from the CPU, allocated when first needed
+    uint8_t* FDCFormatIDs;  // C,H,R,N of each sector given to Format Track, allocated when first needed
+
+    u765_AsyncInsert* AsyncInserts[4]; // disk loading on a worker thread for each unit, NULL if none
+    uint8_t AsyncUnits;                // bit set for each unit in AsyncInserts
+
+    u765_Stats Stats; // left at zero unless the library is built with U765_STATS
+
+    // structures for the drive units present, only these are allocated. With 1 or 3 units, one
+    // more stands for the drive the spare unit select addresses, which never holds a disk
+    u765_DiskUnit FDDUnit[]; // TFDDUnit    <>
 }
 u765_Controller;
 
@@ -181,20 +317,95 @@ typedef struct {
 }
 u765_State;
 
+typedef struct {
+    uint8_t MSR;
+    uint8_t ST0;
+    uint8_t ST1;
+    uint8_t ST2;
+    uint8_t ST3;
+    uint8_t NumUnits;  // units the controller was initialised with, the rest of the entries are 0
+    uint8_t CTRK[4];   // for each unit, the track, head and sector the head is over
+    uint8_t CHEAD[4];
+    uint8_t CSR[4];
+}
+u765_StateEx;
+
+// Controllers share no state, each can be driven from its own thread as long as no two threads
+// use the same controller at once. Clones, and units borrowing the same application buffer, can
+// run on different threads, the buffer staying unchanged while it's inserted. u765_Clone reads
+// the controller it copies, which mustn't be in use meanwhile. Callbacks are called on the
+// thread that made the call triggering them.
 U765_EXPORT u765_Controller* U765_FUNCTION(u765_Initialise)(void);
+U765_EXPORT u765_Controller* U765_FUNCTION(u765_InitialiseEx)(uint32_t Engine);
+// a controller with 1 to 4 drive units instead of 2. Units are selected with as many unit select
+// lines as they need, so with 2 units unit 2 is unit 0 as on the CPC, and with 1 or 3 units the
+// unit left over is a drive no disk can be inserted in. Other counts give 2 units
+U765_EXPORT u765_Controller* U765_FUNCTION(u765_InitialiseUnits)(uint32_t Engine, uint32_t NumUnits);
 U765_EXPORT void U765_FUNCTION(u765_Shutdown)(u765_Controller* FdcHandle);
+// the clone shares the inserted images, each controller copying only the tracks it writes. A
+// mapped file is only ever written by the unit that inserted it, and the tracks it wrote while
+// clones read the file wait for the last of them to be shut down or ejected
+U765_EXPORT u765_Controller* U765_FUNCTION(u765_Clone)(u765_Controller* FdcHandle);
 U765_EXPORT void U765_FUNCTION(u765_ResetDevice)(u765_Controller* FdcHandle);
 U765_EXPORT void U765_FUNCTION(u765_InsertDisk)(u765_Controller* FdcHandle, char const* lpFilename, uint8_t Unit);
+U765_EXPORT void U765_FUNCTION(u765_InsertDiskEx)(u765_Controller* FdcHandle, char const* lpFilename, uint8_t Unit, uint32_t Flags);
+U765_EXPORT void U765_FUNCTION(u765_InsertDiskFromMemory)(u765_Controller* FdcHandle, void const* lpData, size_t Len, uint8_t Unit, uint32_t Flags);
+// u765_InsertDiskEx decodes gzip files itself, and the files in any other format but DSK and EDSK
+// with the decoder given to u765_SetImageDecoder. It is set for the whole process, before any
+// disk is inserted. The decoder pulls the compressed bytes with Read and appends the image with
+// Write, returning false if the file isn't in a format it knows or is damaged. Decoded images
+// are never written back to their file, the changes go to the write-back callback
+U765_EXPORT void U765_FUNCTION(u765_SetImageDecoder)(u765_ImageDecoder Decoder, void* User);
+// inserts the disk as u765_InsertDiskEx does, but reads and indexes it on a worker thread. The unit
+// stays empty and not ready until the first port access or u765_DiskInserted made once it's loaded
+// and no command is running, which inserts it and calls Callback, if not NULL, on that thread with
+// whether it could be. The load is dropped without calling back by the next insert or eject
+U765_EXPORT void U765_FUNCTION(u765_InsertDiskAsync)(u765_Controller* FdcHandle, char const* lpFilename, uint8_t Unit, uint32_t Flags, void (*Callback)(void*, uint8_t, bool), void* User);
+U765_EXPORT void U765_FUNCTION(u765_FlushDisk)(u765_Controller* FdcHandle, uint8_t Unit);
 U765_EXPORT void U765_FUNCTION(u765_EjectDisk)(u765_Controller* FdcHandle, uint8_t Unit);
 U765_EXPORT bool U765_FUNCTION(u765_GetMotorState)(u765_Controller* FdcHandle);
 U765_EXPORT void U765_FUNCTION(u765_SetMotorState)(u765_Controller* FdcHandle, uint8_t Value);
 U765_EXPORT uint8_t U765_FUNCTION(u765_StatusPortRead)(u765_Controller* FdcHandle);
 U765_EXPORT uint8_t U765_FUNCTION(u765_DataPortRead)(u765_Controller* FdcHandle);
+U765_EXPORT uint32_t U765_FUNCTION(u765_DataPortReadBlock)(u765_Controller* FdcHandle, uint8_t* lpBuffer, uint32_t MaxLen);
+// Format Track rewrites the track under the head, growing the image when its sectors need more
+// room. It never adds tracks or sides: seeks past the last track stop on it, head 1 of a single
+// sided image is not ready, and EDSK images only grow their first 204 tracks, counting each side
 U765_EXPORT void U765_FUNCTION(u765_DataPortWrite)(u765_Controller* FdcHandle, uint8_t DataByte);
+U765_EXPORT uint32_t U765_FUNCTION(u765_DataPortWriteBlock)(u765_Controller* FdcHandle, uint8_t const* lpBuffer, uint32_t Len);
 U765_EXPORT void U765_FUNCTION(u765_SetActiveCallback)(u765_Controller* FdcHandle, void (*lpActiveCallback)(void));
 U765_EXPORT void U765_FUNCTION(u765_SetCommandCallback)(u765_Controller* FdcHandle, void (*lpCommandCallback)(uint8_t const*, uint8_t));
+U765_EXPORT void U765_FUNCTION(u765_SetWriteBackCallback)(u765_Controller* FdcHandle, void (*lpWriteBackCallback)(uint8_t, void const*, size_t));
+// these pass User back as the first argument, replacing the callback set without it and vice versa
+U765_EXPORT void U765_FUNCTION(u765_SetActiveCallbackEx)(u765_Controller* FdcHandle, void (*lpActiveCallback)(void*), void* User);
+U765_EXPORT void U765_FUNCTION(u765_SetCommandCallbackEx)(u765_Controller* FdcHandle, void (*lpCommandCallback)(void*, uint8_t const*, uint8_t), void* User);
+U765_EXPORT void U765_FUNCTION(u765_SetWriteBackCallbackEx)(u765_Controller* FdcHandle, void (*lpWriteBackCallback)(void*, uint8_t, void const*, size_t), void* User);
+// called as the execution phase starts moving each sector, with the Len bytes left to be read from
+// Data, or to be written to it when Write is set. It returns how many of them it moved itself, so
+// the host can copy them straight to or from emulated memory. The rest go through the data port,
+// and once a command's sectors are all taken the result phase is read as usual
+U765_EXPORT void U765_FUNCTION(u765_SetSectorCallback)(u765_Controller* FdcHandle, uint32_t (*lpSectorCallback)(void*, uint8_t*, uint32_t, bool), void* User);
 U765_EXPORT bool U765_FUNCTION(u765_DiskInserted)(u765_Controller* FdcHandle, uint8_t Unit);
 U765_EXPORT void U765_FUNCTION(u765_SetRandomMethod)(u765_Controller* FdcHandle, uint8_t RndMethod);
 U765_EXPORT void U765_FUNCTION(u765_GetFDCState)(u765_Controller* FdcHandle, u765_State* lpFDCState);
+U765_EXPORT void U765_FUNCTION(u765_GetFDCStateEx)(u765_Controller* FdcHandle, u765_StateEx* lpFDCState);
+
+// u765_SaveState returns the size of the state, which is only written when it fits in MaxLen,
+// or 0 if the controller can't be saved. u765_LoadState leaves the controller untouched and
+// returns false if the state doesn't match the disks currently inserted.
+U765_EXPORT uint32_t U765_FUNCTION(u765_SaveState)(u765_Controller* FdcHandle, uint8_t* lpBuffer, uint32_t MaxLen, uint32_t Flags);
+U765_EXPORT bool U765_FUNCTION(u765_LoadState)(u765_Controller* FdcHandle, uint8_t const* lpBuffer, uint32_t Len);
+
+// records the port accesses and the calls changing the controller until u765_StopTrace, false if
+// the file can't be created or the controller can't be saved. A trace that can't be written
+// any further is stopped
+U765_EXPORT bool U765_FUNCTION(u765_StartTrace)(u765_Controller* FdcHandle, char const* lpFilename, uint32_t Flags);
+U765_EXPORT void U765_FUNCTION(u765_StopTrace)(u765_Controller* FdcHandle);
+U765_EXPORT void U765_FUNCTION(u765_SetTraceCycle)(u765_Controller* FdcHandle, uint64_t Cycle);
+
+#ifdef U765_STATS
+U765_EXPORT void U765_FUNCTION(u765_GetStats)(u765_Controller* FdcHandle, u765_Stats* lpStats);
+U765_EXPORT void U765_FUNCTION(u765_ResetStats)(u765_Controller* FdcHandle);
+#endif
 
 #endif // FDC765_H__
@@ -1,9 +1,24 @@
 #include <fdc765.h>
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#if defined(U765_STATS) && !defined(_WIN32)
+#include <time.h>
+#endif
+
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
     typedef union { \
         struct { uint8_t l, h; }; \
@@ -42,6 +57,135 @@ typedef struct {
 }
 Context;
 
+// cursor over a saved state, Data is NULL while a state is only being sized
+typedef struct {
+    uint8_t* Data;
+    uint32_t Pos, Len;
+    bool Load;  // reading the state into the controller instead of writing it out
+    bool Apply; // changes may be made to the disk images while loading
+    bool Ok;
+}
+StateStream;
+
+// the reference counts below are shared by clones, which may be running on other threads
+struct u765_TrackCopy {
+    uint32_t RefCount;  // units of cloned controllers reading this copy
+    uint8_t  Data[];    // TrackLength bytes of track data
+};
+
+// a track the unit that owns a mapped file wrote while clones read the file, written to it
+// once they're gone
+typedef struct {
+    uint32_t TrackOffset;
+    uint32_t TrackLength;
+    u765_TrackCopy* Copy;
+}
+PendingTrack;
+
+struct u765_SharedDisk {
+    uint32_t RefCount;  // units reading this image
+    void*    DiskArrayPtr;
+    size_t   DiskArrayLen;
+    bool     DiskMapped;
+    bool     DiskBorrowed;
+    bool     Cached;    // inserted with u765_InsertCached, never written in place
+    bool     Listed;    // found in ImageCache by the next inserts, until a unit writes the file
+    u765_SharedDisk* NextCached;
+    FILE*    PendingFile;   // of the unit ejected while clones still mapped it, closed by the last unit
+    PendingTrack* Pending;  // the tracks that unit wrote meanwhile
+    uint32_t NumPending;
+    time_t   ModTime;   // of the file when it was read
+    size_t   FileLen;   // likewise, the image may be larger once decoded
+    char     Filename[260];
+};
+
+// a disk inserted into a controller of its own on a worker thread, moved into the unit once loaded
+struct u765_AsyncInsert {
+    uint32_t State;            // AsyncLoading until the worker is done with it
+    u765_Controller* Loader;   // the disk is inserted in its unit 0
+    uint32_t Flags;
+    uint8_t  Unit;             // as given to u765_InsertDiskAsync
+    void (*Callback)(void*, uint8_t, bool);
+    void*    User;
+    char     Filename[];
+};
+
+enum {
+    AsyncLoading,
+    AsyncLoaded,    // the loader is the controller's to take
+    AsyncDropped    // the unit doesn't want the disk anymore, the worker frees it
+};
+
+// a compressed disk file being decoded into a new image
+typedef struct {
+    FILE* File;
+    uint8_t* Image;
+    size_t Len, Size;   // bytes decoded, bytes allocated
+}
+DecodeStream;
+
+enum {
+    ImagePlain,     // a DSK or EDSK image as it is
+    ImageGzip,      // decoded with the bundled inflate
+    ImageForeign    // given to the decoder set with u765_SetImageDecoder
+};
+
+#define INFLATE_FAST_BITS 10
+
+typedef struct {
+    uint16_t Counts[16];                    // codes of each length
+    uint16_t Symbols[320];                  // symbols in the order of their codes
+    uint16_t Fast[1 << INFLATE_FAST_BITS];  // symbol << 4 | length of the codes up to INFLATE_FAST_BITS bits, 0 for longer ones
+}
+InflateTable;
+
+typedef struct {
+    DecodeStream* Stream;
+    uint8_t Buffer[16384];  // compressed bytes read from the file
+    size_t Pos, Len;
+    uint64_t Bits;          // bits taken from Buffer, the next one at the bottom
+    uint32_t NumBits;
+    uint32_t Padding;       // zero bits past the end of the file at the top of Bits
+    size_t Start;           // where the gzip member being decoded starts in the image
+    bool Ok;
+    InflateTable Literals, Distances, Lengths;
+}
+Inflater;
+
+#define U765_STATE_VERSION 7   // bump when the state layout or the case_* labels change
+#define U765_TRACE_VERSION 2   // bump when the trace records change
+#define U765_TRACE_BUFFER_SIZE 65536
+
+#define U765_RANDOM_DATA_SIZE 32768 // largest PhysicalSectorSize a sector is topped up to
+#define U765_SCAN_DATA_SIZE 32768   // largest PhysicalSectorSize a sector is scanned for
+#define U765_FORMAT_IDS_SIZE 1024   // C,H,R,N for each of the 255 sectors SC can give
+#define U765_MAX_IMAGE_SIZE (0x100 + 255 * 2 * 0xffff) // largest image: a DSK of 255 tracks of 2 sides of 0xffff bytes
+#define U765_MAX_INFLATE_RATIO 1032 // most bytes deflate can give for each compressed byte
+
+// TrackBlock of every unit that has never held a disk, only ever read. Besides the image
+// cache below, controllers have nothing else in common but the images and copies they share
+static u765_TrackInfoBlock EmptyTrackBlock;
+
+// the images inserted with u765_InsertCached, Listed and NextCached are only used with the lock held
+static u765_SharedDisk* ImageCache;
+static long volatile ImageCacheLock;
+
+// decodes the images in formats the library has no decoder of its own for, set once at start up
+static u765_ImageDecoder ImageDecoder;
+static void* ImageDecoderUser;
+
+#ifdef _WIN32
+#define REF_INC(count) InterlockedIncrement((LONG volatile*)&(count))
+#define REF_DEC(count) ((uint32_t)InterlockedDecrement((LONG volatile*)&(count)))
+#define REF_GET(count) ((uint32_t)InterlockedCompareExchange((LONG volatile*)&(count), 0, 0))
+#define ATOMIC_XCHG(var, value) ((uint32_t)InterlockedExchange((LONG volatile*)&(var), (value)))
+#else
+#define REF_INC(count) __atomic_add_fetch(&(count), 1, __ATOMIC_RELAXED)
+#define REF_DEC(count) __atomic_sub_fetch(&(count), 1, __ATOMIC_ACQ_REL)
+#define REF_GET(count) __atomic_load_n(&(count), __ATOMIC_ACQUIRE)
+#define ATOMIC_XCHG(var, value) __atomic_exchange_n(&(var), (value), __ATOMIC_ACQ_REL)
+#endif
+
 #define ARG(ctx, index) ((ctx)->stack[(ctx)->esp.e + (index)])
 #define PUSH(ctx, val) do { (ctx)->stack[(ctx)->esp.e++] = val; } while (0)
 #define POP(ctx) ((ctx)->stack[--(ctx)->esp.e])
@@ -70,6 +214,17 @@ Context;
 #define READDW(ptr) ((ptr)[0] | (uint32_t)(ptr)[1] << 8 | (uint32_t)(ptr)[2] << 16 | (uint32_t)(ptr)[3] << 24)
 #define WRITEDW(ptr, val) do { (ptr)[0] = (uint8_t)(val); (ptr)[1] = (uint8_t)((val) >> 8); (ptr)[2] = (uint8_t)((val) >> 16); (ptr)[3] = (uint8_t)((val) >> 24); } while (0)
 
+#ifdef U765_STATS
+// adds to a counter of the command in progress
+#define STAT(ctrl, field, n) do { (ctrl)->Stats.Command[(ctrl)->LastFDCCmd & 31].field += (n); } while (0)
+#define STAT_START(ctrl) uint64_t const stat_start = StatsNow()
+#define STAT_END(ctrl) STAT(ctrl, Nanoseconds, StatsNow() - stat_start)
+#else
+#define STAT(ctrl, field, n) do { } while (0)
+#define STAT_START(ctrl) do { } while (0)
+#define STAT_END(ctrl) do { } while (0)
+#endif
+
 static void rep_movsb(Context* ctx) {
     memcpy(ctx->edi.u8, ctx->esi.u8, ctx->ecx.e);
     ctx->edi.u8 += ctx->ecx.e;
@@ -87,11 +242,83 @@ HIGH LEVEL INTERFACE
 -----------------------------------------------------------------------------*/
 
 static void LowLevelInitialise(Context*, u765_Controller*);
-static void WriteCurrentDisk(Context*, u765_Controller*, uint8_t);
+static void WriteCurrentDisk(Context*, u765_Controller*, uint8_t, bool);
 static void GetUnitPtr(Context*, uint8_t);
-static void EDsk2Dsk(Context*, uint8_t);
+static bool UnitPresent(u765_Controller*, u765_DiskUnit*);
+static uint32_t UnitSlots(uint32_t);
+static size_t ControllerSize(uint32_t);
+static void IndexDisk(Context*, uint8_t);
+static void InsertDiskArray(Context*, u765_Controller*, uint8_t, char const*);
+static void WriteDiskRange(Context*, uint32_t, uint32_t, uint8_t const*);
+static void FoldTrackCopies(u765_DiskUnit*);
+static bool DeferTrackWrite(u765_DiskUnit*, uint32_t);
+static void WritePendingTracks(u765_SharedDisk*);
+static void MapDiskFile(Context*);
+static void FreeDiskArray(Context*);
+static void FindCachedImage(Context*, char const*, struct stat const*);
+static void CacheImage(Context*, char const*, struct stat const*);
+static void UncacheImage(u765_SharedDisk*);
+static uint32_t DiskFileFormat(Context*);
+static bool DecodeDiskFile(Context*, uint32_t);
+static bool DecodeReserve(DecodeStream*, size_t);
+static bool InflateGzip(DecodeStream*);
+static bool StartAsyncInsert(u765_AsyncInsert*);
+static void LoadAsyncInsert(u765_AsyncInsert*);
+static void PollAsyncInserts(u765_Controller*);
+static void DropAsyncInsert(u765_Controller*, uint32_t);
+static void FreeAsyncInsert(u765_AsyncInsert*);
+static void FreeDiskIndex(Context*);
+static void IndexSectors(u765_DiskUnit*);
+static void FormatCurrTrack(Context*);
+static void ScanCompare(u765_Controller*);
+static uint8_t* TrackData(u765_DiskUnit*, u765_TrackIndex*);
+static uint8_t* WritableTrackData(u765_DiskUnit*, u765_TrackIndex*);
+static void CopyTrackImage(u765_DiskUnit*, u765_TrackIndex*, uint8_t const*, uint8_t*, uint32_t);
+static u765_TrackInfoBlock* UnitTrackBlock(u765_DiskUnit*);
+static bool CloneBuffers(u765_Controller*, u765_Controller*);
+static void FreeBuffers(u765_Controller*);
+static bool CloneDiskUnits(u765_Controller*, u765_Controller*);
+static uint32_t SendDataBlock(Context*, uint8_t*, uint32_t);
+static uint32_t ReceiveDataBlock(Context*, uint8_t const*, uint32_t);
+static void OfferSectors(u765_Controller*);
+static void StateController(StateStream*, u765_Controller*, uint32_t);
+static uint8_t LabelStatusRead(u765_Controller*);
+static uint8_t LabelDataRead(u765_Controller*);
+static void LabelDataWrite(u765_Controller*, uint8_t);
+static uint8_t DirectStatusRead(u765_Controller*);
+static uint8_t DirectDataRead(u765_Controller*);
+static void DirectDataWrite(u765_Controller*, uint8_t);
+static void TraceRecord(u765_Controller*, uint8_t);
+static void TraceByte(u765_Controller*, uint8_t, uint8_t);
+static void TraceNumber(u765_Controller*, uint64_t);
+static void TraceBytes(u765_Controller*, void const*, uint32_t);
+static void TraceInsert(u765_Controller*, uint8_t);
 static void run(Context*, unsigned);
 
+#ifdef U765_STATS
+// nanoseconds since some fixed point in the past
+static uint64_t StatsNow(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)count.QuadPart / frequency.QuadPart * 1000000000 + (uint64_t)count.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void U765_FUNCTION(u765_GetStats)(u765_Controller* FdcHandle, u765_Stats* lpStats) {
+    memcpy(lpStats, &FdcHandle->Stats, sizeof(u765_Stats));
+}
+
+void U765_FUNCTION(u765_ResetStats)(u765_Controller* FdcHandle) {
+    memset(&FdcHandle->Stats, 0, sizeof(u765_Stats));
+}
+#endif
+
 void U765_FUNCTION(u765_SetRandomMethod)(u765_Controller* FdcHandle, uint8_t RndMethod) {
     Context ctx;
     ctx.esp.e = 0;
@@ -101,6 +328,10 @@ void U765_FUNCTION(u765_SetRandomMethod)(u765_Controller* FdcHandle, uint8_t Rnd
     if ((ctx.eax.l == 255) || (ctx.eax.l <= 2)) {
         ctx.ecx.ctrl->DskRndMethod = ctx.eax.l;
     }
+
+    if (ctx.ecx.ctrl->TraceFile != NULL) {
+        TraceByte(ctx.ecx.ctrl, u765_TraceRandomMethod, RndMethod);
+    }
 }
 
 void U765_FUNCTION(u765_SetActiveCallback)(u765_Controller* FdcHandle, void (*lpActiveCallback)(void)) {
@@ -109,6 +340,17 @@ void U765_FUNCTION(u765_SetActiveCallback)(u765_Controller* FdcHandle, void (*lp
 
     ctx.eax.ctrl = FdcHandle;
     ctx.eax.ctrl->ActiveCallback = lpActiveCallback;
+    ctx.eax.ctrl->ActiveCallbackEx = NULL;
+}
+
+void U765_FUNCTION(u765_SetActiveCallbackEx)(u765_Controller* FdcHandle, void (*lpActiveCallback)(void*), void* User) {
+    Context ctx;
+    ctx.esp.e = 0;
+
+    ctx.eax.ctrl = FdcHandle;
+    ctx.eax.ctrl->ActiveCallback = NULL;
+    ctx.eax.ctrl->ActiveCallbackEx = lpActiveCallback;
+    ctx.eax.ctrl->ActiveUser = User;
 }
 
 void U765_FUNCTION(u765_SetCommandCallback)(u765_Controller* FdcHandle, void (*lpCommandCallback)(uint8_t const*, uint8_t)) {
@@ -117,6 +359,46 @@ void U765_FUNCTION(u765_SetCommandCallback)(u765_Controller* FdcHandle, void (*l
 
     ctx.eax.ctrl = FdcHandle;
     ctx.eax.ctrl->CommandCallback = lpCommandCallback;
+    ctx.eax.ctrl->CommandCallbackEx = NULL;
+}
+
+void U765_FUNCTION(u765_SetCommandCallbackEx)(u765_Controller* FdcHandle, void (*lpCommandCallback)(void*, uint8_t const*, uint8_t), void* User) {
+    Context ctx;
+    ctx.esp.e = 0;
+
+    ctx.eax.ctrl = FdcHandle;
+    ctx.eax.ctrl->CommandCallback = NULL;
+    ctx.eax.ctrl->CommandCallbackEx = lpCommandCallback;
+    ctx.eax.ctrl->CommandUser = User;
+}
+
+void U765_FUNCTION(u765_SetWriteBackCallback)(u765_Controller* FdcHandle, void (*lpWriteBackCallback)(uint8_t, void const*, size_t)) {
+    Context ctx;
+    ctx.esp.e = 0;
+
+    ctx.eax.ctrl = FdcHandle;
+    ctx.eax.ctrl->WriteBackCallback = lpWriteBackCallback;
+    ctx.eax.ctrl->WriteBackCallbackEx = NULL;
+}
+
+void U765_FUNCTION(u765_SetWriteBackCallbackEx)(u765_Controller* FdcHandle, void (*lpWriteBackCallback)(void*, uint8_t, void const*, size_t), void* User) {
+    Context ctx;
+    ctx.esp.e = 0;
+
+    ctx.eax.ctrl = FdcHandle;
+    ctx.eax.ctrl->WriteBackCallback = NULL;
+    ctx.eax.ctrl->WriteBackCallbackEx = lpWriteBackCallback;
+    ctx.eax.ctrl->WriteBackUser = User;
+}
+
+void U765_FUNCTION(u765_SetSectorCallback)(u765_Controller* FdcHandle, uint32_t (*lpSectorCallback)(void*, uint8_t*, uint32_t, bool), void* User) {
+    Context ctx;
+    ctx.esp.e = 0;
+
+    ctx.eax.ctrl = FdcHandle;
+    ctx.eax.ctrl->SectorCallback = lpSectorCallback;
+    ctx.eax.ctrl->SectorUser = User;
+    ctx.eax.ctrl->TransferRunOffered = ctx.eax.ctrl->TransferRun;  // from the next transfer on
 }
 
 void U765_FUNCTION(u765_SetMotorState)(u765_Controller* FdcHandle, uint8_t Value) {
@@ -141,6 +423,10 @@ void U765_FUNCTION(u765_SetMotorState)(u765_Controller* FdcHandle, uint8_t Value
 
     ctx.eax.l = ctx.ecx.ctrl->NewMotorState;
     ctx.ecx.ctrl->MotorState = ctx.eax.l;
+
+    if (ctx.ecx.ctrl->TraceFile != NULL) {
+        TraceByte(ctx.ecx.ctrl, u765_TraceMotorState, Value);
+    }
 }
 
 bool U765_FUNCTION(u765_GetMotorState)(u765_Controller* FdcHandle) {
@@ -152,6 +438,30 @@ bool U765_FUNCTION(u765_GetMotorState)(u765_Controller* FdcHandle) {
 }
 
 uint8_t U765_FUNCTION(u765_StatusPortRead)(u765_Controller* FdcHandle) {
+    uint8_t value;
+
+    if (FdcHandle->AsyncUnits != 0) {
+        PollAsyncInserts(FdcHandle);
+    }
+
+    STAT_START(FdcHandle);
+
+    if (FdcHandle->Engine == u765_EngineDirect) {
+        value = DirectStatusRead(FdcHandle);
+    }
+    else {
+        value = LabelStatusRead(FdcHandle);
+    }
+
+    if (FdcHandle->TraceFile != NULL) {
+        TraceByte(FdcHandle, u765_TraceStatusRead, value);
+    }
+
+    STAT_END(FdcHandle);
+    return value;
+}
+
+static uint8_t LabelStatusRead(u765_Controller* FdcHandle) {
     Context ctx;
     ctx.esp.e = 0;
 
@@ -161,6 +471,7 @@ uint8_t U765_FUNCTION(u765_StatusPortRead)(u765_Controller* FdcHandle) {
         if (ctx.edi.ctrl->OverRunCounter == 0) {
             ctx.edi.ctrl->OverRunTest = false;
             ctx.edi.ctrl->OverRunError = true;
+            STAT(ctx.edi.ctrl, OverRuns, 1);
 
             // pushad
             // mov     eax, [edi].FDCReturn
@@ -190,6 +501,39 @@ uint8_t U765_FUNCTION(u765_StatusPortRead)(u765_Controller* FdcHandle) {
 }
 
 uint8_t U765_FUNCTION(u765_DataPortRead)(u765_Controller* FdcHandle) {
+    uint8_t value;
+
+    if (FdcHandle->AsyncUnits != 0) {
+        PollAsyncInserts(FdcHandle);
+    }
+
+    STAT_START(FdcHandle);
+
+    if ((FdcHandle->MainStatusReg & 0x20) != 0) {
+        STAT(FdcHandle, Bytes, 1);
+    }
+
+    if (FdcHandle->Engine == u765_EngineDirect) {
+        value = DirectDataRead(FdcHandle);
+    }
+    else {
+        value = LabelDataRead(FdcHandle);
+    }
+
+    if (FdcHandle->TraceFile != NULL) {
+        TraceByte(FdcHandle, u765_TraceDataRead, value);
+    }
+
+    STAT_END(FdcHandle);
+
+    if (FdcHandle->SectorCallback != NULL) {
+        OfferSectors(FdcHandle);
+    }
+
+    return value;
+}
+
+static uint8_t LabelDataRead(u765_Controller* FdcHandle) {
     Context ctx;
     ctx.esp.e = 0;
     ctx.edi.ctrl = FdcHandle;
@@ -206,7 +550,66 @@ uint8_t U765_FUNCTION(u765_DataPortRead)(u765_Controller* FdcHandle) {
     return ctx.eax.l;
 }
 
+uint32_t U765_FUNCTION(u765_DataPortReadBlock)(u765_Controller* FdcHandle, uint8_t* lpBuffer, uint32_t MaxLen) {
+    Context ctx;
+    ctx.esp.e = 0;
+    ctx.edi.ctrl = FdcHandle;
+
+    if (FdcHandle->AsyncUnits != 0) {
+        PollAsyncInserts(FdcHandle);
+    }
+
+    STAT_START(FdcHandle);
+
+    uint32_t len = SendDataBlock(&ctx, lpBuffer, MaxLen);
+    STAT(FdcHandle, Bytes, len);
+
+    if (FdcHandle->TraceFile != NULL) {
+        TraceRecord(FdcHandle, u765_TraceDataReadBlock);
+        TraceNumber(FdcHandle, MaxLen);
+        TraceNumber(FdcHandle, len);
+        TraceBytes(FdcHandle, lpBuffer, len);
+    }
+
+    STAT_END(FdcHandle);
+
+    if (FdcHandle->SectorCallback != NULL) {
+        OfferSectors(FdcHandle);
+    }
+
+    return len;
+}
+
 void U765_FUNCTION(u765_DataPortWrite)(u765_Controller* FdcHandle, uint8_t DataByte) {
+    if (FdcHandle->AsyncUnits != 0) {
+        PollAsyncInserts(FdcHandle);
+    }
+
+    STAT_START(FdcHandle);
+
+    if ((FdcHandle->MainStatusReg & 0x20) != 0) {
+        STAT(FdcHandle, Bytes, 1);
+    }
+
+    if (FdcHandle->Engine == u765_EngineDirect) {
+        DirectDataWrite(FdcHandle, DataByte);
+    }
+    else {
+        LabelDataWrite(FdcHandle, DataByte);
+    }
+
+    if (FdcHandle->TraceFile != NULL) {
+        TraceByte(FdcHandle, u765_TraceDataWrite, DataByte);
+    }
+
+    STAT_END(FdcHandle);
+
+    if (FdcHandle->SectorCallback != NULL) {
+        OfferSectors(FdcHandle);
+    }
+}
+
+static void LabelDataWrite(u765_Controller* FdcHandle, uint8_t DataByte) {
     Context ctx;
     ctx.esp.e = 0;
     ctx.edi.ctrl = FdcHandle;
@@ -224,13 +627,63 @@ void U765_FUNCTION(u765_DataPortWrite)(u765_Controller* FdcHandle, uint8_t DataB
     }
 }
 
+uint32_t U765_FUNCTION(u765_DataPortWriteBlock)(u765_Controller* FdcHandle, uint8_t const* lpBuffer, uint32_t Len) {
+    Context ctx;
+    ctx.esp.e = 0;
+    ctx.edi.ctrl = FdcHandle;
+
+    if (FdcHandle->AsyncUnits != 0) {
+        PollAsyncInserts(FdcHandle);
+    }
+
+    STAT_START(FdcHandle);
+
+    uint32_t len = ReceiveDataBlock(&ctx, lpBuffer, Len);
+    STAT(FdcHandle, Bytes, len);
+
+    if (FdcHandle->TraceFile != NULL) {
+        TraceRecord(FdcHandle, u765_TraceDataWriteBlock);
+        TraceNumber(FdcHandle, Len);
+        TraceNumber(FdcHandle, len);
+        TraceBytes(FdcHandle, lpBuffer, Len);
+    }
+
+    STAT_END(FdcHandle);
+
+    if (FdcHandle->SectorCallback != NULL) {
+        OfferSectors(FdcHandle);
+    }
+
+    return len;
+}
+
 u765_Controller* U765_FUNCTION(u765_Initialise)(void) {
+    return u765_InitialiseEx(u765_EngineDefault);
+}
+
+u765_Controller* U765_FUNCTION(u765_InitialiseEx)(uint32_t Engine) {
+    return u765_InitialiseUnits(Engine, 2);
+}
+
+u765_Controller* U765_FUNCTION(u765_InitialiseUnits)(uint32_t Engine, uint32_t NumUnits) {
     Context ctx;
+    uint32_t Unit;
     ctx.esp.e = 0;
 
-    ctx.eax.ctrl = (u765_Controller*)calloc(sizeof(u765_Controller), 1);
+    if (NumUnits < 1 || NumUnits > 4) {
+        NumUnits = 2;
+    }
+
+    ctx.eax.ctrl = (u765_Controller*)calloc(ControllerSize(NumUnits), 1);
 
     if (ctx.eax.ctrl != NULL) {
+        ctx.eax.ctrl->Engine = Engine <= u765_EngineDirect ? (uint8_t)Engine : u765_EngineDefault;
+        ctx.eax.ctrl->NumUnits = (uint8_t)NumUnits;
+
+        for (Unit = 0; Unit < UnitSlots(NumUnits); Unit++) {
+            ctx.eax.ctrl->FDDUnit[Unit].TrackBlock = &EmptyTrackBlock;
+        }
+
         LowLevelInitialise(&ctx, ctx.eax.ctrl);
     }
 
@@ -238,21 +691,67 @@ u765_Controller* U765_FUNCTION(u765_Initialise)(void) {
 }
 
 void U765_FUNCTION(u765_Shutdown)(u765_Controller* FdcHandle) {
-    u765_EjectDisk(FdcHandle, 0);
-    u765_EjectDisk(FdcHandle, 1);
+    uint8_t Unit;
+
+    u765_StopTrace(FdcHandle);
+
+    for (Unit = 0; Unit < FdcHandle->NumUnits; Unit++) {
+        u765_EjectDisk(FdcHandle, Unit);
+    }
+
+    FreeBuffers(FdcHandle);
     free(FdcHandle);
 }
 
+u765_Controller* U765_FUNCTION(u765_Clone)(u765_Controller* FdcHandle) {
+    Context ctx;
+    ctx.esp.e = 0;
+
+    ctx.eax.ctrl = (u765_Controller*)malloc(ControllerSize(FdcHandle->NumUnits));
+
+    if (ctx.eax.ctrl == NULL) {
+        return NULL;
+    }
+
+    memcpy(ctx.eax.ctrl, FdcHandle, ControllerSize(FdcHandle->NumUnits));
+    memset(ctx.eax.ctrl->AsyncInserts, 0, sizeof(ctx.eax.ctrl->AsyncInserts));
+    ctx.eax.ctrl->AsyncUnits = 0;       // disks still loading only go to the original
+    ctx.eax.ctrl->TraceFile = NULL;     // the trace stays with the original
+    ctx.eax.ctrl->TraceBuffer = NULL;
+
+    if (!CloneBuffers(FdcHandle, ctx.eax.ctrl)) {
+        free(ctx.eax.ctrl);
+        return NULL;
+    }
+
+    if (!CloneDiskUnits(FdcHandle, ctx.eax.ctrl)) {
+        FreeBuffers(ctx.eax.ctrl);
+        free(ctx.eax.ctrl);
+        return NULL;
+    }
+
+    return ctx.eax.ctrl;
+}
+
 void U765_FUNCTION(u765_ResetDevice)(u765_Controller* FdcHandle) {
     Context ctx;
     ctx.esp.e = 0;
 
     ctx.eax.ctrl = FdcHandle;
     LowLevelInitialise(&ctx, ctx.eax.ctrl);
+
+    if (FdcHandle->TraceFile != NULL) {
+        TraceRecord(FdcHandle, u765_TraceResetDevice);
+    }
 }
 
 void U765_FUNCTION(u765_InsertDisk)(u765_Controller* FdcHandle, char const* lpFilename, uint8_t Unit) {
+    u765_InsertDiskEx(FdcHandle, lpFilename, Unit, u765_InsertDefault);
+}
+
+void U765_FUNCTION(u765_InsertDiskEx)(u765_Controller* FdcHandle, char const* lpFilename, uint8_t Unit, uint32_t Flags) {
     Context ctx;
+    uint32_t Format;
     ctx.esp.e = 0;
 
     ctx.edi.ctrl = FdcHandle;
@@ -262,13 +761,17 @@ void U765_FUNCTION(u765_InsertDisk)(u765_Controller* FdcHandle, char const* lpFi
     GetUnitPtr(&ctx, Unit);
     ctx.ebx = ctx.eax;
 
+    if (!UnitPresent(FdcHandle, ctx.ebx.disk)) {
+        return;
+    }
+
     ctx.ebx.disk->EDSK = false;
     ctx.ebx.disk->DiskInserted = false;
     ctx.ebx.disk->ContentsChanged = false;
 
     ctx.ebx.disk->WriteProtect = false;
 
-    ctx.eax.fp = fopen(lpFilename, "r+b");
+    ctx.eax.fp = (Flags & u765_InsertWriteProtect) == 0 ? fopen(lpFilename, "r+b") : NULL;
 
     if (ctx.eax.fp == NULL) {
         ctx.ebx.disk->WriteProtect = true;
@@ -290,100 +793,399 @@ void U765_FUNCTION(u765_InsertDisk)(u765_Controller* FdcHandle, char const* lpFi
     }
 
     ctx.ebx.disk->DiskArrayLen = buf.st_size;
-    ctx.ebx.disk->DiskArrayPtr = calloc(1, buf.st_size);
+    ctx.ebx.disk->DiskArrayPtr = NULL;
+    Format = DiskFileFormat(&ctx);
 
-    if (ctx.ebx.disk->DiskArrayPtr == NULL) {
+    // the Disk-Info block is copied unconditionally on insert, decoded images are checked for
+    // it once they're decoded
+    if (Format == ImagePlain && ctx.ebx.disk->DiskArrayLen < sizeof(u765_DiskInfoBlock)) {
         u765_EjectDisk(FdcHandle, Unit);
         return;
     }
 
-    size_t const numread = fread(ctx.ebx.disk->DiskArrayPtr, 1, ctx.ebx.disk->DiskArrayLen, ctx.ebx.disk->DiskFileHandle);
+    if ((Flags & u765_InsertCached) != 0) {
+        FindCachedImage(&ctx, lpFilename, &buf);
+    }
+    else if ((Flags & u765_InsertMapped) != 0 && Format == ImagePlain) {
+        MapDiskFile(&ctx);  // falls back to reading the file if it can't be mapped
+    }
+
+    if (ctx.ebx.disk->DiskArrayPtr == NULL && Format != ImagePlain) {
+        if (!DecodeDiskFile(&ctx, Format)) {
+            u765_EjectDisk(FdcHandle, Unit);
+            return;
+        }
 
-    if (numread != ctx.ebx.disk->DiskArrayLen) {
-        u765_EjectDisk(FdcHandle, Unit);
-        return;
+        if ((Flags & u765_InsertCached) != 0) {
+            CacheImage(&ctx, lpFilename, &buf);
+        }
     }
 
-    ctx.ebx.disk->DiskInserted = true;
-    ctx.ebx.disk->DriveStateChanged = true;
+    if (ctx.ebx.disk->DiskArrayPtr == NULL) {
+        ctx.ebx.disk->DiskArrayPtr = malloc(buf.st_size);
+
+        if (ctx.ebx.disk->DiskArrayPtr == NULL) {
+            u765_EjectDisk(FdcHandle, Unit);
+            return;
+        }
 
-    ctx.eax.u8 = ctx.ebx.disk->DiskArrayPtr;
+        size_t const numread = fread(ctx.ebx.disk->DiskArrayPtr, 1, ctx.ebx.disk->DiskArrayLen, ctx.ebx.disk->DiskFileHandle);
+
+        if (numread != ctx.ebx.disk->DiskArrayLen) {
+            u765_EjectDisk(FdcHandle, Unit);
+            return;
+        }
 
-    if (*ctx.eax.u8 == 'E') {
-        EDsk2Dsk(&ctx, Unit);
+        if ((Flags & u765_InsertCached) != 0) {
+            CacheImage(&ctx, lpFilename, &buf);
+        }
     }
 
-    Context ad = ctx;
-    ctx.esi.ptr = ctx.ebx.disk->DiskArrayPtr;
-    ctx.edi.ptr = ctx.ebx.disk->DiskBlock.DiskInfoBlock;
-    ctx.ecx.e = 256 / 4;
-    rep_movsd(&ctx);
+    if (Format != ImagePlain) {
+        // never written back compressed, the changes go to the write-back callback instead
+        fclose(ctx.ebx.disk->DiskFileHandle);
+        ctx.ebx.disk->DiskFileHandle = NULL;
+    }
 
-    // copy filename into Unit structure
-    ctx.esi.u8 = (uint8_t*)lpFilename;
-    ctx.edi.u8 = (uint8_t*)ctx.ebx.disk->Filename;
-loop:
-    ctx.eax.l = *ctx.esi.u8++;
-    *ctx.edi.u8++ = ctx.eax.l;
-    OR(&ctx, ctx.eax.l, ctx.eax.l);
-    JNE(&ctx, loop);
-    ctx = ad;
+    InsertDiskArray(&ctx, FdcHandle, Unit, lpFilename);
 
-    ctx.ebx.disk->ContentsChanged = false;
-    LowLevelInitialise(&ctx, FdcHandle);
+    if (FdcHandle->TraceFile != NULL) {
+        TraceInsert(FdcHandle, Unit);
+    }
 }
 
-void U765_FUNCTION(u765_EjectDisk)(u765_Controller* FdcHandle, uint8_t Unit) {
+void U765_FUNCTION(u765_InsertDiskFromMemory)(u765_Controller* FdcHandle, void const* lpData, size_t Len, uint8_t Unit, uint32_t Flags) {
     Context ctx;
     ctx.esp.e = 0;
 
     ctx.edi.ctrl = FdcHandle;
 
+    u765_EjectDisk(ctx.edi.ctrl, Unit); // close any open disk on this unit
+
     GetUnitPtr(&ctx, Unit);
     ctx.ebx = ctx.eax;
 
-    if (ctx.ebx.disk->DiskFileHandle != NULL) {
-        WriteCurrentDisk(&ctx, FdcHandle, Unit);
+    if (!UnitPresent(FdcHandle, ctx.ebx.disk)) {
+        return;
+    }
+
+    ctx.ebx.disk->EDSK = false;
+    ctx.ebx.disk->DiskInserted = false;
+    ctx.ebx.disk->ContentsChanged = false;
+    ctx.ebx.disk->DiskFileHandle = NULL;
+
+    // the Disk-Info block is copied unconditionally below
+    if (lpData == NULL || Len < sizeof(u765_DiskInfoBlock)) {
+        return;
+    }
+
+    ctx.ebx.disk->WriteProtect = (Flags & u765_InsertWriteProtect) != 0;
+    ctx.ebx.disk->DiskArrayLen = Len;
+
+    if ((Flags & u765_InsertBorrow) != 0) {
+        // the buffer is const and stays the application's, tracks are copied before being written
+        ctx.ebx.disk->DiskArrayPtr = (void*)lpData;
+        ctx.ebx.disk->DiskBorrowed = true;
+    }
+    else {
+        ctx.ebx.disk->DiskArrayPtr = malloc(Len);
 
-        if (ctx.ebx.disk->DiskArrayPtr != NULL) {
-            free(ctx.ebx.disk->DiskArrayPtr);
-            ctx.ebx.disk->DiskArrayPtr = NULL;
+        if (ctx.ebx.disk->DiskArrayPtr == NULL) {
+            return;
         }
 
-        fclose(ctx.ebx.disk->DiskFileHandle);
-        ctx.ebx.disk->DiskFileHandle = NULL;
-        ctx.ebx.disk->DiskInserted = false;
+        memcpy(ctx.ebx.disk->DiskArrayPtr, lpData, Len);
     }
 
-    LowLevelInitialise(&ctx, FdcHandle);
+    InsertDiskArray(&ctx, FdcHandle, Unit, "");
+
+    if (FdcHandle->TraceFile != NULL) {
+        TraceInsert(FdcHandle, Unit);
+    }
 }
 
-bool U765_FUNCTION(u765_DiskInserted)(u765_Controller* FdcHandle, uint8_t Unit) {
+void U765_FUNCTION(u765_InsertDiskAsync)(u765_Controller* FdcHandle, char const* lpFilename, uint8_t Unit, uint32_t Flags, void (*Callback)(void*, uint8_t, bool), void* User) {
     Context ctx;
+    u765_AsyncInsert* load;
+    uint32_t Slot;
     ctx.esp.e = 0;
 
     ctx.edi.ctrl = FdcHandle;
 
+    u765_EjectDisk(ctx.edi.ctrl, Unit); // close any open disk on this unit, or drop the one loading
+
     GetUnitPtr(&ctx, Unit);
-    ctx.ebx = ctx.eax;
 
-    // lea     eax, [ebx].TFDDUnit.Filename
-    // invoke  SetLastError, eax
+    if (!UnitPresent(FdcHandle, ctx.eax.disk)) {
+        return;
+    }
 
-    ctx.eax.e = ctx.ebx.disk->DiskInserted;
-    return ctx.eax.e != 0;    // true if disk inserted, else false
-}
+    Slot = (uint32_t)(ctx.eax.disk - FdcHandle->FDDUnit);
+    load = (u765_AsyncInsert*)malloc(sizeof(u765_AsyncInsert) + strlen(lpFilename) + 1);
 
-void U765_FUNCTION(u765_GetFDCState)(u765_Controller* FdcHandle, u765_State* lpFDCState) {
-    Context ctx;
-    ctx.esp.e = 0;
+    if (load == NULL || (load->Loader = u765_InitialiseUnits(u765_EngineDefault, 1)) == NULL) {
+        free(load);
 
-    ctx.ecx.ctrl = FdcHandle;
-    ctx.edx.stat = lpFDCState;
+        if (Callback != NULL) {
+            Callback(User, Unit, false);
+        }
 
-    ctx.eax.l = ctx.ecx.ctrl->MainStatusReg;
-    ctx.edx.stat->MSR = ctx.eax.l;
-    ctx.eax.l = ctx.ecx.ctrl->ST0;
+        return;
+    }
+
+    load->State = AsyncLoading;
+    load->Flags = Flags;
+    load->Unit = Unit;
+    load->Callback = Callback;
+    load->User = User;
+    strcpy(load->Filename, lpFilename);
+
+    FdcHandle->AsyncInserts[Slot] = load;
+    FdcHandle->AsyncUnits |= 1 << Slot;
+
+    if (!StartAsyncInsert(load)) {
+        LoadAsyncInsert(load);  // no thread to spare, the disk is loaded right away
+    }
+}
+
+void U765_FUNCTION(u765_SetImageDecoder)(u765_ImageDecoder Decoder, void* User) {
+    ImageDecoder = Decoder;
+    ImageDecoderUser = User;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI AsyncInsertThread(LPVOID Arg) {
+    LoadAsyncInsert((u765_AsyncInsert*)Arg);
+    return 0;
+}
+#else
+static void* AsyncInsertThread(void* Arg) {
+    LoadAsyncInsert((u765_AsyncInsert*)Arg);
+    return NULL;
+}
+#endif
+
+// runs LoadAsyncInsert on a thread nobody waits for, false if none could be started
+static bool StartAsyncInsert(u765_AsyncInsert* load) {
+#ifdef _WIN32
+    HANDLE thread = CreateThread(NULL, 0, AsyncInsertThread, load, 0, NULL);
+
+    if (thread == NULL) {
+        return false;
+    }
+
+    CloseHandle(thread);
+#else
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, AsyncInsertThread, load) != 0) {
+        return false;
+    }
+
+    pthread_detach(thread);
+#endif
+    return true;
+}
+
+// the worker's part, the loader is only touched by the worker until it's handed over
+static void LoadAsyncInsert(u765_AsyncInsert* load) {
+    u765_InsertDiskEx(load->Loader, load->Filename, 0, load->Flags);
+
+    if (ATOMIC_XCHG(load->State, AsyncLoaded) == AsyncDropped) {
+        FreeAsyncInsert(load);
+    }
+}
+
+// moves the disks loaded since the last call into their units, where they are inserted as
+// u765_InsertDiskEx inserts them. A command running is left to end first
+static void PollAsyncInserts(u765_Controller* ctrl) {
+    u765_AsyncInsert* load;
+    u765_DiskUnit* unit;
+    u765_DiskUnit* loaded;
+    u765_DiskUnit empty;
+    uint32_t Slot;
+    bool Inserted;
+    Context ctx;
+    ctx.esp.e = 0;
+
+    if ((ctrl->MainStatusReg & 0x10) != 0) {
+        return;
+    }
+
+    for (Slot = 0; Slot < 4; Slot++) {
+        load = ctrl->AsyncInserts[Slot];
+
+        if (load == NULL || REF_GET(load->State) != AsyncLoaded) {
+            continue;
+        }
+
+        ctrl->AsyncInserts[Slot] = NULL;
+        ctrl->AsyncUnits &= ~(1 << Slot);
+
+        unit = &ctrl->FDDUnit[Slot];
+        loaded = &load->Loader->FDDUnit[0];
+        Inserted = loaded->DiskInserted;
+
+        if (Inserted) {
+            // the unit is empty but keeps its TrackBlock, which may still be pointed to
+            empty = *unit;
+            *unit = *loaded;
+
+            if (empty.TrackBlock != &EmptyTrackBlock) {
+                unit->TrackBlock = empty.TrackBlock;
+                empty.TrackBlock = loaded->TrackBlock;
+            }
+
+            *loaded = empty;
+
+            LowLevelInitialise(&ctx, ctrl);
+
+            if (ctrl->TraceFile != NULL) {
+                TraceInsert(ctrl, load->Unit);
+            }
+        }
+
+        if (load->Callback != NULL) {
+            load->Callback(load->User, load->Unit, Inserted);
+        }
+
+        FreeAsyncInsert(load);
+    }
+}
+
+// the unit at Slot was ejected or given another disk, the one loading is dropped
+static void DropAsyncInsert(u765_Controller* ctrl, uint32_t Slot) {
+    u765_AsyncInsert* load = ctrl->AsyncInserts[Slot];
+
+    ctrl->AsyncInserts[Slot] = NULL;
+    ctrl->AsyncUnits &= ~(1 << Slot);
+
+    // whoever sees the other side done frees it
+    if (ATOMIC_XCHG(load->State, AsyncDropped) == AsyncLoaded) {
+        FreeAsyncInsert(load);
+    }
+}
+
+static void FreeAsyncInsert(u765_AsyncInsert* load) {
+    u765_Shutdown(load->Loader);
+    free(load);
+}
+
+// completes an insert once the unit at ctx->ebx holds the disk image in DiskArrayPtr
+static void InsertDiskArray(Context* ctx, u765_Controller* FdcHandle, uint8_t Unit, char const* lpFilename) {
+    if (UnitTrackBlock(ctx->ebx.disk) == NULL) {
+        u765_EjectDisk(FdcHandle, Unit);
+        return;
+    }
+
+    ctx->ebx.disk->DiskInserted = true;
+    ctx->ebx.disk->DriveStateChanged = true;
+
+    ctx->eax.u8 = ctx->ebx.disk->DiskArrayPtr;
+
+    if (*ctx->eax.u8 == 'E') {
+        ctx->ebx.disk->EDSK = true;     // tracks are located through the track size table
+    }
+
+    Context ad = *ctx;
+    ctx->esi.ptr = ctx->ebx.disk->DiskArrayPtr;
+    ctx->edi.ptr = ctx->ebx.disk->DiskBlock.DiskInfoBlock;
+    ctx->ecx.e = 256 / 4;
+    rep_movsd(ctx);
+
+    // copy filename into Unit structure
+    ctx->esi.u8 = (uint8_t*)lpFilename;
+    ctx->edi.u8 = (uint8_t*)ctx->ebx.disk->Filename;
+loop:
+    ctx->eax.l = *ctx->esi.u8++;
+    *ctx->edi.u8++ = ctx->eax.l;
+    OR(ctx, ctx->eax.l, ctx->eax.l);
+    JNE(ctx, loop);
+    *ctx = ad;
+
+    IndexDisk(ctx, Unit);
+
+    // images that aren't the unit's own have no index to keep copies of the written tracks in
+    if ((ctx->ebx.disk->SharedDisk != NULL || ctx->ebx.disk->DiskBorrowed == true) && ctx->ebx.disk->TrackIndex == NULL) {
+        ctx->ebx.disk->WriteProtect = true;
+    }
+
+    ctx->ebx.disk->ContentsChanged = false;
+    ctx->ebx.disk->LayoutChanged = false;
+    LowLevelInitialise(ctx, FdcHandle);
+}
+
+void U765_FUNCTION(u765_FlushDisk)(u765_Controller* FdcHandle, uint8_t Unit) {
+    Context ctx;
+    ctx.esp.e = 0;
+
+    WriteCurrentDisk(&ctx, FdcHandle, Unit, false);
+}
+
+void U765_FUNCTION(u765_EjectDisk)(u765_Controller* FdcHandle, uint8_t Unit) {
+    Context ctx;
+    ctx.esp.e = 0;
+
+    ctx.edi.ctrl = FdcHandle;
+
+    GetUnitPtr(&ctx, Unit);
+    ctx.ebx = ctx.eax;
+
+    if (FdcHandle->AsyncInserts[ctx.ebx.disk - FdcHandle->FDDUnit] != NULL) {
+        DropAsyncInsert(FdcHandle, (uint32_t)(ctx.ebx.disk - FdcHandle->FDDUnit));
+    }
+
+    if (ctx.ebx.disk->DiskFileHandle != NULL || ctx.ebx.disk->DiskArrayPtr != NULL) {
+        WriteCurrentDisk(&ctx, FdcHandle, Unit, true);
+        FreeDiskArray(&ctx);
+
+        if (ctx.ebx.disk->DiskFileHandle != NULL) {
+            fclose(ctx.ebx.disk->DiskFileHandle);
+            ctx.ebx.disk->DiskFileHandle = NULL;
+        }
+
+        ctx.ebx.disk->DiskInserted = false;
+    }
+
+    FreeDiskIndex(&ctx);
+
+    LowLevelInitialise(&ctx, FdcHandle);
+
+    if (FdcHandle->TraceFile != NULL) {
+        TraceByte(FdcHandle, u765_TraceEjectDisk, Unit);
+    }
+}
+
+bool U765_FUNCTION(u765_DiskInserted)(u765_Controller* FdcHandle, uint8_t Unit) {
+    Context ctx;
+    ctx.esp.e = 0;
+
+    ctx.edi.ctrl = FdcHandle;
+
+    if (FdcHandle->AsyncUnits != 0) {
+        PollAsyncInserts(FdcHandle);
+    }
+
+    GetUnitPtr(&ctx, Unit);
+    ctx.ebx = ctx.eax;
+
+    // lea     eax, [ebx].TFDDUnit.Filename
+    // invoke  SetLastError, eax
+
+    ctx.eax.e = ctx.ebx.disk->DiskInserted;
+    return ctx.eax.e != 0;    // true if disk inserted, else false
+}
+
+void U765_FUNCTION(u765_GetFDCState)(u765_Controller* FdcHandle, u765_State* lpFDCState) {
+    Context ctx;
+    ctx.esp.e = 0;
+
+    ctx.ecx.ctrl = FdcHandle;
+    ctx.edx.stat = lpFDCState;
+
+    ctx.eax.l = ctx.ecx.ctrl->MainStatusReg;
+    ctx.edx.stat->MSR = ctx.eax.l;
+    ctx.eax.l = ctx.ecx.ctrl->ST0;
     ctx.edx.stat->ST0 = ctx.eax.l;
     ctx.eax.l = ctx.ecx.ctrl->ST1;
     ctx.edx.stat->ST1 = ctx.eax.l;
@@ -392,21 +1194,162 @@ void U765_FUNCTION(u765_GetFDCState)(u765_Controller* FdcHandle, u765_State* lpF
     ctx.eax.l = ctx.ecx.ctrl->ST3;
     ctx.edx.stat->ST3 = ctx.eax.l;
 
-    ctx.eax.l = ctx.ecx.ctrl->FDDUnit0.CTK;
+    ctx.eax.l = ctx.ecx.ctrl->FDDUnit[0].CTK;
     ctx.edx.stat->Unit0_CTRK = ctx.eax.l;
-    ctx.eax.l = ctx.ecx.ctrl->FDDUnit0.CHEAD;
+    ctx.eax.l = ctx.ecx.ctrl->FDDUnit[0].CHEAD;
     ctx.edx.stat->Unit0_CHEAD = ctx.eax.l;
-    ctx.eax.l = ctx.ecx.ctrl->FDDUnit0.CSR;
+    ctx.eax.l = ctx.ecx.ctrl->FDDUnit[0].CSR;
     ctx.edx.stat->Unit0_CSR = ctx.eax.l;
 
-    ctx.eax.l = ctx.ecx.ctrl->FDDUnit1.CTK;
+    // every controller has at least 2 unit structures, the second may be the spare one
+    ctx.eax.l = ctx.ecx.ctrl->FDDUnit[1].CTK;
     ctx.edx.stat->Unit1_CTRK = ctx.eax.l;
-    ctx.eax.l = ctx.ecx.ctrl->FDDUnit1.CHEAD;
+    ctx.eax.l = ctx.ecx.ctrl->FDDUnit[1].CHEAD;
     ctx.edx.stat->Unit1_CHEAD = ctx.eax.l;
-    ctx.eax.l = ctx.ecx.ctrl->FDDUnit1.CSR;
+    ctx.eax.l = ctx.ecx.ctrl->FDDUnit[1].CSR;
     ctx.edx.stat->Unit1_CSR = ctx.eax.l;
 }
 
+void U765_FUNCTION(u765_GetFDCStateEx)(u765_Controller* FdcHandle, u765_StateEx* lpFDCState) {
+    uint32_t Unit;
+
+    memset(lpFDCState, 0, sizeof(u765_StateEx));
+    lpFDCState->MSR = FdcHandle->MainStatusReg;
+    lpFDCState->ST0 = FdcHandle->ST0;
+    lpFDCState->ST1 = FdcHandle->ST1;
+    lpFDCState->ST2 = FdcHandle->ST2;
+    lpFDCState->ST3 = FdcHandle->ST3;
+    lpFDCState->NumUnits = FdcHandle->NumUnits;
+
+    for (Unit = 0; Unit < FdcHandle->NumUnits; Unit++) {
+        lpFDCState->CTRK[Unit] = FdcHandle->FDDUnit[Unit].CTK;
+        lpFDCState->CHEAD[Unit] = FdcHandle->FDDUnit[Unit].CHEAD;
+        lpFDCState->CSR[Unit] = FdcHandle->FDDUnit[Unit].CSR;
+    }
+}
+
+uint32_t U765_FUNCTION(u765_SaveState)(u765_Controller* FdcHandle, uint8_t* lpBuffer, uint32_t MaxLen, uint32_t Flags) {
+    StateStream s;
+    s.Data = lpBuffer;
+    s.Pos = 0;
+    s.Len = lpBuffer != NULL ? MaxLen : 0;
+    s.Load = false;
+    s.Apply = false;
+    s.Ok = true;
+
+    StateController(&s, FdcHandle, Flags);
+    return s.Ok ? s.Pos : 0;
+}
+
+bool U765_FUNCTION(u765_LoadState)(u765_Controller* FdcHandle, uint8_t const* lpBuffer, uint32_t Len) {
+    StateStream s;
+    uint32_t Unit;
+    s.Data = (uint8_t*)lpBuffer;
+    s.Pos = 0;
+    s.Len = Len;
+    s.Load = true;
+    s.Apply = false;
+    s.Ok = true;
+
+    // check the whole state against a scratch copy first, so a bad state changes nothing
+    u765_Controller* scratch = (u765_Controller*)malloc(ControllerSize(FdcHandle->NumUnits));
+
+    if (scratch == NULL) {
+        return false;
+    }
+
+    // with buffers of its own, so the check writes nothing the controller is using
+    memcpy(scratch, FdcHandle, ControllerSize(FdcHandle->NumUnits));
+    scratch->FDCRandomData = NULL;
+    scratch->FDCScanData = NULL;
+    scratch->FDCFormatIDs = NULL;
+
+    for (Unit = 0; Unit < UnitSlots(FdcHandle->NumUnits); Unit++) {
+        scratch->FDDUnit[Unit].TrackBlock = &EmptyTrackBlock;
+    }
+
+    StateController(&s, scratch, 0);
+    FreeBuffers(scratch);
+    free(scratch);
+
+    if (s.Ok == false || s.Pos != Len) {
+        return false;
+    }
+
+    s.Pos = 0;
+    s.Apply = true;
+    StateController(&s, FdcHandle, 0);
+
+    if (FdcHandle->TraceFile != NULL) {
+        TraceRecord(FdcHandle, u765_TraceLoadState);
+        TraceNumber(FdcHandle, Len);
+        TraceBytes(FdcHandle, lpBuffer, Len);
+    }
+
+    return s.Ok;
+}
+
+bool U765_FUNCTION(u765_StartTrace)(u765_Controller* FdcHandle, char const* lpFilename, uint32_t Flags) {
+    uint8_t header[8] = { 'U', '7', 'T', 'R', 0, 0, (uint8_t)Flags, FdcHandle->NumUnits };
+    uint32_t len;
+    uint8_t* state;
+    uint8_t Unit;
+
+    u765_StopTrace(FdcHandle);
+
+    // the written tracks go with the state, the images themselves are recorded as inserts
+    len = u765_SaveState(FdcHandle, NULL, 0, u765_StateDiskDelta);
+
+    if (len == 0) {
+        return false;
+    }
+
+    state = (uint8_t*)malloc(len);
+    FdcHandle->TraceBuffer = (uint8_t*)malloc(U765_TRACE_BUFFER_SIZE);
+    FdcHandle->TraceFile = state != NULL && FdcHandle->TraceBuffer != NULL ? fopen(lpFilename, "wb") : NULL;
+
+    if (FdcHandle->TraceFile == NULL) {
+        free(state);
+        free(FdcHandle->TraceBuffer);
+        FdcHandle->TraceBuffer = NULL;
+        return false;
+    }
+
+    u765_SaveState(FdcHandle, state, len, u765_StateDiskDelta);
+
+    WRITEW(&header[4], U765_TRACE_VERSION);
+    FdcHandle->TraceLength = 0;
+    FdcHandle->TraceFlags = Flags;
+    FdcHandle->TraceLastCycle = FdcHandle->TraceCycle;
+    TraceBytes(FdcHandle, header, sizeof(header));
+
+    for (Unit = 0; Unit < FdcHandle->NumUnits; Unit++) {
+        TraceInsert(FdcHandle, Unit);
+    }
+
+    TraceRecord(FdcHandle, u765_TraceLoadState);
+    TraceNumber(FdcHandle, len);
+    TraceBytes(FdcHandle, state, len);
+
+    free(state);
+    return FdcHandle->TraceFile != NULL;
+}
+
+void U765_FUNCTION(u765_StopTrace)(u765_Controller* FdcHandle) {
+    if (FdcHandle->TraceFile != NULL) {
+        fwrite(FdcHandle->TraceBuffer, 1, FdcHandle->TraceLength, FdcHandle->TraceFile);
+        fclose(FdcHandle->TraceFile);
+        FdcHandle->TraceFile = NULL;
+    }
+
+    free(FdcHandle->TraceBuffer);
+    FdcHandle->TraceBuffer = NULL;
+}
+
+void U765_FUNCTION(u765_SetTraceCycle)(u765_Controller* FdcHandle, uint64_t Cycle) {
+    FdcHandle->TraceCycle = Cycle;
+}
+
 /*-----------------------------------------------------------------------------
 LOW LEVEL FUNCTIONS
 -----------------------------------------------------------------------------*/
@@ -422,6 +1365,8 @@ enum {
     case_eax,
     case_edi,
     case_FDC_FormatTrack,
+    case_FDC_FormatTrack1,
+    case_FDC_FormatTrack2,
     case_FDC_Invalid,
     case_FDC_Invalid1,
     case_FDC_NewCommand,
@@ -473,6 +1418,10 @@ enum {
     case_FDCBuff_ReturnSectorResults,
     case_FDCR_NotBadC,
     case_FDCR_SameC,
+    case_FmtTrk_Build,
+    case_FmtTrk_IDs,
+    case_FmtTrk_Results,
+    case_FmtTrk_WProt,
     case_GetSectorSize,
     case_GSS_Exit,
     case_InitFDC,
@@ -487,9 +1436,7 @@ enum {
     case_LocateFirstWriteSector,
     case_LocateReadSector,
     case_LocateTrack,
-    case_LockTrkDone,
     case_LocSingleSide,
-    case_LocTrk1,
     case_NoDiskChange,
     case_NotReadTrk1,
     case_Rd_IgnoreDAM,
@@ -501,6 +1448,7 @@ enum {
     case_Read_CompareSectorID,
     case_Read_ID_1,
     case_ReadCurrTrack,
+    case_RdTrk_Cached,
     case_ReadID_Results,
     case_ReadID_SendResults,
     case_ReadSectorData,
@@ -509,8 +1457,12 @@ enum {
     case_ReturnSectorRWResults,
     case_RSJmp1,
     case_RSNoSec0,
+    case_Scan_Next,
+    case_Scan_Step,
     case_SDTC_NormalRandom,
     case_SDTC_RandomData,
+    case_SDTC_ScanCompare,
+    case_SDTC_ScanData,
     case_SDTC_TransferData,
     case_SectorDataToCPU,
     case_SectorDataToCPU_Done,
@@ -540,14 +1492,15 @@ static void LowLevelInitialise(Context* ctx, u765_Controller* FdcHandle) {
     ctx->eax.ctrl->MotorState = 0;
     ctx->eax.ctrl->FDCVector = case_FDC_NewCommand;
     ctx->eax.ctrl->MainStatusReg = 0x80; // 10000000b
-    ctx->eax.ctrl->FDDUnit0.SeekDone = false;
-    ctx->eax.ctrl->FDDUnit1.SeekDone = false;
-    ctx->eax.ctrl->FDDUnit0.CTK = 0;
-    ctx->eax.ctrl->FDDUnit1.CTK = 0;
-    ctx->eax.ctrl->FDDUnit0.CHEAD = 0;
-    ctx->eax.ctrl->FDDUnit1.CHEAD = 0;
     OR(ctx, ctx->eax.ctrl->ST3, 0x20); // 00100000b
     ctx->eax.ctrl->FDCRandomSeed = 0;
+
+    for (uint32_t Unit = 0; Unit < UnitSlots(ctx->eax.ctrl->NumUnits); Unit++) {
+        ctx->eax.ctrl->FDDUnit[Unit].SeekDone = false;
+        ctx->eax.ctrl->FDDUnit[Unit].CTK = 0;
+        ctx->eax.ctrl->FDDUnit[Unit].CHEAD = 0;
+        ctx->eax.ctrl->FDDUnit[Unit].CachedTrackSlot = 0xffff;
+    }
 }
 
 static void FDCCommandCallback(Context* ctx, uint8_t NumCmdBytes) {
@@ -560,236 +1513,2579 @@ static void FDCCommandCallback(Context* ctx, uint8_t NumCmdBytes) {
         ctx->edi.ctrl->CommandCallback(ARG(ctx, -1).u8, ARG(ctx, -2).l);
         *ctx = ad;
     }
+    else if (ctx->edi.ctrl->CommandCallbackEx != NULL) {
+        Context ad = *ctx;
+        ctx->edi.ctrl->CommandCallbackEx(ctx->edi.ctrl->CommandUser, &ctx->edi.ctrl->FDCCommandByte, NumCmdBytes);
+        *ctx = ad;
+    }
+}
+
+// the unit selected by the unit select lines the units need, the spare unit structure when
+// that's a unit not present
+static void GetUnitPtr(Context* ctx, uint8_t Unit) {
+    AND(ctx, Unit, ctx->edi.ctrl->NumUnits > 2 ? 3 : 1);
+    ctx->eax.disk = &ctx->edi.ctrl->FDDUnit[Unit];
+}
+
+static bool UnitPresent(u765_Controller* ctrl, u765_DiskUnit* unit) {
+    return unit < &ctrl->FDDUnit[ctrl->NumUnits];
+}
+
+// unit structures kept for NumUnits units, as many as the unit select lines can address
+static uint32_t UnitSlots(uint32_t NumUnits) {
+    return NumUnits > 2 ? 4 : 2;
+}
+
+static size_t ControllerSize(uint32_t NumUnits) {
+    return offsetof(u765_Controller, FDDUnit) + UnitSlots(NumUnits) * sizeof(u765_DiskUnit);
+}
+
+static void WriteCurrentDisk(Context* ctx, u765_Controller* FdcHandle, uint8_t Unit, bool Eject) {
+    uint32_t Slot;
+    uint8_t* Image;
+    bool Pending, Deferred;
+
+    ctx->edi.ctrl = FdcHandle;
+
+    GetUnitPtr(ctx, Unit);
+    ctx->ebx = ctx->eax;
+
+    if (ctx->ebx.disk->DiskFileHandle != NULL) {
+        if (ctx->ebx.disk->WriteProtect == false && ctx->ebx.disk->ContentsChanged == true) {
+            if (ctx->ebx.disk->SharedDisk != NULL && ctx->ebx.disk->SharedDisk->Cached == true) {
+                UncacheImage(ctx->ebx.disk->SharedDisk);
+            }
+
+            FoldTrackCopies(ctx->ebx.disk);
+            Pending = false;
+            Deferred = false;
+
+            if (ctx->ebx.disk->TrackIndex != NULL && ctx->ebx.disk->LayoutChanged == false) {
+                // only the tracks written since the last flush differ from the file
+                for (Slot = 0; Slot < ctx->ebx.disk->NumTrackSlots; Slot++) {
+                    if (ctx->ebx.disk->TrackIndex[Slot].Dirty == true) {
+                        // clones still read the mapped file, keep the track until they're gone. An
+                        // ejected unit leaves it to the last of them
+                        if (ctx->ebx.disk->TrackIndex[Slot].Copy != NULL && ctx->ebx.disk->DiskMapped == true) {
+                            if (!Eject) {
+                                Pending = true;
+                                continue;
+                            }
+
+                            if (DeferTrackWrite(ctx->ebx.disk, Slot)) {
+                                ctx->ebx.disk->TrackIndex[Slot].Dirty = false;
+                                Deferred = true;
+                                continue;
+                            }
+                        }
+
+                        WriteDiskRange(ctx, ctx->ebx.disk->TrackIndex[Slot].TrackOffset, ctx->ebx.disk->TrackIndex[Slot].TrackLength, TrackData(ctx->ebx.disk, &ctx->ebx.disk->TrackIndex[Slot]));
+                        ctx->ebx.disk->TrackIndex[Slot].Dirty = false;
+                    }
+                }
+            }
+            else {
+                WriteDiskRange(ctx, 0, ctx->ebx.disk->DiskArrayLen, ctx->ebx.disk->DiskArrayPtr);
+
+                // tracks copied since Format Track laid the image out again go over it
+                for (Slot = 0; Slot < ctx->ebx.disk->NumTrackSlots; Slot++) {
+                    if (ctx->ebx.disk->TrackIndex[Slot].Copy != NULL) {
+                        WriteDiskRange(ctx, ctx->ebx.disk->TrackIndex[Slot].TrackOffset, ctx->ebx.disk->TrackIndex[Slot].TrackLength, ctx->ebx.disk->TrackIndex[Slot].Copy->Data);
+                    }
+
+                    ctx->ebx.disk->TrackIndex[Slot].Dirty = false;
+                }
+
+                ctx->ebx.disk->LayoutChanged = false;
+            }
+
+            if (ctx->ebx.disk->DiskMapped == false) {
+                fflush(ctx->ebx.disk->DiskFileHandle);
+            }
+
+            // the file stays open for the tracks left to the clones
+            if (Deferred) {
+                ctx->ebx.disk->SharedDisk->PendingFile = ctx->ebx.disk->DiskFileHandle;
+                ctx->ebx.disk->DiskFileHandle = NULL;
+            }
+
+            ctx->ebx.disk->ContentsChanged = Pending;
+        }
+    }
+    else if (ctx->ebx.disk->DiskArrayPtr != NULL) {
+        // disk inserted from memory, hand the changed image back to the application
+        if (ctx->ebx.disk->WriteProtect == false && ctx->ebx.disk->ContentsChanged == true) {
+            FoldTrackCopies(ctx->ebx.disk);
+
+            if (ctx->edi.ctrl->WriteBackCallback != NULL || ctx->edi.ctrl->WriteBackCallbackEx != NULL) {
+                Image = ctx->ebx.disk->DiskArrayPtr;
+
+                // tracks copied while the image is shared are put together with it
+                for (Slot = 0; Slot < ctx->ebx.disk->NumTrackSlots; Slot++) {
+                    if (ctx->ebx.disk->TrackIndex[Slot].Copy != NULL) {
+                        if (Image == ctx->ebx.disk->DiskArrayPtr) {
+                            Image = (uint8_t*)malloc(ctx->ebx.disk->DiskArrayLen);
+
+                            if (Image == NULL) {
+                                return;     // try again on the next flush
+                            }
+
+                            memcpy(Image, ctx->ebx.disk->DiskArrayPtr, ctx->ebx.disk->DiskArrayLen);
+                        }
+
+                        memcpy(Image + ctx->ebx.disk->TrackIndex[Slot].TrackOffset, ctx->ebx.disk->TrackIndex[Slot].Copy->Data, ctx->ebx.disk->TrackIndex[Slot].TrackLength);
+                    }
+                }
+
+                Context ad = *ctx;
+                if (ctx->edi.ctrl->WriteBackCallback != NULL) {
+                    ctx->edi.ctrl->WriteBackCallback(Unit, Image, ctx->ebx.disk->DiskArrayLen);
+                }
+                else {
+                    ctx->edi.ctrl->WriteBackCallbackEx(ctx->edi.ctrl->WriteBackUser, Unit, Image, ctx->ebx.disk->DiskArrayLen);
+                }
+                *ctx = ad;
+
+                if (Image != ctx->ebx.disk->DiskArrayPtr) {
+                    free(Image);
+                }
+            }
+
+            for (Slot = 0; Slot < ctx->ebx.disk->NumTrackSlots; Slot++) {
+                ctx->ebx.disk->TrackIndex[Slot].Dirty = false;
+            }
+
+            ctx->ebx.disk->ContentsChanged = false;
+        }
+    }
+}
+
+// writes Len bytes of Data back to the file open in the unit at ctx->ebx, at Offset in the image
+static void WriteDiskRange(Context* ctx, uint32_t Offset, uint32_t Len, uint8_t const* Data) {
+    if (Len == 0) {
+        return;
+    }
+
+    if (ctx->ebx.disk->DiskMapped == true && Data == (uint8_t*)ctx->ebx.disk->DiskArrayPtr + Offset) {
+        // writes already went to the shared mapping, just schedule the dirty pages
+#ifdef _WIN32
+        FlushViewOfFile((uint8_t*)ctx->ebx.disk->DiskArrayPtr + Offset, Len);
+#else
+        uint32_t PageMask = (uint32_t)sysconf(_SC_PAGESIZE) - 1;
+        Len += Offset & PageMask;
+        Offset &= ~PageMask;
+        msync((uint8_t*)ctx->ebx.disk->DiskArrayPtr + Offset, Len, MS_ASYNC);
+#endif
+    }
+    else if (fseek(ctx->ebx.disk->DiskFileHandle, Offset, SEEK_SET) == 0) {
+        fwrite(Data, 1, Len, ctx->ebx.disk->DiskFileHandle);
+
+        if (ctx->ebx.disk->DiskMapped == true) {
+            fflush(ctx->ebx.disk->DiskFileHandle);
+        }
+    }
 }
 
-static void GetUnitPtr(Context* ctx, uint8_t Unit) {
-    AND(ctx, Unit, 1);
+// maps the file open in the unit at ctx->ebx, shared when the disk is writable so writes go
+// straight back to the file through the page cache, private when it is write protected
+static void MapDiskFile(Context* ctx) {
+    if (ctx->ebx.disk->DiskArrayLen == 0) {
+        return;
+    }
+
+#ifdef _WIN32
+    HANDLE file = (HANDLE)_get_osfhandle(_fileno(ctx->ebx.disk->DiskFileHandle));
+    HANDLE mapping = CreateFileMappingA(file, NULL, ctx->ebx.disk->WriteProtect ? PAGE_WRITECOPY : PAGE_READWRITE, 0, 0, NULL);
+
+    if (mapping != NULL) {
+        ctx->ebx.disk->DiskArrayPtr = MapViewOfFile(mapping, ctx->ebx.disk->WriteProtect ? FILE_MAP_COPY : FILE_MAP_WRITE, 0, 0, ctx->ebx.disk->DiskArrayLen);
+        CloseHandle(mapping);   // the view keeps the mapping alive
+    }
+#else
+    void* ptr = mmap(NULL, ctx->ebx.disk->DiskArrayLen, PROT_READ | PROT_WRITE, ctx->ebx.disk->WriteProtect ? MAP_PRIVATE : MAP_SHARED, fileno(ctx->ebx.disk->DiskFileHandle), 0);
+
+    if (ptr != MAP_FAILED) {
+        ctx->ebx.disk->DiskArrayPtr = ptr;
+    }
+#endif
+
+    ctx->ebx.disk->DiskMapped = ctx->ebx.disk->DiskArrayPtr != NULL;
+}
+
+// peeks at the first bytes of the file open in the unit at ctx->ebx to tell how it's stored
+static uint32_t DiskFileFormat(Context* ctx) {
+    uint8_t magic[8] = { 0 };
+    size_t len = fread(magic, 1, sizeof(magic), ctx->ebx.disk->DiskFileHandle);
+
+    fseek(ctx->ebx.disk->DiskFileHandle, 0, SEEK_SET);
+
+    if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return ImageGzip;
+    }
+
+    // anything else that isn't a DSK or EDSK image is left to the application's decoder
+    if (ImageDecoder != NULL && memcmp(magic, "MV - CPC", 8) != 0 && memcmp(magic, "EXTENDED", 8) != 0) {
+        return ImageForeign;
+    }
+
+    return ImagePlain;
+}
+
+static size_t DecoderRead(void* Stream, void* Buffer, size_t Len) {
+    return fread(Buffer, 1, Len, ((DecodeStream*)Stream)->File);
+}
+
+static bool DecoderWrite(void* Stream, void const* Data, size_t Len) {
+    DecodeStream* d = (DecodeStream*)Stream;
+
+    if (!DecodeReserve(d, Len)) {
+        return false;
+    }
+
+    memcpy(d->Image + d->Len, Data, Len);
+    d->Len += Len;
+    return true;
+}
+
+// makes room for Len more bytes of image, false if the image can't grow that much or would
+// be larger than any disk image, so that a file inflating without end is given up on
+static bool DecodeReserve(DecodeStream* d, size_t Len) {
+    uint8_t* image;
+    size_t size = d->Size * 2;
+
+    if (Len <= d->Size - d->Len) {
+        return true;
+    }
+
+    if (Len > U765_MAX_IMAGE_SIZE - d->Len) {
+        return false;
+    }
+
+    if (size < d->Len + Len) {
+        size = d->Len + Len;
+    }
+
+    if (size < 0x10000) {
+        size = 0x10000;
+    }
+
+    if (size > U765_MAX_IMAGE_SIZE) {
+        size = U765_MAX_IMAGE_SIZE;
+    }
+
+    image = (uint8_t*)realloc(d->Image, size);
+
+    if (image == NULL) {
+        return false;
+    }
+
+    d->Image = image;
+    d->Size = size;
+    return true;
+}
+
+// decodes the compressed file open in the unit at ctx->ebx into a new image. The file isn't
+// read any further than the decoder needs, the image growing as the decoded bytes come
+static bool DecodeDiskFile(Context* ctx, uint32_t Format) {
+    DecodeStream d;
+    uint8_t size[4];
+    uint8_t* image;
+    long compressed;
+    size_t hint;
+    bool Ok;
+
+    d.File = ctx->ebx.disk->DiskFileHandle;
+    d.Image = NULL;
+    d.Len = 0;
+    d.Size = 0;
+
+    if (Format == ImageGzip) {
+        // gzip ends with the size of the data, which usually is the whole image. It is only
+        // trusted as far as the compressed bytes can inflate and a disk image can be, the
+        // image growing as usual past that
+        if (fseek(d.File, -4, SEEK_END) == 0 && (compressed = ftell(d.File)) >= 0 && fread(size, 1, 4, d.File) == 4) {
+            hint = READDW(size);
+
+            if (hint > (size_t)compressed * U765_MAX_INFLATE_RATIO) {
+                hint = (size_t)compressed * U765_MAX_INFLATE_RATIO;
+            }
+
+            if (hint > U765_MAX_IMAGE_SIZE) {
+                hint = U765_MAX_IMAGE_SIZE;
+            }
+
+            DecodeReserve(&d, hint);
+        }
+
+        fseek(d.File, 0, SEEK_SET);
+        Ok = InflateGzip(&d);
+    }
+    else {
+        Ok = ImageDecoder(ImageDecoderUser, &d, DecoderRead, DecoderWrite);
+    }
+
+    // the Disk-Info block is copied unconditionally on insert
+    if (!Ok || d.Len < sizeof(u765_DiskInfoBlock)) {
+        free(d.Image);
+        return false;
+    }
+
+    // gives back what growing the image left over
+    if (d.Size != d.Len && (image = (uint8_t*)realloc(d.Image, d.Len)) != NULL) {
+        d.Image = image;
+    }
+
+    ctx->ebx.disk->DiskArrayPtr = d.Image;
+    ctx->ebx.disk->DiskArrayLen = d.Len;
+    return true;
+}
+
+// CRC-32 of gzip, with a table made for the call, which takes less than reading the image
+static uint32_t GzipCrc(uint32_t crc, uint8_t const* Data, size_t Len) {
+    uint32_t table[256], value, i, b;
+
+    for (i = 0; i < 256; i++) {
+        for (value = i, b = 0; b < 8; b++) {
+            value = (value >> 1) ^ (0xedb88320 & (0 - (value & 1)));
+        }
+
+        table[i] = value;
+    }
+
+    crc = ~crc;
+
+    while (Len-- != 0) {
+        crc = (crc >> 8) ^ table[(crc ^ *Data++) & 0xff];
+    }
+
+    return ~crc;
+}
+
+// the next compressed bytes go to the bit buffer, zeros past the end of the file, which make
+// the stream bad once they are consumed
+static void InflateRefill(Inflater* inf) {
+    while (inf->NumBits <= 56) {
+        if (inf->Pos == inf->Len) {
+            inf->Pos = 0;
+            inf->Len = DecoderRead(inf->Stream, inf->Buffer, sizeof(inf->Buffer));
+
+            if (inf->Len == 0) {
+                inf->Padding += 8;
+                inf->NumBits += 8;
+                continue;
+            }
+        }
+
+        inf->Bits |= (uint64_t)inf->Buffer[inf->Pos++] << inf->NumBits;
+        inf->NumBits += 8;
+    }
+}
+
+static uint32_t InflateBits(Inflater* inf, uint32_t n) {
+    uint32_t value;
+
+    if (inf->NumBits < n) {
+        InflateRefill(inf);
+    }
+
+    value = (uint32_t)inf->Bits & ((1u << n) - 1);
+    inf->Bits >>= n;
+    inf->NumBits -= n;
+
+    if (inf->NumBits < inf->Padding) {
+        inf->Ok = false;
+    }
+
+    return value;
+}
+
+// the canonical code of the lengths given, with a table to decode the codes of up to
+// INFLATE_FAST_BITS bits in one go. false if the lengths are more than a code can have
+static bool InflateBuild(InflateTable* t, uint8_t const* Lengths, uint32_t Num) {
+    uint16_t offsets[16];
+    uint32_t len, sym, code, reversed, i, b;
+    int32_t left = 1;
+
+    memset(t->Counts, 0, sizeof(t->Counts));
+    memset(t->Fast, 0, sizeof(t->Fast));
+
+    for (sym = 0; sym < Num; sym++) {
+        t->Counts[Lengths[sym]]++;
+    }
+
+    t->Counts[0] = 0;
+    offsets[1] = 0;
+
+    for (len = 1; len < 16; len++) {
+        left = left * 2 - t->Counts[len];
+
+        if (left < 0) {
+            return false;
+        }
+
+        if (len < 15) {
+            offsets[len + 1] = offsets[len] + t->Counts[len];
+        }
+    }
+
+    for (sym = 0; sym < Num; sym++) {
+        if (Lengths[sym] != 0) {
+            t->Symbols[offsets[Lengths[sym]]++] = (uint16_t)sym;
+        }
+    }
+
+    // codes are sent from their top bit down, the table is indexed by the bits as they come
+    code = 0;
+    i = 0;
+
+    for (len = 1; len <= INFLATE_FAST_BITS; len++) {
+        for (sym = 0; sym < t->Counts[len]; sym++, code++, i++) {
+            reversed = 0;
+
+            for (b = 0; b < len; b++) {
+                reversed |= (code >> b & 1) << (len - 1 - b);
+            }
+
+            for (; reversed < (1 << INFLATE_FAST_BITS); reversed += 1 << len) {
+                t->Fast[reversed] = (uint16_t)(t->Symbols[i] << 4 | len);
+            }
+        }
+
+        code <<= 1;
+    }
+
+    return true;
+}
+
+// the next symbol of the code, -1 if the bits aren't a code
+static int32_t InflateSymbol(Inflater* inf, InflateTable const* t) {
+    uint32_t entry, len, code = 0, first = 0, index = 0, count;
+
+    if (inf->NumBits < 15) {
+        InflateRefill(inf);
+    }
+
+    entry = t->Fast[inf->Bits & ((1 << INFLATE_FAST_BITS) - 1)];
+
+    if (entry != 0) {
+        InflateBits(inf, entry & 15);
+        return (int32_t)(entry >> 4);
+    }
+
+    for (len = 1; len < 16; len++) {
+        code |= InflateBits(inf, 1);
+        count = t->Counts[len];
+
+        if (code - first < count) {
+            return t->Symbols[index + code - first];
+        }
+
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+
+    return -1;
+}
+
+// the lengths of the two codes of a dynamic block, false if they don't make codes
+static bool InflateDynamic(Inflater* inf) {
+    static uint8_t const order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    uint8_t lengths[320];
+    uint32_t nlen, ndist, ncode, i, repeat;
+    int32_t sym;
+    uint8_t value;
+
+    nlen = InflateBits(inf, 5) + 257;
+    ndist = InflateBits(inf, 5) + 1;
+    ncode = InflateBits(inf, 4) + 4;
+
+    if (nlen > 286 || ndist > 30) {
+        return false;
+    }
+
+    memset(lengths, 0, sizeof(lengths));
+
+    for (i = 0; i < ncode; i++) {
+        lengths[order[i]] = (uint8_t)InflateBits(inf, 3);
+    }
+
+    if (!InflateBuild(&inf->Lengths, lengths, 19)) {
+        return false;
+    }
+
+    for (i = 0; i < nlen + ndist;) {
+        sym = InflateSymbol(inf, &inf->Lengths);
+
+        if (sym < 0) {
+            return false;
+        }
+
+        if (sym < 16) {
+            lengths[i++] = (uint8_t)sym;
+            continue;
+        }
+
+        value = 0;
+
+        if (sym == 16) {
+            if (i == 0) {
+                return false;   // nothing to repeat
+            }
+
+            value = lengths[i - 1];
+            repeat = 3 + InflateBits(inf, 2);
+        }
+        else if (sym == 17) {
+            repeat = 3 + InflateBits(inf, 3);
+        }
+        else {
+            repeat = 11 + InflateBits(inf, 7);
+        }
+
+        if (i + repeat > nlen + ndist) {
+            return false;
+        }
+
+        while (repeat-- != 0) {
+            lengths[i++] = value;
+        }
+    }
+
+    // the end of block code has to be there
+    return lengths[256] != 0 && InflateBuild(&inf->Literals, lengths, nlen) && InflateBuild(&inf->Distances, lengths + nlen, ndist);
+}
+
+static void InflateFixed(Inflater* inf) {
+    uint8_t lengths[320];
+    uint32_t i;
+
+    for (i = 0; i < 288; i++) {
+        lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+
+    for (i = 0; i < 30; i++) {
+        lengths[288 + i] = 5;
+    }
+
+    InflateBuild(&inf->Literals, lengths, 288);
+    InflateBuild(&inf->Distances, lengths + 288, 30);
+}
+
+// the literals and matches of a block, straight into the image
+static bool InflateCodes(Inflater* inf, DecodeStream* d) {
+    static uint16_t const lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static uint8_t const lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static uint16_t const distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static uint8_t const distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    uint32_t len, dist;
+    uint8_t* from;
+    uint8_t* to;
+    int32_t sym;
+
+    for (;;) {
+        sym = InflateSymbol(inf, &inf->Literals);
+
+        if (sym < 0 || !inf->Ok) {
+            return false;
+        }
+
+        if (sym < 256) {
+            if (d->Len == d->Size && !DecodeReserve(d, 1)) {
+                return false;
+            }
+
+            d->Image[d->Len++] = (uint8_t)sym;
+            continue;
+        }
+
+        if (sym == 256) {
+            return inf->Ok;
+        }
+
+        if (sym > 285) {
+            return false;
+        }
+
+        len = lengthBase[sym - 257] + InflateBits(inf, lengthExtra[sym - 257]);
+        sym = InflateSymbol(inf, &inf->Distances);
+
+        if (sym < 0 || sym > 29) {
+            return false;
+        }
+
+        dist = distBase[sym] + InflateBits(inf, distExtra[sym]);
+
+        if (!inf->Ok || dist > d->Len - inf->Start || !DecodeReserve(d, len)) {
+            return false;
+        }
+
+        to = d->Image + d->Len;
+        from = to - dist;
+        d->Len += len;
+
+        if (dist >= len) {
+            memcpy(to, from, len);
+        }
+        else {
+            while (len-- != 0) {
+                *to++ = *from++;
+            }
+        }
+    }
+}
+
+// a gzip file of one or more members, each a deflate stream
+static bool InflateGzip(DecodeStream* d) {
+    Inflater* inf = (Inflater*)malloc(sizeof(Inflater));
+    uint32_t flags, len, last, type, crc, i;
+    bool Ok = true;
+
+    if (inf == NULL) {
+        return false;
+    }
+
+    inf->Stream = d;
+    inf->Pos = 0;
+    inf->Len = 0;
+    inf->Bits = 0;
+    inf->NumBits = 0;
+    inf->Padding = 0;
+    inf->Ok = true;
+
+    do {
+        if (InflateBits(inf, 16) != 0x8b1f || InflateBits(inf, 8) != 8) {
+            Ok = false;
+            break;
+        }
+
+        flags = InflateBits(inf, 8);
+        InflateBits(inf, 16);   // modification time
+        InflateBits(inf, 16);
+        InflateBits(inf, 16);   // extra flags and OS
+
+        if ((flags & 4) != 0) {
+            for (len = InflateBits(inf, 16); len != 0 && inf->Ok; len--) {
+                InflateBits(inf, 8);
+            }
+        }
+
+        if ((flags & 8) != 0) {
+            while (InflateBits(inf, 8) != 0 && inf->Ok) {
+            }
+        }
+
+        if ((flags & 16) != 0) {
+            while (InflateBits(inf, 8) != 0 && inf->Ok) {
+            }
+        }
+
+        if ((flags & 2) != 0) {
+            InflateBits(inf, 16);
+        }
+
+        inf->Start = d->Len;
+
+        do {
+            last = InflateBits(inf, 1);
+            type = InflateBits(inf, 2);
+
+            if (type == 0) {
+                InflateBits(inf, inf->NumBits & 7);
+                len = InflateBits(inf, 16);
+
+                if ((InflateBits(inf, 16) ^ len) != 0xffff || !DecodeReserve(d, len)) {
+                    Ok = false;
+                    break;
+                }
+
+                for (i = 0; i < len; i++) {
+                    d->Image[d->Len++] = (uint8_t)InflateBits(inf, 8);
+                }
+            }
+            else if (type == 1) {
+                InflateFixed(inf);
+                Ok = InflateCodes(inf, d);
+            }
+            else if (type == 2) {
+                Ok = InflateDynamic(inf) && InflateCodes(inf, d);
+            }
+            else {
+                Ok = false;
+            }
+        }
+        while (Ok && inf->Ok && last == 0);
+
+        if (!Ok || !inf->Ok) {
+            Ok = false;
+            break;
+        }
+
+        InflateBits(inf, inf->NumBits & 7);
+        crc = InflateBits(inf, 16);
+        crc |= InflateBits(inf, 16) << 16;
+        len = InflateBits(inf, 16);
+        len |= InflateBits(inf, 16) << 16;
+
+        if (!inf->Ok || len != (uint32_t)(d->Len - inf->Start) || crc != GzipCrc(0, d->Image + inf->Start, d->Len - inf->Start)) {
+            Ok = false;
+            break;
+        }
+
+        // another member follows if anything but the padding is left
+        if (inf->NumBits - inf->Padding < 16) {
+            InflateRefill(inf);
+        }
+    }
+    while (inf->NumBits - inf->Padding >= 16 && (inf->Bits & 0xffff) == 0x8b1f);
+
+    free(inf);
+    return Ok;
+}
+
+// the image cache is only locked for as long as it takes to walk it
+static void LockImageCache(void) {
+#ifdef _WIN32
+    while (InterlockedExchange(&ImageCacheLock, 1) != 0) {
+        SwitchToThread();
+    }
+#else
+    while (__atomic_exchange_n(&ImageCacheLock, 1, __ATOMIC_ACQUIRE) != 0) {
+        sched_yield();
+    }
+#endif
+}
+
+static void UnlockImageCache(void) {
+#ifdef _WIN32
+    InterlockedExchange(&ImageCacheLock, 0);
+#else
+    __atomic_store_n(&ImageCacheLock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+// the cached image of the file, NULL if it isn't cached or was written since it was read
+static u765_SharedDisk* LookupImage(char const* lpFilename, struct stat const* buf) {
+    u765_SharedDisk* shared;
+
+    for (shared = ImageCache; shared != NULL; shared = shared->NextCached) {
+        if (shared->FileLen == (size_t)buf->st_size && shared->ModTime == buf->st_mtime && strcmp(shared->Filename, lpFilename) == 0) {
+            return shared;
+        }
+    }
+
+    return NULL;
+}
+
+static void UnlistImage(u765_SharedDisk* shared) {
+    u765_SharedDisk** link;
+
+    if (shared->Listed == true) {
+        for (link = &ImageCache; *link != shared; link = &(*link)->NextCached) {
+        }
+
+        *link = shared->NextCached;
+        shared->Listed = false;
+    }
+}
+
+// shares the cached image of the file open in the unit at ctx->ebx, leaving DiskArrayPtr NULL
+// if it has to be read
+static void FindCachedImage(Context* ctx, char const* lpFilename, struct stat const* buf) {
+    u765_SharedDisk* shared;
+
+    LockImageCache();
+    shared = LookupImage(lpFilename, buf);
+
+    if (shared != NULL) {
+        REF_INC(shared->RefCount);
+        ctx->ebx.disk->SharedDisk = shared;
+        ctx->ebx.disk->DiskArrayPtr = shared->DiskArrayPtr;
+        ctx->ebx.disk->DiskArrayLen = shared->DiskArrayLen;
+    }
+
+    UnlockImageCache();
+}
+
+// hands the image just read into the unit at ctx->ebx to the cache, or drops it for the one
+// another thread read meanwhile. The image stays the unit's own if it can't be cached
+static void CacheImage(Context* ctx, char const* lpFilename, struct stat const* buf) {
+    u765_SharedDisk* shared;
+    u765_SharedDisk* other;
+
+    if (strlen(lpFilename) >= sizeof(shared->Filename)) {
+        return;
+    }
+
+    shared = (u765_SharedDisk*)malloc(sizeof(u765_SharedDisk));
+
+    if (shared == NULL) {
+        return;
+    }
+
+    shared->RefCount = 1;
+    shared->DiskArrayPtr = ctx->ebx.disk->DiskArrayPtr;
+    shared->DiskArrayLen = ctx->ebx.disk->DiskArrayLen;
+    shared->DiskMapped = false;
+    shared->DiskBorrowed = false;
+    shared->Cached = true;
+    shared->Listed = true;
+    shared->PendingFile = NULL;
+    shared->Pending = NULL;
+    shared->NumPending = 0;
+    shared->ModTime = buf->st_mtime;
+    shared->FileLen = (size_t)buf->st_size;
+    strcpy(shared->Filename, lpFilename);
+
+    LockImageCache();
+    other = LookupImage(lpFilename, buf);
+
+    if (other != NULL) {
+        REF_INC(other->RefCount);
+    }
+    else {
+        shared->NextCached = ImageCache;
+        ImageCache = shared;
+    }
+
+    UnlockImageCache();
+
+    if (other != NULL) {
+        free(shared);
+        free(ctx->ebx.disk->DiskArrayPtr);
+        shared = other;
+    }
+
+    ctx->ebx.disk->SharedDisk = shared;
+    ctx->ebx.disk->DiskArrayPtr = shared->DiskArrayPtr;
+}
+
+// the file is about to be written, the next inserts have to read it again
+static void UncacheImage(u765_SharedDisk* shared) {
+    LockImageCache();
+    UnlistImage(shared);
+    UnlockImageCache();
+}
+
+static void FreeDiskArray(Context* ctx) {
+    bool Last;
+
+
+    if (ctx->ebx.disk->SharedDisk != NULL) {
+        // a cached image is dropped with the cache locked, so it can't be found meanwhile
+        if (ctx->ebx.disk->SharedDisk->Cached == true) {
+            LockImageCache();
+            Last = REF_DEC(ctx->ebx.disk->SharedDisk->RefCount) == 0;
+
+            if (Last) {
+                UnlistImage(ctx->ebx.disk->SharedDisk);
+            }
+
+            UnlockImageCache();
+        }
+        else {
+            Last = REF_DEC(ctx->ebx.disk->SharedDisk->RefCount) == 0;
+        }
+
+        // the last unit reading a shared image frees it
+        if (Last) {
+            WritePendingTracks(ctx->ebx.disk->SharedDisk);
+            ctx->ebx.disk->DiskArrayPtr = ctx->ebx.disk->SharedDisk->DiskArrayPtr;
+            ctx->ebx.disk->DiskArrayLen = ctx->ebx.disk->SharedDisk->DiskArrayLen;
+            ctx->ebx.disk->DiskMapped = ctx->ebx.disk->SharedDisk->DiskMapped;
+            ctx->ebx.disk->DiskBorrowed = ctx->ebx.disk->SharedDisk->DiskBorrowed;
+            free(ctx->ebx.disk->SharedDisk);
+        }
+        else {
+            ctx->ebx.disk->DiskArrayPtr = NULL;
+        }
+
+        ctx->ebx.disk->SharedDisk = NULL;
+    }
+
+    if (ctx->ebx.disk->DiskArrayPtr != NULL) {
+        if (ctx->ebx.disk->DiskMapped == true) {
+#ifdef _WIN32
+            UnmapViewOfFile(ctx->ebx.disk->DiskArrayPtr);
+#else
+            munmap(ctx->ebx.disk->DiskArrayPtr, ctx->ebx.disk->DiskArrayLen);
+#endif
+        }
+        else if (ctx->ebx.disk->DiskBorrowed == false) {
+            free(ctx->ebx.disk->DiskArrayPtr);
+        }
+
+        ctx->ebx.disk->DiskArrayPtr = NULL;
+    }
+
+    ctx->ebx.disk->DiskMapped = false;
+    ctx->ebx.disk->DiskBorrowed = false;
+}
+
+// size of the sector data in a DSK track, as computed by GetSectorSize
+static uint32_t DskSectorSize(uint8_t SectorSize) {
+    uint32_t size = (uint32_t)128 << (SectorSize & 31);
+    return size < 8192 ? size : 6144;
+}
+
+// bytes of the unit's TrackBlock from Data to its end, 0 once the sizes of the sectors before
+// it have taken Data past the end
+static uint32_t TrackBlockRoom(u765_DiskUnit* unit, uint8_t const* Data) {
+    uint8_t const* end = (uint8_t const*)(unit->TrackBlock + 1);
+    return Data < end ? (uint32_t)(end - Data) : 0;
+}
+
+// Data, or the end of the unit's TrackBlock if the sizes of the sectors before it have taken
+// Data past it. a position beyond the end would point into whatever memory follows, which
+// TrackBlockRoom treats as no room anyway but a saved state can't refer to
+static uint8_t* TrackBlockData(u765_DiskUnit* unit, uint8_t* Data) {
+    return TrackBlockRoom(unit, Data) != 0 ? Data : (uint8_t*)(unit->TrackBlock + 1);
+}
+
+// builds the track offset table and the per-sector data offsets and IDs for the disk in
+// this unit, so tracks and sectors can be located without walking the image
+static void IndexDisk(Context* ctx, uint8_t unit) {
+    uint32_t NumSlots, Slot, TrackOffset, TrackSize;
+
+    GetUnitPtr(ctx, unit);
+    ctx->ebx = ctx->eax;
+
+    FreeDiskIndex(ctx);
+
+    NumSlots = ctx->ebx.disk->DiskBlock.NumTracks;
+    if (ctx->ebx.disk->DiskBlock.NumSides == 2) {
+        NumSlots *= 2;
+    }
+
+    // at most 29 sectors fit in the SectorInfoList of a track
+    ctx->ebx.disk->TrackIndex = (u765_TrackIndex*)calloc(NumSlots + 1, sizeof(u765_TrackIndex));
+    ctx->ebx.disk->SectorIndex = (u765_SectorIndex*)calloc(NumSlots * 29 + 1, sizeof(u765_SectorIndex));
+
+    if (ctx->ebx.disk->TrackIndex == NULL || ctx->ebx.disk->SectorIndex == NULL) {
+        FreeDiskIndex(ctx);   // the controller falls back to walking the image
+        return;
+    }
+
+    ctx->ebx.disk->NumTrackSlots = NumSlots;
+
+    TrackOffset = 0x100;
+
+    for (Slot = 0; Slot < NumSlots; Slot++) {
+        // EDSK tracks are stored at their own sizes, from the table at $34 in the Disk-Info block
+        TrackSize = ctx->ebx.disk->DiskBlock.TrackSize;
+        if (ctx->ebx.disk->EDSK == true) {
+            TrackSize = Slot < 0x100 - 0x34 ? (uint32_t)((uint8_t*)ctx->ebx.disk->DiskArrayPtr)[0x34 + Slot] << 8 : 0;
+        }
+
+        ctx->ebx.disk->TrackIndex[Slot].TrackOffset = TrackOffset;
+        TrackOffset += TrackSize;
+
+        if (ctx->ebx.disk->TrackIndex[Slot].TrackOffset >= ctx->ebx.disk->DiskArrayLen) {
+            continue;   // track is beyond the end of the image
+        }
+
+        ctx->ebx.disk->TrackIndex[Slot].TrackLength = ctx->ebx.disk->DiskArrayLen - ctx->ebx.disk->TrackIndex[Slot].TrackOffset;
+        if (ctx->ebx.disk->TrackIndex[Slot].TrackLength > TrackSize) {
+            ctx->ebx.disk->TrackIndex[Slot].TrackLength = TrackSize;
+        }
+    }
+
+    IndexSectors(ctx->ebx.disk);
+}
+
+// indexes the sectors of every track of the unit as they are now, from the unit's copies of
+// the tracks it has them for
+static void IndexSectors(u765_DiskUnit* unit) {
+    uint32_t Slot, NumSectors, DataOffset, Sector;
+    u765_SectorIndex* SectorIndex = unit->SectorIndex;
+    uint8_t* Track;
+
+    for (Slot = 0; Slot < unit->NumTrackSlots; Slot++) {
+        unit->TrackIndex[Slot].FirstSector = (uint16_t)(SectorIndex - unit->SectorIndex);
+        unit->TrackIndex[Slot].NumSectors = 0;
+
+        if (unit->TrackIndex[Slot].TrackLength < 0x100) {
+            continue;   // no room for the SectorInfoList
+        }
+
+        Track = TrackData(unit, &unit->TrackIndex[Slot]);
+        NumSectors = Track[0x15];
+        if (NumSectors > 29) {
+            NumSectors = 29;
+        }
+
+        // same sector sizes SkipNextSector uses when walking the track
+        DataOffset = 0;
+
+        for (Sector = 0; Sector < NumSectors; Sector++) {
+            SectorIndex->DataOffset = DataOffset;
+            SectorIndex->CHRN = READDW(&Track[0x18 + Sector * 8]);
+            SectorIndex++;
+
+            if (unit->EDSK == true) {
+                DataOffset += READW(&Track[0x18 + Sector * 8 + 6]);
+            }
+            else {
+                DataOffset += DskSectorSize(Track[0x14]);
+            }
+        }
+
+        unit->TrackIndex[Slot].NumSectors = NumSectors;
+    }
+}
+
+static void FreeDiskIndex(Context* ctx) {
+    uint32_t Slot;
+
+    for (Slot = 0; Slot < ctx->ebx.disk->NumTrackSlots; Slot++) {
+        if (ctx->ebx.disk->TrackIndex[Slot].Copy != NULL && REF_DEC(ctx->ebx.disk->TrackIndex[Slot].Copy->RefCount) == 0) {
+            free(ctx->ebx.disk->TrackIndex[Slot].Copy);
+        }
+    }
+
+    free(ctx->ebx.disk->TrackIndex);
+    free(ctx->ebx.disk->SectorIndex);
+    ctx->ebx.disk->TrackIndex = NULL;
+    ctx->ebx.disk->SectorIndex = NULL;
+    ctx->ebx.disk->NumTrackSlots = 0;
+    ctx->ebx.disk->CachedTrackSlot = 0xffff;
+}
+
+// index entry of the track last located for the unit in ctx->ebx, NULL if not indexed
+static u765_TrackIndex* GetTrackIndex(Context* ctx) {
+    if (ctx->ebx.disk->TrackSlot >= ctx->ebx.disk->NumTrackSlots) {
+        return NULL;
+    }
+
+    return &ctx->ebx.disk->TrackIndex[ctx->ebx.disk->TrackSlot];
+}
+
+// the current contents of a track, this unit's copy if it has one
+static uint8_t* TrackData(u765_DiskUnit* unit, u765_TrackIndex* track) {
+    if (track->Copy != NULL) {
+        return track->Copy->Data;
+    }
+
+    return (uint8_t*)unit->DiskArrayPtr + track->TrackOffset;
+}
+
+// the image is read by other units, or isn't ours to write to: a clone's mapping of a file
+// stays the file's even once the other units are gone
+static bool ImageShared(u765_DiskUnit* unit) {
+    return unit->DiskBorrowed == true || (unit->DiskMapped == true && unit->DiskFileHandle == NULL) ||
+           (unit->SharedDisk != NULL && (unit->SharedDisk->Cached == true || REF_GET(unit->SharedDisk->RefCount) > 1));
+}
+
+// where a track can be written to, copying it first while the image or the copy is shared,
+// NULL if the copy can't be allocated
+static uint8_t* WritableTrackData(u765_DiskUnit* unit, u765_TrackIndex* track) {
+    u765_TrackCopy* copy;
+
+    if (track->Copy == NULL && !ImageShared(unit)) {
+        return (uint8_t*)unit->DiskArrayPtr + track->TrackOffset;
+    }
+
+    if (track->Copy != NULL && REF_GET(track->Copy->RefCount) == 1) {
+        return track->Copy->Data;
+    }
+
+    copy = (u765_TrackCopy*)malloc(sizeof(u765_TrackCopy) + track->TrackLength);
+
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    copy->RefCount = 1;
+    memcpy(copy->Data, TrackData(unit, track), track->TrackLength);
+
+    // a clone may have dropped the copy meanwhile, leaving it to us to free
+    if (track->Copy != NULL && REF_DEC(track->Copy->RefCount) == 0) {
+        free(track->Copy);
+    }
+
+    track->Copy = copy;
+    return copy->Data;
+}
+
+// once nothing else reads the image, the copied tracks are put back into it
+static void FoldTrackCopies(u765_DiskUnit* unit) {
+    uint32_t Slot;
+
+    if (ImageShared(unit)) {
+        return;
+    }
+
+    for (Slot = 0; Slot < unit->NumTrackSlots; Slot++) {
+        if (unit->TrackIndex[Slot].Copy != NULL) {
+            memcpy((uint8_t*)unit->DiskArrayPtr + unit->TrackIndex[Slot].TrackOffset, unit->TrackIndex[Slot].Copy->Data, unit->TrackIndex[Slot].TrackLength);
+
+            if (REF_DEC(unit->TrackIndex[Slot].Copy->RefCount) == 0) {
+                free(unit->TrackIndex[Slot].Copy);
+            }
+
+            unit->TrackIndex[Slot].Copy = NULL;
+        }
+    }
+}
+
+// leaves the unit's copy of the track in Slot to the clones still mapping the file, false if
+// it has to be written now, as it does once they're gone
+static bool DeferTrackWrite(u765_DiskUnit* unit, uint32_t Slot) {
+    u765_SharedDisk* shared = unit->SharedDisk;
+    PendingTrack* pending;
+
+    if (shared == NULL || REF_GET(shared->RefCount) < 2) {
+        return false;
+    }
+
+    pending = (PendingTrack*)realloc(shared->Pending, (shared->NumPending + 1) * sizeof(PendingTrack));
+
+    if (pending == NULL) {
+        return false;
+    }
+
+    shared->Pending = pending;
+    pending[shared->NumPending].TrackOffset = unit->TrackIndex[Slot].TrackOffset;
+    pending[shared->NumPending].TrackLength = unit->TrackIndex[Slot].TrackLength;
+    pending[shared->NumPending].Copy = unit->TrackIndex[Slot].Copy;
+    REF_INC(unit->TrackIndex[Slot].Copy->RefCount);
+    shared->NumPending++;
+    return true;
+}
+
+// writes the tracks left by the unit ejected while clones mapped the file, now that the last
+// of them is done with it
+static void WritePendingTracks(u765_SharedDisk* shared) {
+    uint32_t i;
+
+    for (i = 0; i < shared->NumPending; i++) {
+        if (fseek(shared->PendingFile, shared->Pending[i].TrackOffset, SEEK_SET) == 0) {
+            fwrite(shared->Pending[i].Copy->Data, 1, shared->Pending[i].TrackLength, shared->PendingFile);
+        }
+
+        if (REF_DEC(shared->Pending[i].Copy->RefCount) == 0) {
+            free(shared->Pending[i].Copy);
+        }
+    }
+
+    if (shared->PendingFile != NULL) {
+        fclose(shared->PendingFile);
+    }
+
+    free(shared->Pending);
+}
+
+// copies Len bytes of the image from Image, the start of the given track, taking every track
+// the bytes cover from the unit's copy of it when there is one
+static void CopyTrackImage(u765_DiskUnit* unit, u765_TrackIndex* track, uint8_t const* Image, uint8_t* Dest, uint32_t Len) {
+    uint32_t Start, Offset, CopyLen;
+
+    memcpy(Dest, Image, Len);
+
+    if (track == NULL) {
+        return;
+    }
+
+    // tracks are stored in TrackIndex order, so only the ones from this track on can overlap
+    for (Start = track->TrackOffset; track < unit->TrackIndex + unit->NumTrackSlots && track->TrackOffset < Start + Len; track++) {
+        if (track->Copy != NULL && track->TrackOffset >= Start) {
+            Offset = track->TrackOffset - Start;
+            CopyLen = track->TrackLength < Len - Offset ? track->TrackLength : Len - Offset;
+            memcpy(Dest + Offset, track->Copy->Data, CopyLen);
+        }
+    }
+}
+
+// size of a track in the image with the given Disk-Info block, as IndexDisk reads it
+static uint32_t HeaderTrackSize(u765_DiskUnit* unit, uint8_t const* Header, uint32_t Slot) {
+    if (unit->EDSK == true) {
+        return Slot < 0x100 - 0x34 ? (uint32_t)Header[0x34 + Slot] << 8 : 0;
+    }
+
+    return READW(&Header[0x32]);
+}
+
+// lays the image of the unit at ctx->ebx out again with Needed bytes for the track in Slot, DSK
+// tracks all grow to the same size, EDSK tracks only this one. The unit then owns the new image,
+// which is written back whole
+static bool RelayoutImage(Context* ctx, uint32_t Slot, uint32_t Needed) {
+    u765_DiskUnit* unit = ctx->ebx.disk;
+    uint32_t const NumSlots = unit->NumTrackSlots;
+    uint32_t Len, Offset, Size, s;
+    uint8_t Header[0x100];
+    uint8_t* Image;
+
+    // the image never gains tracks or sides, as seeks stop at the last track and head 1 of a single
+    // sided image isn't ready, and the EDSK track size table has room for no more slots
+    if (Slot >= NumSlots || (unit->EDSK == true && Slot >= 0x100 - 0x34)) {
+        return false;
+    }
+
+    // the units still reading a mapped file would have it change under them once it's written
+    if (unit->DiskMapped == true && ImageShared(unit)) {
+        return false;
+    }
+
+    Needed = (Needed + 0xff) & ~0xffu;
+    memcpy(Header, &unit->DiskBlock, sizeof(Header));
+
+    if (unit->EDSK == true) {
+        if (Header[0x34 + Slot] < Needed >> 8) {
+            Header[0x34 + Slot] = (uint8_t)(Needed >> 8);
+        }
+    }
+    else if ((uint32_t)READW(&Header[0x32]) < Needed) {
+        WRITEW(&Header[0x32], Needed);
+    }
+
+    Len = 0x100;
+    for (s = 0; s < NumSlots; s++) {
+        Len += HeaderTrackSize(unit, Header, s);
+    }
+
+    Image = (uint8_t*)calloc(Len, 1);
+
+    if (Image == NULL) {
+        return false;
+    }
+
+    memcpy(Image, Header, sizeof(Header));
+    Offset = 0x100;
+
+    for (s = 0; s < NumSlots; s++) {
+        Size = HeaderTrackSize(unit, Header, s);
+        memcpy(Image + Offset, TrackData(unit, &unit->TrackIndex[s]), unit->TrackIndex[s].TrackLength < Size ? unit->TrackIndex[s].TrackLength : Size);
+        Offset += Size;
+    }
+
+    // a cached image would still be found for the file, which no longer holds it
+    if (unit->SharedDisk != NULL && unit->SharedDisk->Cached == true) {
+        UncacheImage(unit->SharedDisk);
+    }
+
+    FreeDiskArray(ctx);
+    unit->DiskArrayPtr = Image;
+    unit->DiskArrayLen = Len;
+    memcpy(&unit->DiskBlock, Image, sizeof(unit->DiskBlock));
+
+    IndexDisk(ctx, ctx->edi.ctrl->FDCParameters[0]);
+
+    for (s = 0; s < unit->NumTrackSlots; s++) {
+        unit->TrackIndex[s].Dirty = true;
+        unit->TrackIndex[s].Written = true;
+    }
+
+    unit->LayoutChanged = true;
+    unit->ContentsChanged = true;
+    return true;
+}
+
+// Format Track: writes a Track-Info block with the IDs received in FDCFormatIDs and sectors filled
+// with D over the track under the head, in place when the track has room for them
+static void FormatCurrTrack(Context* ctx) {
+    u765_DiskUnit* unit = ctx->ebx.disk;
+    uint8_t const* Params = ctx->edi.ctrl->FDCParameters;   // unit, N, SC, GPL, D
+    uint32_t const Size = DskSectorSize(Params[1]);
+    uint32_t NumSectors = Params[2], Needed, Sector;
+    u765_TrackIndex* Index;
+    uint8_t* Track = NULL;
+
+    // the result phase returns the ID of the last sector
+    if (Params[2] != 0) {
+        memcpy(&ctx->edi.ctrl->FDCResults[3], &ctx->edi.ctrl->FDCFormatIDs[(Params[2] - 1) * 4], 4);
+    }
+
+    // only the sectors the SectorInfoList and an EDSK track size have room for are kept
+    if (NumSectors > 29) {
+        NumSectors = 29;
+    }
+    if (Size != 0 && NumSectors > (0xff00 - 0x100) / Size) {
+        NumSectors = (0xff00 - 0x100) / Size;
+    }
+    Needed = 0x100 + NumSectors * Size;
+
+    CALL(ctx, case_LocateTrack);
+    Index = GetTrackIndex(ctx);
+
+    // the track only moves the others when it has outgrown its room in the image
+    if (unit->TrackIndex != NULL && (Index == NULL || Index->TrackLength < Needed) && RelayoutImage(ctx, unit->TrackSlot, Needed)) {
+        Index = GetTrackIndex(ctx);
+    }
+
+    if (Index != NULL && Index->TrackLength >= Needed) {
+        Track = WritableTrackData(unit, Index);
+    }
+
+    if (Track == NULL) {
+        AND(ctx, ctx->edi.ctrl->ST0, 0x3f);
+        OR(ctx, ctx->edi.ctrl->ST0, 0x40);      // AT
+        OR(ctx, ctx->edi.ctrl->ST1, 2);         // the image can't take the track
+        return;
+    }
+
+    memset(Track, 0, 0x100);
+    memcpy(Track, "Track-Info\r\n", 12);
+    Track[0x10] = unit->CTK;
+    Track[0x11] = unit->CHEAD;
+    Track[0x14] = Params[1];
+    Track[0x15] = (uint8_t)NumSectors;
+    Track[0x16] = Params[3];
+    Track[0x17] = Params[4];
+
+    for (Sector = 0; Sector < NumSectors; Sector++) {
+        memcpy(&Track[0x18 + Sector * 8], &ctx->edi.ctrl->FDCFormatIDs[Sector * 4], 4);
+
+        if (unit->EDSK == true) {
+            WRITEW(&Track[0x18 + Sector * 8 + 6], Size);
+        }
+    }
+
+    memset(Track + 0x100, Params[4], NumSectors * Size);
+    memset(Track + Needed, 0, Index->TrackLength - Needed);
+
+    Index->Dirty = true;
+    Index->Written = true;
+    unit->ContentsChanged = true;
+    unit->CachedTrackSlot = 0xffff;     // TrackBlock still holds the old track
+    IndexSectors(unit);
+}
+
+// ORs into lower and higher whether any of len bytes from the disk is below or above the one
+// from the CPU, leaving out those where either is 0xff. the loop has no early exit, so that
+// it's turned into vector compares when len is a constant
+static void ScanBytes(uint8_t const* disk, uint8_t const* cpu, uint32_t len, uint8_t* lower, uint8_t* higher) {
+    uint8_t lo = *lower, hi = *higher, d, c, care;
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        d = disk[i];
+        c = cpu[i];
+        care = (uint8_t)((d != 0xff) & (c != 0xff));
+        lo |= (uint8_t)((d < c) & care);
+        hi |= (uint8_t)((d > c) & care);
+    }
+
+    *lower = lo;
+    *higher = hi;
+}
+
+// compares the FDC_SENDCnt bytes of sector data at FDC_SENDLoc with those the CPU sent, setting
+// SH in ST2 when they are equal and SN when the scan isn't satisfied
+static void ScanCompare(u765_Controller* ctrl) {
+    uint8_t const* disk = ctrl->FDC_SENDLoc;
+    uint8_t const* cpu = ctrl->FDCScanData;
+    uint32_t len = ctrl->FDC_SENDCnt, i;
+    uint8_t lower = 0, higher = 0;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        ScanBytes(disk + i, cpu + i, 16, &lower, &higher);
+    }
+
+    ScanBytes(disk + i, cpu + i, len - i, &lower, &higher);
+
+    ctrl->ST2 &= 0xf3;
+
+    if ((lower | higher) == 0) {
+        ctrl->ST2 |= 8;         // SH
+    }
+    else if ((ctrl->FDCCommandByte & 0x1f) == 0x11 ||                  // Scan Equal
+        ((ctrl->FDCCommandByte & 0x1f) == 0x19 && higher != 0) ||     // Scan Low or Equal
+        ((ctrl->FDCCommandByte & 0x1f) == 0x1d && lower != 0)) {      // Scan High or Equal
+        ctrl->ST2 |= 4;         // SN
+    }
+}
+
+// the unit's own TrackBlock, which replaces EmptyTrackBlock the first time it's needed
+// and is then kept until the controller is shut down
+static u765_TrackInfoBlock* UnitTrackBlock(u765_DiskUnit* unit) {
+    u765_TrackInfoBlock* block;
+
+    if (unit->TrackBlock == &EmptyTrackBlock) {
+        block = (u765_TrackInfoBlock*)calloc(1, sizeof(u765_TrackInfoBlock));
+
+        if (block == NULL) {
+            return NULL;
+        }
+
+        unit->TrackBlock = block;
+    }
+
+    return unit->TrackBlock;
+}
+
+// the buffer random sector data is built in, allocated for the first disk that needs it
+static uint8_t* RandomData(u765_Controller* ctrl) {
+    if (ctrl->FDCRandomData == NULL) {
+        ctrl->FDCRandomData = (uint8_t*)malloc(U765_RANDOM_DATA_SIZE);
+    }
+
+    return ctrl->FDCRandomData;
+}
+
+// the buffer the Scan commands receive the CPU bytes in, allocated for the first scan
+static uint8_t* ScanData(u765_Controller* ctrl) {
+    if (ctrl->FDCScanData == NULL) {
+        ctrl->FDCScanData = (uint8_t*)malloc(U765_SCAN_DATA_SIZE);
+    }
+
+    return ctrl->FDCScanData;
+}
+
+// the buffer Format Track receives the sector IDs in, allocated for the first format
+static uint8_t* FormatIDs(u765_Controller* ctrl) {
+    if (ctrl->FDCFormatIDs == NULL) {
+        ctrl->FDCFormatIDs = (uint8_t*)malloc(U765_FORMAT_IDS_SIZE);
+    }
+
+    return ctrl->FDCFormatIDs;
+}
+
+// gives Clone, a byte copy of Source, its own copies of the buffers kept outside the controller
+static bool CloneBuffers(u765_Controller* Source, u765_Controller* Clone) {
+    u765_DiskUnit* From = Source->FDDUnit;
+    u765_DiskUnit* To = Clone->FDDUnit;
+    uint32_t Unit, Units = UnitSlots(Source->NumUnits);
+    bool Ok = true;
+
+    Clone->FDCRandomData = NULL;
+    Clone->FDCScanData = NULL;
+    Clone->FDCFormatIDs = NULL;
+
+    for (Unit = 0; Unit < Units; Unit++) {
+        To[Unit].TrackBlock = &EmptyTrackBlock;
+    }
+
+    if (Source->FDCRandomData != NULL) {
+        Ok = RandomData(Clone) != NULL;
+    }
+
+    if (Source->FDCScanData != NULL && Ok) {
+        Ok = ScanData(Clone) != NULL;
+    }
+
+    if (Source->FDCFormatIDs != NULL && Ok) {
+        Ok = FormatIDs(Clone) != NULL;
+    }
+
+    for (Unit = 0; Unit < Units && Ok; Unit++) {
+        if (From[Unit].TrackBlock != &EmptyTrackBlock) {
+            Ok = UnitTrackBlock(&To[Unit]) != NULL;
+        }
+    }
+
+    if (!Ok) {
+        FreeBuffers(Clone);
+        return false;
+    }
+
+    // pointers into the buffers move to the clone's copies, one past the end included
+#define CLONE_BUF(p, from, to, len) do { if ((uint8_t*)(p) >= (uint8_t*)(from) && (uint8_t*)(p) <= (uint8_t*)(from) + (len)) (p) = (void*)((uint8_t*)(to) + ((uint8_t*)(p) - (uint8_t*)(from))); } while (0)
+#define CLONE_BUFS(from, to, len) do { \
+        memcpy((to), (from), (len)); \
+        CLONE_BUF(Clone->FDC_RCVDLoc, (from), (to), (len)); \
+        CLONE_BUF(Clone->FDC_SENDLoc, (from), (to), (len)); \
+        CLONE_BUF(Clone->CurrentSectorData, (from), (to), (len)); \
+        CLONE_BUF(Clone->CurrentSectorInfo, (from), (to), (len)); \
+    } while (0)
+
+    if (Source->FDCRandomData != NULL) {
+        CLONE_BUFS(Source->FDCRandomData, Clone->FDCRandomData, U765_RANDOM_DATA_SIZE);
+    }
+
+    if (Source->FDCScanData != NULL) {
+        CLONE_BUFS(Source->FDCScanData, Clone->FDCScanData, U765_SCAN_DATA_SIZE);
+    }
+
+    if (Source->FDCFormatIDs != NULL) {
+        CLONE_BUFS(Source->FDCFormatIDs, Clone->FDCFormatIDs, U765_FORMAT_IDS_SIZE);
+    }
+
+    for (Unit = 0; Unit < Units; Unit++) {
+        if (From[Unit].TrackBlock != &EmptyTrackBlock) {
+            CLONE_BUFS(From[Unit].TrackBlock, To[Unit].TrackBlock, sizeof(u765_TrackInfoBlock));
+        }
+    }
+#undef CLONE_BUFS
+#undef CLONE_BUF
+
+    return true;
+}
+
+static void FreeBuffers(u765_Controller* ctrl) {
+    uint32_t Unit;
+
+    free(ctrl->FDCRandomData);
+    ctrl->FDCRandomData = NULL;
+    free(ctrl->FDCScanData);
+    ctrl->FDCScanData = NULL;
+    free(ctrl->FDCFormatIDs);
+    ctrl->FDCFormatIDs = NULL;
+
+    for (Unit = 0; Unit < UnitSlots(ctrl->NumUnits); Unit++) {
+        if (ctrl->FDDUnit[Unit].TrackBlock != &EmptyTrackBlock) {
+            free(ctrl->FDDUnit[Unit].TrackBlock);
+            ctrl->FDDUnit[Unit].TrackBlock = &EmptyTrackBlock;
+        }
+    }
+}
+
+// shares the images in the units of Source with the units of Clone, a byte copy of Source
+static bool CloneDiskUnits(u765_Controller* Source, u765_Controller* Clone) {
+    u765_DiskUnit* From = Source->FDDUnit;
+    u765_DiskUnit* To = Clone->FDDUnit;
+    u765_TrackIndex* TrackIndex[4] = { NULL, NULL, NULL, NULL };
+    u765_SectorIndex* SectorIndex[4] = { NULL, NULL, NULL, NULL };
+    u765_SharedDisk* SharedDisk[4] = { NULL, NULL, NULL, NULL };
+    uint32_t Unit, Units = UnitSlots(Source->NumUnits), Slot;
+    bool Ok = true;
+
+    // pointers into the controller itself move with the clone
+#define CLONE_PTR(p) do { if ((uint8_t*)(p) >= (uint8_t*)Source && (uint8_t*)(p) < (uint8_t*)Source + ControllerSize(Source->NumUnits)) (p) = (void*)((uint8_t*)Clone + ((uint8_t*)(p) - (uint8_t*)Source)); } while (0)
+    CLONE_PTR(Clone->FDC_RCVDLoc);
+    CLONE_PTR(Clone->FDC_SENDLoc);
+    CLONE_PTR(Clone->CurrentSectorData);
+    CLONE_PTR(Clone->CurrentSectorInfo);
+    CLONE_PTR(Clone->UnitPtr);
+    CLONE_PTR(Clone->SeekUnitPtr);
+#undef CLONE_PTR
+
+    // everything is allocated before any image is shared, so a failure leaves Source as it was
+    for (Unit = 0; Unit < Units; Unit++) {
+        if (From[Unit].DiskArrayPtr == NULL) {
+            continue;
+        }
+
+        if (From[Unit].TrackIndex == NULL) {
+            Ok = false;     // written tracks can't be copied without the index
+            break;
+        }
+
+        TrackIndex[Unit] = (u765_TrackIndex*)malloc((From[Unit].NumTrackSlots + 1) * sizeof(u765_TrackIndex));
+        SectorIndex[Unit] = (u765_SectorIndex*)malloc((From[Unit].NumTrackSlots * 29 + 1) * sizeof(u765_SectorIndex));
+
+        if (From[Unit].SharedDisk == NULL) {
+            SharedDisk[Unit] = (u765_SharedDisk*)malloc(sizeof(u765_SharedDisk));
+        }
+
+        if (TrackIndex[Unit] == NULL || SectorIndex[Unit] == NULL || (From[Unit].SharedDisk == NULL && SharedDisk[Unit] == NULL)) {
+            Ok = false;
+            break;
+        }
+    }
+
+    if (!Ok) {
+        for (Unit = 0; Unit < Units; Unit++) {
+            free(TrackIndex[Unit]);
+            free(SectorIndex[Unit]);
+            free(SharedDisk[Unit]);
+        }
+
+        return false;
+    }
+
+    for (Unit = 0; Unit < Units; Unit++) {
+        // the clone's changes go to its write-back callback, never to the file
+        To[Unit].DiskFileHandle = NULL;
+
+        if (From[Unit].DiskArrayPtr == NULL) {
+            To[Unit].TrackIndex = NULL;
+            To[Unit].SectorIndex = NULL;
+            To[Unit].NumTrackSlots = 0;
+            continue;
+        }
+
+        if (From[Unit].SharedDisk == NULL) {
+            SharedDisk[Unit]->RefCount = 1;
+            SharedDisk[Unit]->DiskArrayPtr = From[Unit].DiskArrayPtr;
+            SharedDisk[Unit]->DiskArrayLen = From[Unit].DiskArrayLen;
+            SharedDisk[Unit]->DiskMapped = From[Unit].DiskMapped;
+            SharedDisk[Unit]->DiskBorrowed = From[Unit].DiskBorrowed;
+            SharedDisk[Unit]->Cached = false;
+            SharedDisk[Unit]->Listed = false;
+            SharedDisk[Unit]->PendingFile = NULL;
+            SharedDisk[Unit]->Pending = NULL;
+            SharedDisk[Unit]->NumPending = 0;
+            From[Unit].SharedDisk = SharedDisk[Unit];
+        }
+
+        REF_INC(From[Unit].SharedDisk->RefCount);
+        To[Unit].SharedDisk = From[Unit].SharedDisk;
+
+        memcpy(TrackIndex[Unit], From[Unit].TrackIndex, (From[Unit].NumTrackSlots + 1) * sizeof(u765_TrackIndex));
+        memcpy(SectorIndex[Unit], From[Unit].SectorIndex, (From[Unit].NumTrackSlots * 29 + 1) * sizeof(u765_SectorIndex));
+        To[Unit].TrackIndex = TrackIndex[Unit];
+        To[Unit].SectorIndex = SectorIndex[Unit];
+
+        for (Slot = 0; Slot < From[Unit].NumTrackSlots; Slot++) {
+            if (From[Unit].TrackIndex[Slot].Copy != NULL) {
+                REF_INC(From[Unit].TrackIndex[Slot].Copy->RefCount);
+            }
+        }
+    }
+
+    return true;
+}
+
+// points ctx->esi.u8 and ctx->ecx.u8 to the sector info and data of the physical
+// sector given, the same pointers a SkipNextSector walk from sector 0 ends with
+static bool IndexedSectorPtrs(Context* ctx, uint8_t sector) {
+    u765_TrackIndex* index = GetTrackIndex(ctx);
+
+    if (index == NULL || sector >= index->NumSectors) {
+        return false;
+    }
+
+    ctx->esi.u8 = &ctx->ebx.disk->TrackBlock->SectorInfoList[sector * 8];
+    ctx->ecx.u8 = &ctx->ebx.disk->TrackBlock->SectorData[0];
+    ctx->ecx.u8 += ctx->ebx.disk->SectorIndex[index->FirstSector + sector].DataOffset;
+    return true;
+}
+
+// called from SkipReadSector when the sector at CSR did not match, moves straight to the next
+// sector that will, using the CHRN of each indexed sector. the sectors in between would have
+// been read and discarded without side effects. if no sector matches within the revolutions
+// left, moves to the final sector of the search so the not-found path runs as before
+static bool SkipToMatchingSector(Context* ctx) {
+    u765_TrackIndex* index = GetTrackIndex(ctx);
+    u765_SectorIndex* sectors;
+    uint32_t chrn, next, revolution, found;
+    uint8_t NumSectors = ctx->ebx.disk->TrackBlock->NumSectors;
+
+    if (index == NULL || NumSectors == 0 || NumSectors != index->NumSectors) {
+        return false;
+    }
+
+    sectors = &ctx->ebx.disk->SectorIndex[index->FirstSector];
+    chrn = READDW(&ctx->edi.ctrl->FDCParameters[1]);
+    next = ctx->ebx.disk->CSR + 1;
+    revolution = ctx->edi.ctrl->IndexHoleCount;
+    found = NumSectors;
+
+    for (; revolution < 2; revolution++, next = 0) {
+        for (; next < NumSectors; next++) {
+            if (sectors[next].CHRN == chrn) {
+                found = next;
+                break;
+            }
+        }
+
+        if (found != NumSectors) {
+            break;
+        }
+    }
+
+    if (found == NumSectors) {
+        // nothing matches, visit the final sector of the last revolution
+        revolution = 1;
+        found = NumSectors - 1;
+    }
+
+    if (revolution == ctx->edi.ctrl->IndexHoleCount && found <= (uint32_t)ctx->ebx.disk->CSR + 1) {
+        return false;   // the next physical sector, nothing to skip
+    }
+
+    if (revolution != ctx->edi.ctrl->IndexHoleCount) {
+        // crossing the index hole, as InitReadSector does
+        STAT(ctx->edi.ctrl, Revolutions, revolution - ctx->edi.ctrl->IndexHoleCount);
+        ctx->edi.ctrl->IndexHoleCount = revolution;
+        ctx->edi.ctrl->CurrentSectorSize = DskSectorSize(ctx->ebx.disk->TrackBlock->SectorSize);
+        ctx->edi.ctrl->ST2DAMBit = 0;
+    }
+
+    ctx->ebx.disk->CSR = found;
+    IndexedSectorPtrs(ctx, found);
+    ctx->edi.ctrl->CurrentSectorData = TrackBlockData(ctx->ebx.disk, ctx->ecx.u8);
+    ctx->edi.ctrl->CurrentSectorInfo = ctx->esi.u8;
+    return true;
+}
+
+/*-----------------------------------------------------------------------------
+SAVE STATE
+-----------------------------------------------------------------------------*/
+
+static void StateBytes(StateStream* s, void* value, uint32_t len) {
+    if (len == 0) {
+        return;
+    }
+
+    if (s->Load) {
+        if (len > s->Len - s->Pos || s->Pos > s->Len) {
+            s->Ok = false;
+            return;
+        }
+
+        memcpy(value, s->Data + s->Pos, len);
+    }
+    else if (s->Data != NULL && s->Pos <= s->Len && len <= s->Len - s->Pos) {
+        memcpy(s->Data + s->Pos, value, len);
+    }
+
+    s->Pos += len;
+}
+
+static void StateByte(StateStream* s, uint8_t* value) {
+    StateBytes(s, value, 1);
+}
+
+static void StateBool(StateStream* s, bool* value) {
+    uint8_t b = *value;
+    StateByte(s, &b);
+    *value = b != 0;
+}
+
+static void StateWord(StateStream* s, uint16_t* value) {
+    uint8_t b[2];
+    WRITEW(b, *value);
+    StateBytes(s, b, 2);
+    *value = READW(b);
+}
+
+static void StateDword(StateStream* s, uint32_t* value) {
+    uint8_t b[4];
+    WRITEDW(b, *value);
+    StateBytes(s, b, 4);
+    *value = READDW(b);
+}
+
+static void StateLabel(StateStream* s, unsigned* value) {
+    uint32_t v = *value;
+    StateDword(s, &v);
+    *value = v;
+}
+
+// a value that isn't restored but has to match on load, like the size of an inserted image
+static void StateCheck(StateStream* s, uint32_t value) {
+    uint32_t v = value;
+    StateDword(s, &v);
+
+    if (v != value) {
+        s->Ok = false;
+    }
+}
+
+// the memory a pointer tag refers to: the controller (tag 1), the image of a unit (tags 2, 3, 8, 9),
+// the random data buffer (tag 4), the TrackBlock of a unit (tags 5, 6, 10, 11) or the scan data
+// buffer (tag 7)
+static uint8_t* StatePointerBase(u765_Controller* ctrl, uint32_t tag, size_t* len) {
+    static uint8_t const units[12] = { 0, 0, 0, 1, 0, 0, 1, 0, 2, 3, 2, 3 };
+    u765_DiskUnit* unit = tag < 12 && units[tag] < UnitSlots(ctrl->NumUnits) ? &ctrl->FDDUnit[units[tag]] : NULL;
+
+    switch (tag) {
+    case 1:
+        *len = ControllerSize(ctrl->NumUnits);
+        return (uint8_t*)ctrl;
+    case 2:
+    case 3:
+    case 8:
+    case 9:
+        if (unit == NULL) {
+            break;
+        }
+        *len = unit->DiskArrayLen;
+        return (uint8_t*)unit->DiskArrayPtr;
+    case 4:
+        *len = U765_RANDOM_DATA_SIZE;
+        return ctrl->FDCRandomData;
+    case 5:
+    case 6:
+    case 10:
+    case 11:
+        if (unit == NULL) {
+            break;
+        }
+        *len = sizeof(u765_TrackInfoBlock);
+        return (uint8_t*)unit->TrackBlock;
+    case 7:
+        *len = U765_SCAN_DATA_SIZE;
+        return ctrl->FDCScanData;
+    case 12:
+        *len = U765_FORMAT_IDS_SIZE;
+        return ctrl->FDCFormatIDs;
+    }
+
+    *len = 0;
+    return NULL;
+}
+
+// pointers are saved as a tag and an offset into the memory it refers to
+static void StatePointer(StateStream* s, u765_Controller* ctrl, uint8_t** value) {
+    uint8_t* base;
+    size_t len;
+    uint32_t v = 0, tag, offset;
+
+    if (!s->Load && *value != NULL) {
+        v = 0xffffffff;
+
+        for (tag = 1; tag <= 12 && v == 0xffffffff; tag++) {
+            base = StatePointerBase(ctrl, tag, &len);
+
+            if (base != NULL && *value >= base && *value <= base + len) {
+                v = tag << 28 | (uint32_t)(*value - base);
+            }
+        }
+
+        if (v == 0xffffffff) {
+            s->Ok = false;      // points somewhere that can't be restored
+        }
+    }
+
+    StateDword(s, &v);
+
+    if (s->Load) {
+        tag = v >> 28;
+        offset = v & 0x0fffffff;
+        *value = NULL;
+
+        if (tag == 4) {
+            RandomData(ctrl);   // random data was being sent, the buffer has to exist again
+        }
+        else if (tag == 7) {
+            ScanData(ctrl);     // a scan was receiving bytes
+        }
+        else if (tag == 12) {
+            FormatIDs(ctrl);    // and so was a format
+        }
+
+        base = StatePointerBase(ctrl, tag, &len);
+
+        if (base != NULL && offset <= len) {
+            *value = base + offset;
+        }
+        else if (v != 0) {
+            s->Ok = false;
+        }
+    }
+}
+
+static void StateUnitPtr(StateStream* s, u765_Controller* ctrl, u765_DiskUnit** value) {
+    uint8_t v = *value != NULL ? (uint8_t)(*value - ctrl->FDDUnit) : 0xff;
+    StateByte(s, &v);
+    *value = v < UnitSlots(ctrl->NumUnits) ? &ctrl->FDDUnit[v] : NULL;
+}
+
+// fills TrackBlock the way ReadCurrTrack does for the given slot, or with zeros for 0xffff
+static void StateTrackBase(u765_DiskUnit* unit, uint16_t slot, uint8_t* base) {
+    uint32_t len = 0;
+
+    if (slot < unit->NumTrackSlots) {
+        len = unit->TrackIndex[slot].TrackLength;
+        if (len > sizeof(u765_TrackInfoBlock)) {
+            len = sizeof(u765_TrackInfoBlock);
+        }
+
+        CopyTrackImage(unit, &unit->TrackIndex[slot], (uint8_t*)unit->DiskArrayPtr + unit->TrackIndex[slot].TrackOffset, base, len);
+    }
+
+    memset(base + len, 0, sizeof(u765_TrackInfoBlock) - len);
+}
+
+// writes the runs of bytes where block differs from base, ended by a run of length 0
+static void StateTrackRuns(StateStream* s, uint8_t* block, uint8_t const* base) {
+    uint16_t offset, len;
+    uint32_t i, end;
+
+    for (i = 0; i < sizeof(u765_TrackInfoBlock); i = end) {
+        if (block[i] == base[i]) {
+            end = i + 1;
+            continue;
+        }
+
+        // runs separated by less than the size of a run header are merged
+        for (end = i + 1; end < sizeof(u765_TrackInfoBlock); end++) {
+            if (memcmp(block + end, base + end, end + 4 <= sizeof(u765_TrackInfoBlock) ? 4 : sizeof(u765_TrackInfoBlock) - end) == 0) {
+                break;
+            }
+        }
+
+        offset = (uint16_t)i;
+        len = (uint16_t)(end - i);
+        StateWord(s, &offset);
+        StateWord(s, &len);
+        StateBytes(s, block + i, len);
+    }
+
+    offset = 0;
+    len = 0;
+    StateWord(s, &offset);
+    StateWord(s, &len);
+}
+
+// TrackBlock is saved as the runs of bytes that differ from an image track, or from zeros
+// for slot 0xffff, whichever base gives the fewest bytes, and not at all while it's EmptyTrackBlock
+static void StateTrackBlock(StateStream* s, u765_DiskUnit* unit) {
+    uint8_t* block = (uint8_t*)unit->TrackBlock;
+    uint8_t* base;
+    uint16_t slot = 0xffff, offset = 0, len = 0;
+    uint16_t candidates[3] = { unit->CachedTrackSlot, unit->TrackSlot, 0xffff };
+    uint32_t i, size, best = 0xffffffff;
+    bool allocated = unit->TrackBlock != &EmptyTrackBlock;
+    StateStream count;
+
+    StateBool(s, &allocated);
+
+    if (s->Load) {
+        if (allocated == false) {
+            if (unit->TrackBlock != &EmptyTrackBlock) {
+                memset(unit->TrackBlock, 0, sizeof(u765_TrackInfoBlock));
+            }
+            return;
+        }
+
+        block = (uint8_t*)UnitTrackBlock(unit);
+
+        if (block == NULL) {
+            s->Ok = false;
+            return;
+        }
+
+        StateWord(s, &slot);
+        StateTrackBase(unit, slot, block);
+
+        for (;;) {
+            StateWord(s, &offset);
+            StateWord(s, &len);
+
+            if (s->Ok == false || len == 0) {
+                return;
+            }
+
+            if ((uint32_t)offset + len > sizeof(u765_TrackInfoBlock)) {
+                s->Ok = false;
+                return;
+            }
+
+            StateBytes(s, block + offset, len);
+        }
+    }
+
+    if (allocated == false) {
+        return;
+    }
+
+    base = (uint8_t*)malloc(sizeof(u765_TrackInfoBlock));
+
+    if (base == NULL) {
+        s->Ok = false;
+        return;
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (candidates[i] != 0xffff && candidates[i] >= unit->NumTrackSlots) {
+            continue;
+        }
+
+        count.Data = NULL;
+        count.Pos = 0;
+        count.Len = 0;
+        count.Load = false;
+        count.Ok = true;
+
+        StateTrackBase(unit, candidates[i], base);
+        StateTrackRuns(&count, block, base);
+        size = count.Pos;
+
+        if (size < best) {
+            best = size;
+            slot = candidates[i];
+        }
+
+        if (size == 4) {
+            break;      // nothing but the end marker
+        }
+    }
+
+    StateWord(s, &slot);
+    StateTrackBase(unit, slot, base);
+    StateTrackRuns(s, block, base);
+
+    free(base);
+}
+
+// tracks written since the disk was inserted, as whole tracks, ended by slot 0xffff
+static void StateDiskDelta(StateStream* s, u765_DiskUnit* unit, uint32_t Flags) {
+    u765_TrackIndex* track;
+    uint8_t* data;
+    uint16_t slot = 0;
+
+    if (s->Load) {
+        for (;;) {
+            StateWord(s, &slot);
+
+            if (s->Ok == false || slot == 0xffff) {
+                return;
+            }
+
+            if (slot >= unit->NumTrackSlots) {
+                s->Ok = false;
+                return;
+            }
+
+            track = &unit->TrackIndex[slot];
+
+            if (track->TrackLength > s->Len - s->Pos) {
+                s->Ok = false;
+                return;
+            }
+
+            if (memcmp(TrackData(unit, track), s->Data + s->Pos, track->TrackLength) != 0) {
+                if (s->Apply) {
+                    data = WritableTrackData(unit, track);
+
+                    if (data == NULL) {
+                        s->Ok = false;
+                        return;
+                    }
+
+                    memcpy(data, s->Data + s->Pos, track->TrackLength);
+                    track->Dirty = true;
+                    unit->ContentsChanged = true;
+                }
+            }
+
+            if (s->Apply) {
+                track->Written = true;
+            }
+
+            s->Pos += track->TrackLength;
+        }
+    }
+
+    if ((Flags & u765_StateDiskDelta) != 0) {
+        for (slot = 0; slot < unit->NumTrackSlots; slot++) {
+            if (unit->TrackIndex[slot].Written == true) {
+                StateWord(s, &slot);
+                StateBytes(s, TrackData(unit, &unit->TrackIndex[slot]), unit->TrackIndex[slot].TrackLength);
+            }
+        }
+    }
+
+    slot = 0xffff;
+    StateWord(s, &slot);
+}
+
+static uint32_t StateDiskHash(u765_DiskUnit* unit) {
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < sizeof(u765_DiskInfoBlock); i++) {
+        hash = (hash ^ ((uint8_t*)&unit->DiskBlock)[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static void StateUnit(StateStream* s, u765_DiskUnit* unit, uint32_t Flags) {
+    // the images themselves are not part of the state, only checked to be the same
+    StateCheck(s, unit->DiskInserted);
+    StateCheck(s, (uint32_t)unit->DiskArrayLen);
+    StateCheck(s, unit->NumTrackSlots);
+    StateCheck(s, StateDiskHash(unit));
+
+    if (s->Ok == false) {
+        return;
+    }
+
+    StateBool(s, &unit->ContentsChanged);
+    StateBool(s, &unit->WriteProtect);
+    StateBool(s, &unit->EDSK);
+    StateBool(s, &unit->DriveStateChanged);
+    StateByte(s, &unit->CTK);
+    StateByte(s, &unit->CHEAD);
+    StateByte(s, &unit->CSR);
+    StateBool(s, &unit->SeekDone);
+    StateWord(s, &unit->TrackSlot);
+    StateWord(s, &unit->CachedTrackSlot);
+
+    // the disk has to be brought up to date before TrackBlock is rebuilt from it
+    StateDiskDelta(s, unit, Flags);
+    StateTrackBlock(s, unit);
+}
+
+static void StateController(StateStream* s, u765_Controller* ctrl, uint32_t Flags) {
+    uint8_t magic[4] = { 'U', '7', '6', '5' };
+    uint16_t version = U765_STATE_VERSION;
+    uint32_t Unit;
+    uint8_t mode;
+    uint16_t len;
+
+    StateBytes(s, magic, 4);
+    StateWord(s, &version);
+
+    if (memcmp(magic, "U765", 4) != 0 || version != U765_STATE_VERSION) {
+        s->Ok = false;
+        return;
+    }
+
+    // a state only loads into a controller with as many units
+    StateCheck(s, ctrl->NumUnits);
+
+    if (!s->Ok) {
+        return;
+    }
+
+    // the units come first, pointers into their TrackBlocks need them allocated on load
+    for (Unit = 0; Unit < UnitSlots(ctrl->NumUnits); Unit++) {
+        StateUnit(s, &ctrl->FDDUnit[Unit], Flags);
+    }
+
+    StatePointer(s, ctrl, &ctrl->FDC_RCVDLoc);
+    StatePointer(s, ctrl, &ctrl->FDC_SENDLoc);
+    StateDword(s, &ctrl->CurrentSectorSize);
+    StatePointer(s, ctrl, &ctrl->CurrentSectorData);
+    StatePointer(s, ctrl, &ctrl->CurrentSectorInfo);
+    StateLabel(s, &ctrl->SectorToCPUReturn);
+    StateLabel(s, &ctrl->CPUToSectorReturn);
+    StateLabel(s, &ctrl->FDCVector);
+    StateLabel(s, &ctrl->FDCReturn);
+    StateLabel(s, &ctrl->FDCBufferReturn);
+    StateDword(s, &ctrl->CurrentFDDArrayPtr);
+    StateUnitPtr(s, ctrl, &ctrl->UnitPtr);
+    StateUnitPtr(s, ctrl, &ctrl->SeekUnitPtr);
+    StateDword(s, &ctrl->BytesSaved);
+    StateDword(s, &ctrl->PhysicalSectorSize);
+    StateDword(s, &ctrl->AvailableSectorData);
+    StateDword(s, &ctrl->MultipleSectorPick);
+    StateWord(s, &ctrl->FDCCmdPC);
+    StateWord(s, &ctrl->FDC_RCVDCnt);
+    StateWord(s, &ctrl->FDC_SENDCnt);
+
+    // the byte registers from SelectedUnit to DskRndMethod, one after the other
+    StateByte(s, &ctrl->SelectedUnit);
+    StateByte(s, &ctrl->LED);
+    StateByte(s, &ctrl->MainStatusReg);
+    StateByte(s, &ctrl->Byte_3FFD);
+    StateByte(s, &ctrl->ST0);
+    StateByte(s, &ctrl->ST1);
+    StateByte(s, &ctrl->ST2);
+    StateByte(s, &ctrl->ST3);
+    StateByte(s, &ctrl->SeekResult);
+    StateByte(s, &ctrl->TSEError);
+    StateByte(s, &ctrl->ST2DAMBit);
+    StateByte(s, &ctrl->IndexHoleCount);
+    StateByte(s, &ctrl->LastFDCCmd);
+    StateByte(s, &ctrl->FDCRandomSeed);
+    StateByte(s, &ctrl->DAM_Mask);
+    StateByte(s, &ctrl->SectorsRead);
+    StateByte(s, &ctrl->OverRunCounter);
+    StateByte(s, &ctrl->MotorOffTimer);
+    StateByte(s, &ctrl->NewMotorState);
+    StateByte(s, &ctrl->MotorState);
+    StateByte(s, &ctrl->DTL_BytesSent);
+    StateByte(s, &ctrl->ValidTrack);
+    StateByte(s, &ctrl->OverRunTest);
+    StateByte(s, &ctrl->OverRunError);
+    StateBool(s, &ctrl->MultiSectorRead);
+    StateByte(s, &ctrl->SectorsTransferred);
+    StateByte(s, &ctrl->NumParams);
+    StateByte(s, &ctrl->NumResults);
+    StateByte(s, &ctrl->OriginalR);
+    StateByte(s, &ctrl->RetCSR0);
+    StateByte(s, &ctrl->CurrentSectorNumber);
+    StateByte(s, &ctrl->DskRndMethod);
+
+    mode = (uint8_t)ctrl->ReadMode;
+    StateByte(s, &mode);
+    ctrl->ReadMode = (u765_ReadMode)mode;
+    mode = (uint8_t)ctrl->WriteMode;
+    StateByte(s, &mode);
+    ctrl->WriteMode = (u765_WriteMode)mode;
+
+    StateByte(s, &ctrl->FDCCommandByte);
+    StateBytes(s, ctrl->FDCParameters, sizeof(ctrl->FDCParameters));
+    StateBytes(s, ctrl->FDCResults, sizeof(ctrl->FDCResults));
+
+    // only the random bytes still to be sent to the CPU matter
+    len = 0;
+    if (ctrl->FDCRandomData != NULL && ctrl->FDC_SENDLoc >= ctrl->FDCRandomData && ctrl->FDC_SENDLoc < ctrl->FDCRandomData + U765_RANDOM_DATA_SIZE) {
+        len = ctrl->FDC_SENDCnt;
+        if (len > ctrl->FDCRandomData + U765_RANDOM_DATA_SIZE - ctrl->FDC_SENDLoc) {
+            len = (uint16_t)(ctrl->FDCRandomData + U765_RANDOM_DATA_SIZE - ctrl->FDC_SENDLoc);
+        }
+    }
+
+    StateCheck(s, len);
+    StateBytes(s, ctrl->FDC_SENDLoc, len);
+
+    // and only the bytes a scan has received so far
+    len = 0;
+    if (ctrl->FDCScanData != NULL && ctrl->FDC_RCVDLoc > ctrl->FDCScanData && ctrl->FDC_RCVDLoc <= ctrl->FDCScanData + U765_SCAN_DATA_SIZE) {
+        len = (uint16_t)(ctrl->FDC_RCVDLoc - ctrl->FDCScanData);
+    }
+
+    StateCheck(s, len);
+    StateBytes(s, ctrl->FDCScanData, len);
+
+    // and the sector IDs a format has received
+    len = 0;
+    if (ctrl->FDCFormatIDs != NULL && ctrl->FDC_RCVDLoc > ctrl->FDCFormatIDs && ctrl->FDC_RCVDLoc <= ctrl->FDCFormatIDs + U765_FORMAT_IDS_SIZE) {
+        len = (uint16_t)(ctrl->FDC_RCVDLoc - ctrl->FDCFormatIDs);
+    }
+
+    StateCheck(s, len);
+    StateBytes(s, ctrl->FDCFormatIDs, len);
+}
+
+static void SetFastDisk(Context* ctx) {
+    if (ctx->edi.ctrl->ActiveCallback != NULL) {
+        ctx->edi.ctrl->ActiveCallback();
+    }
+    else if (ctx->edi.ctrl->ActiveCallbackEx != NULL) {
+        ctx->edi.ctrl->ActiveCallbackEx(ctx->edi.ctrl->ActiveUser);
+    }
+}
+
+static void InitFDC(Context* ctx) {
+    ctx->edi.ctrl->LED = 0;
+    ctx->edi.ctrl->FDCVector = case_FDC_NewCommand;
+    ctx->edi.ctrl->OverRunTest = false;
+    ctx->edi.ctrl->OverRunError = false;
+    ctx->edi.ctrl->MainStatusReg = 128;          // FDC is ready for a new command
+
+    // call command callback with no cmd executing
+    ctx->edi.ctrl->FDCCommandByte = 0;         // no command executing
+    FDCCommandCallback(ctx, 1);
+}
+
+// FDC->CPU block transfer for the execution phase, drains FDC_SENDLoc/FDC_SENDCnt in runs.
+// the final byte of each run goes through the engine's data port read so FDCReturn is taken exactly
+// as in the byte by byte path, and the command and result phases are left untouched. a NULL
+// buffer skips bytes the host has already taken from FDC_SENDLoc
+static uint32_t SendDataBlock(Context* ctx, uint8_t* buffer, uint32_t len) {
+    ctx->edx.e = 0;                 // bytes transferred so far
+
+    while (ctx->edx.e < len) {
+        ctx->eax.l = ctx->edi.ctrl->MainStatusReg;
+        AND(ctx, ctx->eax.l, 0xe0);
+        CMP(ctx, ctx->eax.l, 0xe0);  // execution mode + FDC->CPU + ready?
+        if (!ctx->zero || ctx->edi.ctrl->FDCVector != case_FDC_SendData1) {
+            break;
+        }
+
+        ctx->ecx.e = ctx->edi.ctrl->FDC_SENDCnt;
+
+        if (ctx->ecx.e > 1) {
+            DEC(ctx, ctx->ecx.e);     // leave the final byte of the run
+            if (ctx->ecx.e > len - ctx->edx.e) {
+                ctx->ecx.e = len - ctx->edx.e;
+            }
+
+            if (buffer != NULL) {
+                memcpy(buffer + ctx->edx.e, ctx->edi.ctrl->FDC_SENDLoc, ctx->ecx.e);
+            }
+
+            ctx->edi.ctrl->FDC_SENDLoc += ctx->ecx.e;
+            ctx->edi.ctrl->FDC_SENDCnt -= ctx->ecx.x;
+            ADD(ctx, ctx->edx.e, ctx->ecx.e);
+
+            // leave the same state as FDC_SendData2 after each byte
+            ctx->edi.ctrl->Byte_3FFD = ctx->edi.ctrl->FDC_SENDLoc[-1];
+            ctx->edi.ctrl->OverRunTest = true;
+            ctx->edi.ctrl->OverRunCounter = 64;
+            continue;
+        }
+
+        ctx->eax.l = ctx->edi.ctrl->Engine == u765_EngineDirect ? DirectDataRead(ctx->edi.ctrl) : LabelDataRead(ctx->edi.ctrl);
+
+        if (buffer != NULL) {
+            buffer[ctx->edx.e] = ctx->eax.l;
+        }
+        INC(ctx, ctx->edx.e);
+    }
+
+    return ctx->edx.e;
+}
+
+// CPU->FDC block transfer for the execution phase, fills FDC_RCVDLoc/FDC_RCVDCnt in runs.
+// the final byte of each run goes through the engine's data port write so FDCReturn is taken exactly
+// as in the byte by byte path. a NULL buffer skips bytes the host has already put at FDC_RCVDLoc
+static uint32_t ReceiveDataBlock(Context* ctx, uint8_t const* buffer, uint32_t len) {
+    ctx->edx.e = 0;                 // bytes transferred so far
+
+    while (ctx->edx.e < len) {
+        ctx->eax.l = ctx->edi.ctrl->MainStatusReg;
+        AND(ctx, ctx->eax.l, 0xe0);
+        CMP(ctx, ctx->eax.l, 0xa0);  // execution mode + CPU->FDC + ready?
+        if (!ctx->zero || ctx->edi.ctrl->FDCVector != case_FDC_ReceiveDataLoop) {
+            break;
+        }
+
+        ctx->ecx.e = ctx->edi.ctrl->FDC_RCVDCnt;
+
+        if (ctx->ecx.e > 1) {
+            DEC(ctx, ctx->ecx.e);     // leave the final byte of the run
+            if (ctx->ecx.e > len - ctx->edx.e) {
+                ctx->ecx.e = len - ctx->edx.e;
+            }
+
+            if (buffer != NULL) {
+                memcpy(ctx->edi.ctrl->FDC_RCVDLoc, buffer + ctx->edx.e, ctx->ecx.e);
+            }
+
+            ctx->edi.ctrl->FDC_RCVDLoc += ctx->ecx.e;
+            ctx->edi.ctrl->FDC_RCVDCnt -= ctx->ecx.x;
+            ADD(ctx, ctx->edx.e, ctx->ecx.e);
+
+            ctx->edi.ctrl->Byte_3FFD = ctx->edi.ctrl->FDC_RCVDLoc[-1];
+            continue;
+        }
+
+        ctx->eax.l = buffer != NULL ? buffer[ctx->edx.e] : *ctx->edi.ctrl->FDC_RCVDLoc;
 
-    if (Unit == 0) {
-        ctx->eax.disk = &ctx->edi.ctrl->FDDUnit0;
-    }
-    else {
-        ctx->eax.disk = &ctx->edi.ctrl->FDDUnit1;
+        if (ctx->edi.ctrl->Engine == u765_EngineDirect) {
+            DirectDataWrite(ctx->edi.ctrl, ctx->eax.l);
+        }
+        else {
+            LabelDataWrite(ctx->edi.ctrl, ctx->eax.l);
+        }
+        INC(ctx, ctx->edx.e);
     }
+
+    return ctx->edx.e;
 }
 
-static void WriteCurrentDisk(Context* ctx, u765_Controller* FdcHandle, uint8_t Unit) {
-    ctx->edi.ctrl = FdcHandle;
+// hands each transfer the execution phase starts to SectorCallback, which moves the bytes it
+// takes itself. those are then skipped and traced as a block transfer of the same
+// length would be, and the next transfer is offered in turn until one isn't taken whole
+static void OfferSectors(u765_Controller* FdcHandle) {
+    Context ctx;
+    uint8_t* data;
+    uint32_t len, taken;
+    bool write;
 
-    GetUnitPtr(ctx, Unit);
-    ctx->ebx = ctx->eax;
+    while (FdcHandle->TransferRunOffered != FdcHandle->TransferRun) {
+        FdcHandle->TransferRunOffered = FdcHandle->TransferRun;
 
-    if (ctx->ebx.disk->DiskFileHandle != NULL) {
-        if (ctx->ebx.disk->WriteProtect == false && ctx->ebx.disk->ContentsChanged == true) {
-            fwrite(ctx->ebx.disk->DiskArrayPtr, 1, ctx->ebx.disk->DiskArrayLen, ctx->ebx.disk->DiskFileHandle);
-            ctx->ebx.disk->ContentsChanged = false;
+        if ((FdcHandle->MainStatusReg & 0xe0) == 0xe0 && FdcHandle->FDCVector == case_FDC_SendData1) {
+            data = FdcHandle->FDC_SENDLoc;
+            len = FdcHandle->FDC_SENDCnt;
+            write = false;
+        }
+        else if ((FdcHandle->MainStatusReg & 0xe0) == 0xa0 && FdcHandle->FDCVector == case_FDC_ReceiveDataLoop) {
+            data = FdcHandle->FDC_RCVDLoc;
+            len = FdcHandle->FDC_RCVDCnt;
+            write = true;
+        }
+        else {
+            return;     // command bytes
+        }
+
+        taken = FdcHandle->SectorCallback(FdcHandle->SectorUser, data, len, write);
+
+        if (taken == 0) {
+            return;
+        }
+
+        if (taken > len) {
+            taken = len;
+        }
+
+        // the end of the transfer may reuse the buffer, so the trace goes first
+        if (FdcHandle->TraceFile != NULL) {
+            TraceRecord(FdcHandle, write ? u765_TraceDataWriteBlock : u765_TraceDataReadBlock);
+            TraceNumber(FdcHandle, taken);
+            TraceNumber(FdcHandle, taken);
+            TraceBytes(FdcHandle, data, taken);
+        }
+
+        STAT(FdcHandle, Bytes, taken);
+        ctx.esp.e = 0;
+        ctx.edi.ctrl = FdcHandle;
+
+        if (write) {
+            ReceiveDataBlock(&ctx, NULL, taken);
+        }
+        else {
+            SendDataBlock(&ctx, NULL, taken);
+        }
+
+        if (taken < len) {
+            return;
         }
     }
 }
 
-static void EDsk2Dsk(Context* ctx, uint8_t unit) {
-    uint8_t NumTracks, NumSectors, NumSides;
-    uint32_t F, G, SectorLen, DOffset, DskOffset, EDskOffset, MaxTrackLen;
-    void* DskArray;
+/*-----------------------------------------------------------------------------
+DIRECT ENGINE
+-----------------------------------------------------------------------------*/
+
+// the per-byte phases, receiving command and sector bytes and sending result and sector
+// bytes, are handled here on the controller alone. run() is entered with a fresh Context
+// only where a phase ends and the label code takes over, which is once per transfer
 
-    GetUnitPtr(ctx, unit);
-    ctx->ebx = ctx->eax;
+static void DirectRun(u765_Controller* ctrl, unsigned label) {
+    Context ctx;
+    ctx.esp.e = 0;
+    ctx.edi.ctrl = ctrl;
+
+    run(&ctx, label);
+}
 
-    ctx->ebx.disk->EDSK = true;
+// a transfer has ended, FDCReturn continues the command, as in FDC_ReceiveDataEnd
+static void DirectReturn(u765_Controller* ctrl) {
+    ctrl->FDCVector = ctrl->FDCReturn;
+    DirectRun(ctrl, ctrl->FDCReturn);
+}
 
-    ctx->esi.u8 = ctx->ebx.disk->DiskArrayPtr;
-    ctx->eax.l = ctx->esi.u8[0x30];
-    NumTracks = ctx->eax.l;
-    ctx->eax.l = ctx->esi.u8[0x31];
-    NumSides = ctx->eax.l;
+static uint8_t DirectStatusRead(u765_Controller* ctrl) {
+    if (ctrl->OverRunTest == true) {
+        if (ctrl->OverRunCounter != 0) {
+            ctrl->OverRunCounter--;
+        }
+        else {
+            ctrl->OverRunTest = false;
+            ctrl->OverRunError = true;
+            STAT(ctrl, OverRuns, 1);
+            ctrl->ST0 = (ctrl->ST0 & 0x3f) | 0x40;  // AT
+            ctrl->ST1 |= 0x10;                      // OverRun (Lost Data)
+            ctrl->MainStatusReg &= 0xdf;            // clear Execution mode first, fixes Italia 1990
+            DirectReturn(ctrl);
+        }
+    }
 
-    // the track size block starts at offset $34
-    DOffset = 0x34;
-    MaxTrackLen = 0;
+    return ctrl->MainStatusReg;
+}
 
-    // and now we walk through the tracks and find the largest.
-    ctx->eax.l = NumTracks;
-    ctx->ecx.l = NumSides;
-    ctx->eax.x = (uint16_t)ctx->eax.l * (uint16_t)ctx->ecx.l;
-    AND(ctx, ctx->eax.e, 0xffff);
+static uint8_t DirectDataRead(u765_Controller* ctrl) {
+    if ((ctrl->MainStatusReg & 0xc0) != 0xc0) {
+        return ctrl->MainStatusReg & 0xc0;
+    }
 
-    XOR(ctx, ctx->ecx.e, ctx->ecx.e);
-    ctx->esi.u8 = ctx->ebx.disk->DiskArrayPtr;
-    ctx->esi.u8 += DOffset;
+    if (ctrl->FDCVector != case_FDC_SendData1) {
+        DirectRun(ctrl, ctrl->FDCVector);
+        return ctrl->Byte_3FFD;
+    }
 
-    for (int loop_counter = ctx->eax.e; loop_counter >= 0; loop_counter--) {
-        ctx->eax.e = ctx->esi.u8[ctx->ecx.e];
-        INC(ctx, ctx->ecx.e);
+    // FDC_SendData1
+    ctrl->Byte_3FFD = *ctrl->FDC_SENDLoc++;
 
-        if (ctx->eax.e > MaxTrackLen) {
-            MaxTrackLen = ctx->eax.e;
-        }
+    if (--ctrl->FDC_SENDCnt != 0) {
+        ctrl->OverRunTest = true;
+        ctrl->OverRunCounter = 64;
+    }
+    else {
+        DirectReturn(ctrl);
     }
 
-    // having done that, each track is 256*Tracklen bytes.
-    MaxTrackLen <<= 8;
+    return ctrl->Byte_3FFD;
+}
 
-    // now inflate the array to the required size.
-    ctx->eax.l = NumTracks;
-    ctx->ecx.l = NumSides;
-    ctx->eax.x = (uint16_t)ctx->eax.l * (uint16_t)ctx->ecx.l;
-    AND(ctx, ctx->eax.e, 0xffff);
-    ctx->ecx.e = MaxTrackLen;
-    ctx->eax.e *= ctx->ecx.e;
-    ADD(ctx, ctx->eax.e, 256);
-    ADD(ctx, ctx->eax.e, 100000);         // add safe space beyond disk space
+static void DirectDataWrite(u765_Controller* ctrl, uint8_t value) {
+    ctrl->Byte_3FFD = value;
 
-    ctx->eax.ptr = malloc(ctx->eax.e);
+    if ((ctrl->MainStatusReg & 0xc0) != 0x80) {
+        return;
+    }
 
-    DskArray = ctx->eax.ptr;
-    if (ctx->eax.ptr == NULL) {
-        return;         // *** memory allocation error
+    if (ctrl->FDCVector != case_FDC_ReceiveDataLoop) {
+        DirectRun(ctrl, ctrl->FDCVector);
+        return;
     }
 
-    ctx->esi.u8 = ctx->ebx.disk->DiskArrayPtr;
-    ctx->esi.u8 += 0x22;
-    ctx->edi.u8 = DskArray;
-    ctx->edi.u8 += 0x22;
-    ctx->ecx.e = 14;       // $22 to $2f
-    rep_movsb(ctx);
+    // FDC_ReceiveDataLoop
+    *ctrl->FDC_RCVDLoc++ = value;
 
-    // fill in the info we already know.
-    ctx->edi.u8 = DskArray;
-    ctx->eax.l = NumTracks;
-    ctx->edi.u8[0x30] = ctx->eax.l;
-    ctx->eax.l = NumSides;
-    ctx->edi.u8[0x31] = ctx->eax.l;
-    ctx->eax.e = MaxTrackLen;
-    WRITEW(&ctx->edi.u8[0x32], ctx->eax.x);
-
-    // and start gathering tracks from offset $100 (tracks start there, immediately after the header).
-    EDskOffset = 0x100;
-
-    ctx->eax.l = NumTracks;
-    ctx->ecx.l = NumSides;
-
-    ctx->eax.x = (uint16_t)ctx->eax.l * (uint16_t)ctx->ecx.l;
-    AND(ctx, ctx->eax.e, 0xffff);
-
-    F = 0;
-
-    for (int loop_counter = ctx->eax.e; loop_counter >= 0; loop_counter--) {
-        // the offset into the dsk that we will write the next track.
-        ctx->eax.e = F;
-        ctx->ecx.e = MaxTrackLen;
-        ctx->eax.e *= ctx->ecx.e;
-        ADD(ctx, ctx->eax.e, 0x100);
-        DskOffset = ctx->eax.e;
-
-        // Number of sectors in this track.
-        ctx->esi.u8 = ctx->ebx.disk->DiskArrayPtr;
-        ctx->esi.u8 += EDskOffset;
-        ctx->esi.u8 += 0x15;
-        ctx->eax.l = *ctx->esi.u8;
-        NumSectors = ctx->eax.l;
-
-        // Is the track size > 0?
-        ctx->esi.u8 = ctx->ebx.disk->DiskArrayPtr;
-        ctx->esi.u8 += F;
-        ctx->esi.u8 += 0x34;
-        ctx->eax.l = *ctx->esi.u8;
-
-        if (ctx->eax.l != 0) {
-            // While there's sectors available in this track
-            if (NumSectors > 0) {
-                // Copy the TrackInfoBlock and Sector Info List across
-                ctx->esi.u8 = ctx->ebx.disk->DiskArrayPtr;
-                ctx->esi.u8 += EDskOffset;
-                ctx->edi.u8 = DskArray;
-                ctx->edi.u8 += DskOffset;
-
-                ctx->ecx.e = NumSectors;
-                SHL(ctx, ctx->ecx.e, 3);
-                ADD(ctx, ctx->ecx.e, 0x18);
-                rep_movsb(ctx);
+    if (--ctrl->FDC_RCVDCnt == 0) {
+        DirectReturn(ctrl);
+    }
+}
 
-                // Now copy the sector data itself. Edsk has varying lengths, dsk does not.
-
-                // Sectors begin 256 bytes after the start of the track
-                ADD(ctx, DskOffset, 0x100);
-
-                ctx->eax.e = EDskOffset;
-                ADD(ctx, ctx->eax.e, 0x100);
-                DOffset = ctx->eax.e;
-
-                G = 0;
-                ctx->eax.e = NumSectors;
-
-                for (int loop_counter = ctx->eax.e; loop_counter >= 0; loop_counter--) {
-                    // The edsk's sector length is found in the Sector Info List
-                    ctx->eax.e = G;
-                    SHL(ctx, ctx->eax.e, 3);
-                    ADD(ctx, ctx->eax.e, 30);
-                    ADD(ctx, ctx->eax.e, EDskOffset);
-                    ctx->esi.u8 = ctx->ebx.disk->DiskArrayPtr;
-                    ctx->esi.u8 += ctx->eax.e;
-                    ctx->eax.e = READW(ctx->esi.u8);
-                    SectorLen = ctx->eax.e;
-
-                    // copy the data across
-                    if (SectorLen > 0) {
-                        ctx->esi.u8 = ctx->ebx.disk->DiskArrayPtr;
-                        ctx->esi.u8 += DOffset;
-                        ctx->edi.u8 = DskArray;
-                        ctx->edi.u8 += DskOffset;
-                        
-                        ctx->ecx.e = SectorLen;
-                        ADD(ctx, DOffset, ctx->ecx.e);
-                        SHR(ctx, ctx->ecx.e, 2);
-                        rep_movsd(ctx);
-                        ctx->ecx.e = SectorLen;
-                        AND(ctx, ctx->ecx.e, 3);
-                        rep_movsb(ctx);
-                    }
+/*-----------------------------------------------------------------------------
+TRACE
+-----------------------------------------------------------------------------*/
 
-                    // Move to the next sector
-                    ctx->eax.e = SectorLen;
-                    ADD(ctx, DskOffset, ctx->eax.e);
+// stops a trace that can't be written any further, keeping what was written so far
+static void TraceFailed(u765_Controller* ctrl) {
+    fclose(ctrl->TraceFile);
+    ctrl->TraceFile = NULL;
+    free(ctrl->TraceBuffer);
+    ctrl->TraceBuffer = NULL;
+}
 
-                    INC(ctx, G);
-                }
-            }
+static void TraceBytes(u765_Controller* ctrl, void const* data, uint32_t len) {
+    if (ctrl->TraceFile == NULL) {
+        return;
+    }
 
-            // move to the start of the next track in the edsk.
-            ctx->esi.u8 = ctx->ebx.disk->DiskArrayPtr;
-            ctx->esi.u8 += F;
-            ctx->esi.u8 += 0x34;
-            ctx->eax.e = *ctx->esi.u8;
-            SHL(ctx, ctx->eax.e, 8);
-            ADD(ctx, EDskOffset, ctx->eax.e);
+    if (len > U765_TRACE_BUFFER_SIZE - ctrl->TraceLength) {
+        if (fwrite(ctrl->TraceBuffer, 1, ctrl->TraceLength, ctrl->TraceFile) != ctrl->TraceLength) {
+            TraceFailed(ctrl);
+            return;
         }
 
-        INC(ctx, F);
+        ctrl->TraceLength = 0;
+
+        // images and states go straight to the file
+        if (len > U765_TRACE_BUFFER_SIZE) {
+            if (fwrite(data, 1, len, ctrl->TraceFile) != len) {
+                TraceFailed(ctrl);
+            }
+            return;
+        }
     }
 
-    free(ctx->ebx.disk->DiskArrayPtr);
-    ctx->eax.ptr = DskArray;
-    ctx->ebx.disk->DiskArrayPtr = ctx->eax.ptr;
+    memcpy(ctrl->TraceBuffer + ctrl->TraceLength, data, len);
+    ctrl->TraceLength += len;
+}
+
+static void TraceNumber(u765_Controller* ctrl, uint64_t value) {
+    uint8_t b[10];
+    uint32_t len = 0;
+
+    while (value >= 0x80) {
+        b[len++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
 
-    ctx->ebx.disk->WriteProtect = true;
+    b[len++] = (uint8_t)value;
+    TraceBytes(ctrl, b, len);
 }
 
-static void SetFastDisk(Context* ctx) {
-    if (ctx->edi.ctrl->ActiveCallback != NULL) {
-        ctx->edi.ctrl->ActiveCallback();
+// starts a record, with the cycles since the last stamped one when they are traced
+static void TraceRecord(u765_Controller* ctrl, uint8_t type) {
+    uint64_t cycles = ctrl->TraceCycle - ctrl->TraceLastCycle;
+
+    if ((ctrl->TraceFlags & u765_TraceCycles) != 0 && cycles != 0) {
+        type |= 0x80;
+        TraceBytes(ctrl, &type, 1);
+        TraceNumber(ctrl, cycles);
+        ctrl->TraceLastCycle = ctrl->TraceCycle;
+        return;
     }
+
+    TraceBytes(ctrl, &type, 1);
 }
 
-static void InitFDC(Context* ctx) {
-    ctx->edi.ctrl->LED = 0;
-    ctx->edi.ctrl->FDCVector = case_FDC_NewCommand;
-    ctx->edi.ctrl->OverRunTest = false;
-    ctx->edi.ctrl->OverRunError = false;
-    ctx->edi.ctrl->MainStatusReg = 128;          // FDC is ready for a new command
+// a record of one byte, the most common by far, written directly when it fits
+static void TraceByte(u765_Controller* ctrl, uint8_t type, uint8_t value) {
+    if (ctrl->TraceLength <= U765_TRACE_BUFFER_SIZE - 2 && (ctrl->TraceFlags & u765_TraceCycles) == 0) {
+        ctrl->TraceBuffer[ctrl->TraceLength++] = type;
+        ctrl->TraceBuffer[ctrl->TraceLength++] = value;
+        return;
+    }
 
-    // call command callback with no cmd executing
-    ctx->edi.ctrl->FDCCommandByte = 0;         // no command executing
-    FDCCommandCallback(ctx, 1);
+    TraceRecord(ctrl, type);
+    TraceBytes(ctrl, &value, 1);
+}
+
+// the image in the unit as it is now, replayed with u765_InsertDiskFromMemory
+static void TraceInsert(u765_Controller* ctrl, uint8_t Unit) {
+    Context ctx;
+    ctx.esp.e = 0;
+    ctx.edi.ctrl = ctrl;
+
+    GetUnitPtr(&ctx, Unit);
+    ctx.ebx = ctx.eax;
+
+    uint8_t flags = ctx.ebx.disk->WriteProtect == true ? u765_InsertWriteProtect : u765_InsertDefault;
+    uint32_t len = ctx.ebx.disk->DiskInserted == true ? (uint32_t)ctx.ebx.disk->DiskArrayLen : 0;
+
+    TraceRecord(ctrl, u765_TraceInsertDisk);
+    TraceBytes(ctrl, &Unit, 1);
+    TraceBytes(ctrl, &flags, 1);
+    TraceNumber(ctrl, len);
+
+    if (len != 0) {
+        TraceBytes(ctrl, ctx.ebx.disk->DiskArrayPtr, len);
+    }
 }
 
 static void run(Context* ctx, unsigned label) {
@@ -808,12 +4104,13 @@ again:
             AND(ctx, ctx->eax.e, 31);                 // mask command bits
 
             ctx->edi.ctrl->LastFDCCmd = ctx->eax.l;    // for debugging purposes only
+            STAT(ctx->edi.ctrl, Commands, 1);
 
             // a Sense Interrupt Status command must be sent after a Seek or Recalibrate interrupt,
             // otherwise the FDC will consider the next command to be an Invalid Command.
 
             // Breaks New Zealand Story
-            // ctx->ecx.e = ctx->edi.ctrl->FDDUnit0;
+            // ctx->ecx.e = ctx->edi.ctrl->FDDUnit[0];
             // .if     (ctx->eax.l != 8) && (ctx->ecx.e->TFDDUnit.SeekDone == true)
             // ctx->ecx.e->TFDDUnit.SeekDone = false;
             // goto label_FDC_Invalid;
@@ -1029,7 +4326,7 @@ again:
             CMP(ctx, ctx->edi.ctrl->TSEError, true);
             JNE(ctx, label_FDC_RSSkip1);
 
-            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock.SectorInfoList[0];
+            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock->SectorInfoList[0];
             goto label_ReadID_Results;
 
         case case_FDC_RSSkip1: label_FDC_RSSkip1:
@@ -1046,8 +4343,8 @@ again:
             goto label_ReadID_SendResults;
 
         case case_Read_ID_1: label_Read_ID_1:
-            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock.SectorInfoList[0];
-            ctx->ecx.u8 = &ctx->ebx.disk->TrackBlock.SectorData[0];
+            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock->SectorInfoList[0];
+            ctx->ecx.u8 = &ctx->ebx.disk->TrackBlock->SectorData[0];
 
             // after a seek/recalibrate we return the sector ID for the first disk sector
             // on the new track until RetSCR0 counts down to 0
@@ -1061,7 +4358,7 @@ again:
         case case_RSNoSec0: label_RSNoSec0:
             ctx->edx.l = ctx->ebx.disk->CSR;
             INC(ctx, ctx->edx.l);
-            CMP(ctx, ctx->edx.l, ctx->ebx.disk->TrackBlock.NumSectors);
+            CMP(ctx, ctx->edx.l, ctx->ebx.disk->TrackBlock->NumSectors);
             JC(ctx, label_RSJmp1);
             XOR(ctx, ctx->edx.l, ctx->edx.l);
             // fallthrough
@@ -1070,6 +4367,11 @@ again:
             ctx->ebx.disk->CSR = ctx->edx.l;
             OR(ctx, ctx->edx.l, ctx->edx.l);
             JE(ctx, label_FDC_RdScDone);
+
+            if (IndexedSectorPtrs(ctx, ctx->edx.l)) {
+                ctx->edx.l = 0;
+                goto label_FDC_RdScDone;    // located through the track index
+            }
             // fallthrough
 
         case case_FDC_RdScL1: label_FDC_RdScL1:
@@ -1125,26 +4427,101 @@ again:
         // ######################################################################
 
         case case_FDC_FormatTrack: label_FDC_FormatTrack:
+            SetFastDisk(ctx);
+
+            ctx->edi.ctrl->FDCReturn = case_FDC_FormatTrack1;
+            ctx->ecx.x = 5;                   // expect 5 bytes
+            goto label_ReceiveCommandBytes;
+
+        case case_FDC_FormatTrack1: label_FDC_FormatTrack1:
+            FDCCommandCallback(ctx, 6);
+
+            XOR(ctx, ctx->eax.l, ctx->eax.l);
+            ctx->edi.ctrl->ST0 = ctx->eax.l;
+            ctx->edi.ctrl->ST1 = ctx->eax.l;
+            ctx->edi.ctrl->ST2 = ctx->eax.l;
+            ctx->edi.ctrl->ST2DAMBit = ctx->eax.l;
+
+            CALL(ctx, case_TrapStandardErrors);
+            CMP(ctx, ctx->ebx.disk->WriteProtect, true);
+            JNE(ctx, label_FmtTrk_WProt);        // jump if not write-protected
+
+            ctx->edi.ctrl->TSEError = true;     // force the error
+            AND(ctx, ctx->edi.ctrl->ST0, 0x3f);
+            OR(ctx, ctx->edi.ctrl->ST0, 0x40);           // AT
+            OR(ctx, ctx->edi.ctrl->ST1, 2);             // write-protected
+            // fallthrough
+
+        case case_FmtTrk_WProt: label_FmtTrk_WProt:
+            ctx->eax.l = ctx->ebx.disk->CTK;              // C,H of the track, N from the command
+            ctx->edi.ctrl->FDCResults[3] = ctx->eax.l;
+            ctx->eax.l = ctx->ebx.disk->CHEAD;
+            ctx->edi.ctrl->FDCResults[4] = ctx->eax.l;
+            ctx->edi.ctrl->FDCResults[5] = 0;
+            ctx->eax.l = ctx->edi.ctrl->FDCParameters[1];
+            ctx->edi.ctrl->FDCResults[6] = ctx->eax.l;
+
+            CMP(ctx, ctx->edi.ctrl->TSEError, true);
+            JE(ctx, label_FmtTrk_Results);          // exit returning the error
+            // fallthrough
+
+        case case_FmtTrk_IDs: label_FmtTrk_IDs:
+            OR(ctx, ctx->edi.ctrl->MainStatusReg, 32 + 16);      // enter Execution mode + busy
+
+            XOR(ctx, ctx->ecx.e, ctx->ecx.e);
+            ctx->ecx.l = ctx->edi.ctrl->FDCParameters[2]; // SC
+            SHL(ctx, ctx->ecx.e, 2);                      // C,H,R,N for each sector
+            TEST(ctx, ctx->ecx.e, ctx->ecx.e);
+            JE(ctx, label_FmtTrk_Build);
+
+            if (FormatIDs(ctx->edi.ctrl) == NULL) {
+                // nowhere to receive the IDs, as if they had been lost
+                AND(ctx, ctx->edi.ctrl->ST0, 0x3f);
+                OR(ctx, ctx->edi.ctrl->ST0, 0x40);           // AT
+                OR(ctx, ctx->edi.ctrl->ST1, 0x10);           // OverRun (Lost Data)
+                goto label_FmtTrk_Results;
+            }
+
+            ctx->edx.u8 = ctx->edi.ctrl->FDCFormatIDs;
+            ctx->edi.ctrl->UnitPtr = ctx->ebx.disk;             // preserve FDD Unit ptr
+            ctx->edi.ctrl->FDCReturn = case_FmtTrk_Build;
+            goto label_FDC_ReceiveData;    // receive the sector IDs from CPU
+
+        case case_FmtTrk_Build: label_FmtTrk_Build:
+            ctx->ebx.disk = ctx->edi.ctrl->UnitPtr;             // restore FDD Unit ptr
+            FormatCurrTrack(ctx);
+            // fallthrough
+
+        case case_FmtTrk_Results: label_FmtTrk_Results:
+            ctx->edi.ctrl->FDCBufferReturn = case_FDC_FormatTrack2;
+            goto label_ReturnSectorRWResults;
+
+        case case_FDC_FormatTrack2: label_FDC_FormatTrack2:
             CALL(ctx, case_InitFDC);
             return;
 
         // ######################################################################
 
+        // the Scan commands read sectors as Read Data does, but compare each with bytes received
+        // from the CPU instead of sending it, until one satisfies the scan. STP replaces DTL
         case case_FDC_ScanEqual: label_FDC_ScanEqual:
-            CALL(ctx, case_InitFDC);
-            return;
+            ctx->edi.ctrl->ReadMode = u765_FDCScanData;
+            ctx->edi.ctrl->DAM_Mask = 0;        // set Data Address mask for normal data sectors
+            goto label_FDC_ReadDataEntry;
 
         // ######################################################################
 
         case case_FDC_ScanLowOrEqual: label_FDC_ScanLowOrEqual:
-            CALL(ctx, case_InitFDC);
-            return;
+            ctx->edi.ctrl->ReadMode = u765_FDCScanData;
+            ctx->edi.ctrl->DAM_Mask = 0;
+            goto label_FDC_ReadDataEntry;
 
         // ######################################################################
 
         case case_FDC_ScanHighOrEqual: label_FDC_ScanHighOrEqual:
-            CALL(ctx, case_InitFDC);
-            return;
+            ctx->edi.ctrl->ReadMode = u765_FDCScanData;
+            ctx->edi.ctrl->DAM_Mask = 0;
+            goto label_FDC_ReadDataEntry;
 
         // ######################################################################
 
@@ -1188,7 +4565,7 @@ again:
 
             ctx->ebx.disk = ctx->edi.ctrl->SeekUnitPtr;       // drive unit which was issued a Seek/Recalibrate command
             if (ctx->ebx.disk == NULL) {
-                ctx->ebx.disk = &ctx->edi.ctrl->FDDUnit0;            // safeguard
+                ctx->ebx.disk = &ctx->edi.ctrl->FDDUnit[0];          // safeguard
             }
 
             CMP(ctx, ctx->ebx.disk->SeekDone, true);      // interrupt caused by seek completion?
@@ -1219,10 +4596,8 @@ again:
             // fallthrough
 
         case case_FDC_SenseCont: label_FDC_SenseCont:
-            ctx->edx.disk = &ctx->edi.ctrl->FDDUnit1;
-            if (ctx->ebx.disk == ctx->edx.disk) {      // offset FDDUnit1
-                OR(ctx, ctx->eax.l, 1);        // set unit 1 bit in result
-            }
+            ctx->edx.e = (uint32_t)(ctx->ebx.disk - ctx->edi.ctrl->FDDUnit);
+            OR(ctx, ctx->eax.l, ctx->edx.l);   // set unit bits in result
 
             ctx->edi.ctrl->ST0 = ctx->eax.l;
             ctx->esi.u8[0] = ctx->eax.l;
@@ -1412,6 +4787,7 @@ again:
         // byte received is in Byte_3FFD var
 
         case case_FDC_ReceiveData: label_FDC_ReceiveData:
+            ctx->edi.ctrl->TransferRun++;      // a new transfer for OfferSectors
             ctx->edi.ctrl->FDC_RCVDCnt = ctx->ecx.x;
             ctx->edi.ctrl->FDC_RCVDLoc = ctx->edx.u8;
             ctx->edi.ctrl->FDCVector = case_FDC_ReceiveDataLoop;
@@ -1438,6 +4814,7 @@ again:
         // FDC->CPU
         // FDC sends CX bytes from [ESI] to Z80
         case case_FDC_SendData: label_FDC_SendData:
+            ctx->edi.ctrl->TransferRun++;
             ctx->edi.ctrl->FDC_SENDCnt = ctx->ecx.x;
             ctx->edi.ctrl->FDC_SENDLoc = ctx->esi.u8;
             ctx->edi.ctrl->FDCVector = case_FDC_SendData1;
@@ -1503,12 +4880,12 @@ again:
 
         // locate physical sector the head is currently over
         case case_InitReadSector: label_InitReadSector:
-            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock.SectorInfoList[0];
-            ctx->ecx.u8 = &ctx->ebx.disk->TrackBlock.SectorData[0];
+            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock->SectorInfoList[0];
+            ctx->ecx.u8 = &ctx->ebx.disk->TrackBlock->SectorData[0];
 
             ctx->edx.l = ctx->ebx.disk->CSR;
             INC(ctx, ctx->edx.l);
-            CMP(ctx, ctx->edx.l, ctx->ebx.disk->TrackBlock.NumSectors);
+            CMP(ctx, ctx->edx.l, ctx->ebx.disk->TrackBlock->NumSectors);
             JC(ctx, label_IRSJmp1);
             XOR(ctx, ctx->edx.l, ctx->edx.l);
             // fallthrough
@@ -1517,6 +4894,11 @@ again:
             ctx->ebx.disk->CSR = ctx->edx.l;
             OR(ctx, ctx->edx.l, ctx->edx.l);
             JE(ctx, label_IRSDone);
+
+            if (IndexedSectorPtrs(ctx, ctx->edx.l)) {
+                ctx->edx.l = 0;
+                goto label_IRSDone;         // located through the track index
+            }
             // fallthrough
 
         case case_IRSLoop: label_IRSLoop:
@@ -1526,7 +4908,7 @@ again:
             // fallthrough
 
         case case_IRSDone: label_IRSDone:
-            ctx->edi.ctrl->CurrentSectorData = ctx->ecx.u8;    // ptr to this sector's data
+            ctx->edi.ctrl->CurrentSectorData = TrackBlockData(ctx->ebx.disk, ctx->ecx.u8); // ptr to this sector's data
             ctx->edi.ctrl->CurrentSectorInfo = ctx->esi.u8;    // ptr to this sector's info
             CALL(ctx, case_GetSectorSize);
             ctx->edi.ctrl->CurrentSectorSize = ctx->eax.e;    // this sector's size (in bytes)
@@ -1649,6 +5031,8 @@ again:
         // when R = EOT then we have read all requested sectors so return result bytes
         case case_LFRS_3: label_LFRS_3:
             ctx->eax.l = ctx->esi.u8[2];
+            CMP(ctx, ctx->edi.ctrl->ReadMode, u765_FDCScanData);
+            JE(ctx, label_Scan_Next);
             CMP(ctx, ctx->edi.ctrl->ReadMode, u765_FDCReadTrack);
             JNE(ctx, label_NotReadTrk1);
 
@@ -1658,7 +5042,7 @@ again:
             JE(ctx, label_Read_Com1);  // terminate command
 
             // any more sectors to read on this track?
-            CMP(ctx, ctx->eax.l, ctx->ebx.disk->TrackBlock.NumSectors);
+            CMP(ctx, ctx->eax.l, ctx->ebx.disk->TrackBlock->NumSectors);
             JC(ctx, label_LFRS_4);  // continue reading if sectors available
 
             // else sectors expired before reaching EOT sector count
@@ -1688,21 +5072,43 @@ again:
         // each sector in a multi-sector transfer is treated as an entirely separate
         // sector read so we reset the IndexHoleCount back to zero again
 
+        // a Scan command ends on the first sector that satisfies it, otherwise it moves on
+        // by STP sectors until it gets past EOT
+        case case_Scan_Next: label_Scan_Next:
+            TEST(ctx, ctx->edi.ctrl->ST2, 4);            // scan not satisfied?
+            JE(ctx, label_ReturnSectorRWResults);      // exit with this sector's CHRN
+
+            CMP(ctx, ctx->edi.ctrl->FDCParameters[7], 2); // STP
+            JNE(ctx, label_Scan_Step);
+            INC(ctx, ctx->edi.ctrl->FDCParameters[3]);  // R parameter
+            INC(ctx, ctx->eax.l);
+            // fallthrough
+
+        case case_Scan_Step: label_Scan_Step:
+            CMP(ctx, ctx->eax.l, ctx->edi.ctrl->FDCParameters[5]); // EOT
+            JNC(ctx, label_Read_Com1);  // terminate command
+            goto label_LFRS_4;
+
         case case_LFRS_4: label_LFRS_4:
             INC(ctx, ctx->edi.ctrl->FDCParameters[3]);  // R parameter
             ctx->edi.ctrl->IndexHoleCount = 0;           // 1st revolution for this sector read
             goto label_InitReadSector;
 
         case case_SkipReadSector: label_SkipReadSector:
+            if (SkipToMatchingSector(ctx)) {
+                goto label_LocateReadSector;
+            }
+
             CALL(ctx, case_AdvanceSectorPtrs);
 
             INC(ctx, ctx->ebx.disk->CSR);                // move to the next physical sector
             ctx->eax.l = ctx->ebx.disk->CSR;
-            CMP(ctx, ctx->eax.l, ctx->ebx.disk->TrackBlock.NumSectors);
+            CMP(ctx, ctx->eax.l, ctx->ebx.disk->TrackBlock->NumSectors);
             JC(ctx, label_LocateReadSector);
 
             ctx->ebx.disk->CSR = -1;             // InitReadSector increments this to zero
             INC(ctx, ctx->edi.ctrl->IndexHoleCount);
+            STAT(ctx->edi.ctrl, Revolutions, 1);
             CMP(ctx, ctx->edi.ctrl->IndexHoleCount, 2);   // search for two disk revolutions
             JC(ctx, label_InitReadSector);
 
@@ -1731,8 +5137,8 @@ again:
                 // if N = 0 (use DTL bytes)
                 XOR(ctx, ctx->ecx.e, ctx->ecx.e);
                 ctx->ecx.l = ctx->edi.ctrl->FDCParameters[7]; // DTL from command
-                if (ctx->ecx.l > 128) {
-                    ctx->ecx.l = 128;                     // DTL max bytes = 128
+                if (ctx->ecx.l > 128 || ctx->ecx.l == 0) {
+                    ctx->ecx.l = 128;                     // DTL max bytes = 128, a DTL of 0 can't be sent
                 }
                 ctx->edx.e = ctx->ecx.e;                            // ecx & edx = DTL bytes available
                 ctx->edi.ctrl->DTL_BytesSent = true;
@@ -1752,6 +5158,12 @@ again:
                 ctx->ecx.e = 32768;
             }
 
+            // the data available never runs past the end of TrackBlock
+            ctx->eax.e = TrackBlockRoom(ctx->ebx.disk, ctx->edi.ctrl->CurrentSectorData);
+            if (ctx->edx.e > ctx->eax.e) {
+                ctx->edx.e = ctx->eax.e;
+            }
+
             ctx->edi.ctrl->PhysicalSectorSize = ctx->ecx.e;      // = (128 Shl N) or DTL bytes
             ctx->edi.ctrl->AvailableSectorData = ctx->edx.e;
 
@@ -1764,6 +5176,11 @@ again:
             CMP(ctx, ctx->eax.x, 0x2020);                           // if both data error bits set
             JE(ctx, label_SDTC_RandomData);                    // then return a randomised sector
 
+            // a sector cut short by the end of TrackBlock is topped up like a randomised one
+            if (ctx->edi.ctrl->CurrentSectorData + ctx->ecx.e > (uint8_t*)(ctx->ebx.disk->TrackBlock + 1)) {
+                goto label_SDTC_RandomData;
+            }
+
             ctx->esi.u8 = ctx->edi.ctrl->CurrentSectorData;
             goto label_SDTC_TransferData;
 
@@ -1799,10 +5216,30 @@ again:
             else {
                     // available sector data <= physical sector size
         case case_SDTC_NormalRandom: label_SDTC_NormalRandom:
+                if (RandomData(ctx->edi.ctrl) == NULL) {
+                    // no buffer to build the sector in, send just the available data
+                    ctx->esi.u8 = ctx->edi.ctrl->CurrentSectorData;
+                    if (ctx->ecx.e > ctx->edx.e) {
+                        ctx->ecx.e = ctx->edx.e;
+                    }
+                    goto label_SDTC_TransferData;
+                }
+
+                if (ctx->edx.e > ctx->ecx.e) {
+                    ctx->edx.e = ctx->ecx.e;               // less than 2 sectors, only the first is used
+                }
+
+                // the seed and method are fetched while edi still points to the controller
+                ctx->eax.l = ctx->edi.ctrl->FDCRandomSeed;
+                ctx->eax.h = 3;
+                if (ctx->edi.ctrl->DskRndMethod == 255) {
+                    XOR(ctx, ctx->eax.x, ctx->eax.x);
+                }
+
                 PUSH(ctx, ctx->edi);
                 PUSH(ctx, ctx->ecx);
                 ctx->esi.u8 = ctx->edi.ctrl->CurrentSectorData;
-                ctx->edi.u8 = &ctx->edi.ctrl->FDCRandomData[0];
+                ctx->edi.u8 = ctx->edi.ctrl->FDCRandomData;
                 ctx->ecx.e = ctx->edx.e;                    // copy available sector data
 
                 rep_movsb(ctx);
@@ -1811,21 +5248,15 @@ again:
                 // if required, top up sector data with random bytes
                 SUB(ctx, ctx->ecx.e, ctx->edx.e);    // ctx->ecx.e = top-up bytes required
 
-                ctx->eax.l = ctx->edi.ctrl->FDCRandomSeed;
-                ctx->eax.h = 3;
-                if (ctx->edi.ctrl->DskRndMethod == 255) {
-                    XOR(ctx, ctx->eax.x, ctx->eax.x);
-                }
-
                 while  (ctx->ecx.e > 0) {
-                    *ctx->edi.u8 = ctx->eax.l;
+                    *ctx->edi.u8++ = ctx->eax.l;
                     ADD(ctx, ctx->eax.l, ctx->eax.h);
                     DEC(ctx, ctx->ecx.e);
                 }
-                ctx->edi.ctrl->FDCRandomSeed = ctx->eax.l;
                 ctx->edi = POP(ctx);
+                ctx->edi.ctrl->FDCRandomSeed = ctx->eax.l;
 
-                ctx->esi.u8 = &ctx->edi.ctrl->FDCRandomData[0];
+                ctx->esi.u8 = ctx->edi.ctrl->FDCRandomData;
                 ctx->ecx.e = ctx->edi.ctrl->PhysicalSectorSize;
 
                 // for N >= 6 sectors, transfer data now
@@ -1884,11 +5315,40 @@ again:
                 FDCCommandCallback(ctx, 9);   // send a new callback for each successive sector read);
             }
 
+            CMP(ctx, ctx->edi.ctrl->ReadMode, u765_FDCScanData);
+            JE(ctx, label_SDTC_ScanData);
+
             // transfer CX bytes from [ESI] to Z80
             ctx->edi.ctrl->UnitPtr = ctx->ebx.disk;          // preserve FDD Unit ptr
             ctx->edi.ctrl->FDCReturn = case_SectorDataToCPU_Done;
             goto label_FDC_SendData;               // transfer data to CPU
 
+        // receive CX bytes from Z80 to compare with the sector data at [ESI]
+        case case_SDTC_ScanData: label_SDTC_ScanData:
+            ctx->edi.ctrl->FDC_SENDLoc = ctx->esi.u8;     // kept for ScanCompare
+            ctx->edi.ctrl->FDC_SENDCnt = ctx->ecx.x;
+            ctx->edi.ctrl->UnitPtr = ctx->ebx.disk;          // preserve FDD Unit ptr
+            ctx->edi.ctrl->FDCReturn = case_SDTC_ScanCompare;
+
+            if (ScanData(ctx->edi.ctrl) == NULL) {
+                // nowhere to receive the bytes, as if they had been lost
+                AND(ctx, ctx->edi.ctrl->ST0, 0x3f);
+                OR(ctx, ctx->edi.ctrl->ST0, 0x40);           // AT
+                OR(ctx, ctx->edi.ctrl->ST1, 0x10);           // OverRun (Lost Data)
+                goto label_ReturnSectorRWResults;
+            }
+
+            CMP(ctx, ctx->ecx.x, 0);
+            JE(ctx, label_SDTC_ScanCompare);
+
+            ctx->edx.u8 = ctx->edi.ctrl->FDCScanData;
+            goto label_FDC_ReceiveData;            // receive data from CPU
+
+        case case_SDTC_ScanCompare: label_SDTC_ScanCompare:
+            ctx->ebx.disk = ctx->edi.ctrl->UnitPtr;          // restore FDD Unit ptr
+            ScanCompare(ctx->edi.ctrl);
+            goto label_SectorDataToCPU_Done;
+
         case case_SectorDataToCPU_Done: label_SectorDataToCPU_Done:
             INC(ctx, ctx->edi.ctrl->SectorsTransferred);    // count number of sectors sent each command
 
@@ -1907,14 +5367,14 @@ again:
             // fallthrough
 
         case case_SkipSectorEDSK: label_SkipSectorEDSK:
-            ctx->edi.ctrl->CurrentSectorData += ctx->eax.e;
+            ctx->edi.ctrl->CurrentSectorData = TrackBlockData(ctx->ebx.disk, ctx->edi.ctrl->CurrentSectorData + ctx->eax.e);
             ctx->edi.ctrl->CurrentSectorInfo += 8;
             return;
 
         // ######################################################################
 
         // disk writing is incomplete and will only work with standard
-        // +3DOS single-sector writes and only to normal DSK files.
+        // +3DOS single-sector writes.
 
         case case_WriteSectorData: label_WriteSectorData:
             XOR(ctx, ctx->eax.l, ctx->eax.l);
@@ -1951,9 +5411,9 @@ again:
             ctx->edi.ctrl->CurrentSectorSize = ctx->eax.e;                   // this sector's size (in bytes)
 
             PUSH(ctx, ctx->esi);
-            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock.SectorData[0];
+            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock->SectorData[0];
             ctx->edi.ctrl->CurrentSectorData = ctx->esi.u8;     // ptr to this sector's data
-            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock.SectorInfoList[0];
+            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock->SectorInfoList[0];
             ctx->edi.ctrl->CurrentSectorInfo = ctx->esi.u8; // ptr to this sector's info
             ctx->esi = POP(ctx);
             ctx->edi.ctrl->CurrentSectorNumber = 0;
@@ -1961,6 +5421,12 @@ again:
 
         case case_LocateFirstWriteSector: label_LocateFirstWriteSector:
             ctx->esi.u8 = ctx->edi.ctrl->CurrentSectorInfo;
+
+            if (ctx->ebx.disk->EDSK == true) {
+                ctx->eax.e = READW(&ctx->esi.u8[6]);    // EDSK sectors have their own sizes
+                ctx->edi.ctrl->CurrentSectorSize = ctx->eax.e;
+            }
+
             ctx->eax.l = ctx->esi.u8[2];          // sector ID (R)
             CMP(ctx, ctx->eax.l, ctx->edi.ctrl->FDCParameters[3]); // is this the sector we are looking for?
             JC(ctx, label_SkipWriteSector);     // skip if not
@@ -1979,11 +5445,11 @@ again:
         case case_SkipWriteSector: label_SkipWriteSector:
             ctx->edi.ctrl->CurrentSectorInfo += 8;
             ctx->eax.e = ctx->edi.ctrl->CurrentSectorSize;
-            ctx->edi.ctrl->CurrentSectorData += ctx->eax.e;
+            ctx->edi.ctrl->CurrentSectorData = TrackBlockData(ctx->ebx.disk, ctx->edi.ctrl->CurrentSectorData + ctx->eax.e);
 
             INC(ctx, ctx->edi.ctrl->CurrentSectorNumber);
             ctx->eax.l = ctx->edi.ctrl->CurrentSectorNumber;
-            CMP(ctx, ctx->eax.l, ctx->ebx.disk->TrackBlock.NumSectors);
+            CMP(ctx, ctx->eax.l, ctx->ebx.disk->TrackBlock->NumSectors);
             JNE(ctx, label_LocateFirstWriteSector);
 
             goto label_ReturnSectorRWResults;
@@ -1993,17 +5459,41 @@ again:
             CMP(ctx, ctx->eax.l, 0);
             JNE(ctx, label_CDTS_1);
 
-            XOR(ctx, ctx->ecx.x, ctx->ecx.x);
+            XOR(ctx, ctx->ecx.e, ctx->ecx.e);
             ctx->ecx.l = ctx->edi.ctrl->FDCParameters[7]; // DTL from command
+            if (ctx->ecx.l == 0) {
+                ctx->ecx.l = 128;                         // as when reading, a DTL of 0 can't be taken
+            }
             goto label_CDTS_2;
 
         case case_CDTS_1: label_CDTS_1:
             ctx->ecx.e = ctx->edi.ctrl->CurrentSectorSize;
+
+            if (ctx->ebx.disk->EDSK == true) {
+                // only the first copy of a weak sector is written, and a sector stored
+                // shorter than its N only takes the bytes the image has room for
+                ctx->esi.u8 = ctx->edi.ctrl->CurrentSectorInfo;
+                ctx->eax.e = DskSectorSize(ctx->esi.u8[3]);
+                if (ctx->ecx.e > ctx->eax.e) {
+                    ctx->ecx.e = ctx->eax.e;
+                }
+            }
             // fallthrough
 
         case case_CDTS_2: label_CDTS_2:
+            // the bytes received never run past the end of TrackBlock either, a sector
+            // the ones before have left no room for takes none
+            ctx->eax.e = TrackBlockRoom(ctx->ebx.disk, ctx->edi.ctrl->CurrentSectorData);
+            if (ctx->ecx.e > ctx->eax.e) {
+                ctx->ecx.e = ctx->eax.e;
+            }
+
             ctx->edx.u8 = ctx->edi.ctrl->CurrentSectorData;
+            ctx->edi.ctrl->FDC_RCVDLoc = ctx->edx.u8;        // WriteCurrTrack copies up to here
             ctx->edi.ctrl->UnitPtr = ctx->ebx.disk;             // preserve FDD Unit ptr
+            TEST(ctx, ctx->ecx.e, ctx->ecx.e);
+            JE(ctx, label_CPUDataToSector_1);
+
             ctx->edi.ctrl->FDCReturn = case_CPUDataToSector_1;
             goto label_FDC_ReceiveData;    // receive new sector data from CPU
 
@@ -2079,9 +5569,9 @@ again:
 
         case case_GetSectorSize: label_GetSectorSize:
             PUSH(ctx, ctx->ecx);
-            ctx->ecx.l = ctx->ebx.disk->TrackBlock.SectorSize;
+            ctx->ecx.l = ctx->ebx.disk->TrackBlock->SectorSize;
             ctx->eax.e = 128;
-            SHL(ctx, ctx->eax.e, ctx->ecx.l);
+            SHL(ctx, ctx->eax.e, ctx->ecx.l & 31);   // as the x86 shift counts
             CMP(ctx, ctx->eax.e, 8192);
             JC(ctx, label_GSS_Exit);
             ctx->eax.e = 6144;
@@ -2097,15 +5587,57 @@ again:
             CALL(ctx, case_LocateTrack);    // ctx->esi.u8 points to current track data
 
             PUSH(ctx, ctx->edi);
-            ctx->edi.u8 = &ctx->ebx.disk->TrackBlock.TrackData[0];
+
+            // TrackBlock is kept in step with the image by WriteCurrTrack, so it only has
+            // to be copied again when the track or head changes
+            ctx->eax.x = ctx->ebx.disk->TrackSlot;
+            CMP(ctx, ctx->eax.x, ctx->ebx.disk->CachedTrackSlot);
+            JE(ctx, label_RdTrk_Cached);
+
+            STAT(ctx->edi.ctrl, TrackCopies, 1);
+            ctx->edi.u8 = &ctx->ebx.disk->TrackBlock->TrackData[0];
             ctx->ecx.x = ctx->ebx.disk->DiskBlock.TrackSize;
+            AND(ctx, ctx->ecx.e, 0xffff);
+
+            // only the track itself is copied, the bytes past it in TrackBlock are left as they
+            // were, as transfers running off the end of the track read them
+            if (GetTrackIndex(ctx) != NULL) {
+                ctx->ecx.e = GetTrackIndex(ctx)->TrackLength;
+            }
             if (ctx->ecx.e > sizeof(u765_TrackInfoBlock)) {
                 ctx->ecx.e = sizeof(u765_TrackInfoBlock);
             }
 
-            rep_movsb(ctx);
+            // never copy beyond the end of the image
+            ctx->edx.u8 = ctx->ebx.disk->DiskArrayPtr;
+            ctx->edx.u8 += ctx->ebx.disk->DiskArrayLen;
+            if (ctx->esi.u8 >= ctx->edx.u8) {
+                ctx->ecx.e = 0;
+            }
+            else if (ctx->ecx.e > (uint32_t)(ctx->edx.u8 - ctx->esi.u8)) {
+                ctx->ecx.e = (uint32_t)(ctx->edx.u8 - ctx->esi.u8);
+            }
+
+            // an EDSK track of size 0 shares its offset with the next track
+            if (GetTrackIndex(ctx) != NULL && GetTrackIndex(ctx)->TrackLength < 0x100) {
+                ctx->ecx.e = 0;
+            }
+
+            if (ctx->ecx.e < 0x100) {
+                memset(ctx->edi.u8, 0, 0x100);  // no Track-Info, this track is unformatted
+            }
+
+            CopyTrackImage(ctx->ebx.disk, GetTrackIndex(ctx), ctx->esi.u8, ctx->edi.u8, ctx->ecx.e);
+
+            ctx->ebx.disk->CachedTrackSlot = 0xffff;
+            ctx->eax.x = ctx->ebx.disk->TrackSlot;
+            if (ctx->eax.x < ctx->ebx.disk->NumTrackSlots) {
+                ctx->ebx.disk->CachedTrackSlot = ctx->eax.x;
+            }
+            // fallthrough
 
-            ctx->edi.u8 = &ctx->ebx.disk->TrackBlock.TrackData[0];
+        case case_RdTrk_Cached: label_RdTrk_Cached:
+            ctx->edi.u8 = &ctx->ebx.disk->TrackBlock->TrackData[0];
             ctx->esi.ptr = "Track-Info";
             ctx->edx.l = false;
             ctx->ecx.l = 10;
@@ -2133,47 +5665,77 @@ again:
             ctx->ebx.disk->ContentsChanged = true;
             CALL(ctx, case_LocateTrack);    // ctx->esi.u8 points to current track data
 
+            if (GetTrackIndex(ctx) != NULL) {
+                GetTrackIndex(ctx)->Dirty = true;
+                GetTrackIndex(ctx)->Written = true;
+            }
+
+            // only the sector data just received differs from the image, so that is all
+            // that is copied back, limited to the bytes of this track
+            XOR(ctx, ctx->edx.e, ctx->edx.e);
+            ctx->edx.x = ctx->ebx.disk->DiskBlock.TrackSize;
+            if (ctx->ebx.disk->TrackIndex != NULL) {
+                XOR(ctx, ctx->edx.e, ctx->edx.e);
+                if (GetTrackIndex(ctx) != NULL) {
+                    // while the image is shared the track is written to this unit's own copy
+                    ctx->esi.u8 = WritableTrackData(ctx->ebx.disk, GetTrackIndex(ctx));
+                    if (ctx->esi.u8 != NULL) {
+                        ctx->edx.e = GetTrackIndex(ctx)->TrackLength;
+                    }
+                }
+            }
+
+            ctx->eax.e = (uint32_t)(ctx->edi.ctrl->CurrentSectorData - &ctx->ebx.disk->TrackBlock->TrackData[0]);
+            ctx->ecx.e = (uint32_t)(ctx->edi.ctrl->FDC_RCVDLoc - ctx->edi.ctrl->CurrentSectorData);
+
+            if (ctx->eax.e + ctx->ecx.e > ctx->edx.e) {
+                // TrackBlock now differs from the image beyond this track
+                ctx->ebx.disk->CachedTrackSlot = 0xffff;
+                ctx->ecx.e = ctx->eax.e < ctx->edx.e ? ctx->edx.e - ctx->eax.e : 0;
+            }
+
             PUSH(ctx, ctx->edi);
-            ctx->edi.u8 = ctx->esi.u8;         // edi=track data in FDDUnit0
-            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock.TrackData[0];
-            ctx->ecx.x = ctx->ebx.disk->DiskBlock.TrackSize;
-            AND(ctx, ctx->ecx.e, 0xffff);
+            ctx->edi.u8 = ctx->esi.u8;         // edi=track data in FDDUnit[0]
+            ctx->edi.u8 += ctx->eax.e;
+            ctx->esi.u8 = &ctx->ebx.disk->TrackBlock->TrackData[0];
+            ctx->esi.u8 += ctx->eax.e;
 
             rep_movsb(ctx);
 
             ctx->edi = POP(ctx);
+            STAT(ctx->edi.ctrl, TrackCopies, 1);
             return;
 
         // ######################################################################
 
-        // sets ctx->esi.u8 to the start of the current track data in FDDUnit0 array
+        // sets ctx->esi.u8 to the start of the current track data in FDDUnit[0] array
         case case_LocateTrack: label_LocateTrack:
-            XOR(ctx, ctx->eax.e, ctx->eax.e);
-            XOR(ctx, ctx->edx.e, ctx->edx.e);
-            ctx->edx.x = ctx->ebx.disk->DiskBlock.TrackSize;
-            AND(ctx, ctx->edx.e, 65535);
-            ctx->ecx.l = ctx->ebx.disk->CTK;      // current physical track head is over
-            INC(ctx, ctx->ecx.l);
-            // fallthrough
-
-        case case_LocTrk1: label_LocTrk1:
-            DEC(ctx, ctx->ecx.l);
-            JE(ctx, label_LockTrkDone);
-            ADD(ctx, ctx->eax.e, ctx->edx.e);
-            goto label_LocTrk1;
-
-        case case_LockTrkDone: label_LockTrkDone:
+            ctx->eax.e = ctx->ebx.disk->CTK;      // current physical track head is over
             CMP(ctx, ctx->ebx.disk->DiskBlock.NumSides, 2);
             JNE(ctx, label_LocSingleSide);
             SHL(ctx, ctx->eax.e, 1);
 
             CMP(ctx, ctx->ebx.disk->CHEAD, 1);
             JNE(ctx, label_LocSingleSide);
-            ADD(ctx, ctx->eax.e, ctx->edx.e);                  // add DiskBlock.TrackSize to skip to the interleaved track
+            INC(ctx, ctx->eax.e);                 // the interleaved track for side 1
             // fallthrough
 
         case case_LocSingleSide: label_LocSingleSide:
-            ADD(ctx, ctx->eax.e, 0x100);    // and add the sizeof DiskInfoBlock
+            ctx->ebx.disk->TrackSlot = ctx->eax.x;
+
+            if (ctx->eax.e < ctx->ebx.disk->NumTrackSlots) {
+                ctx->eax.e = ctx->ebx.disk->TrackIndex[ctx->eax.e].TrackOffset;
+            }
+            else if (ctx->ebx.disk->EDSK == true) {
+                ctx->eax.e = ctx->ebx.disk->DiskArrayLen;   // EDSK tracks can't be found without the index
+            }
+            else {
+                XOR(ctx, ctx->edx.e, ctx->edx.e);
+                ctx->edx.x = ctx->ebx.disk->DiskBlock.TrackSize;
+                ctx->eax.e *= ctx->edx.e;
+                ADD(ctx, ctx->eax.e, 0x100);    // and add the sizeof DiskInfoBlock
+            }
+
             ctx->esi.u8 = ctx->ebx.disk->DiskArrayPtr;
             ctx->esi.u8 += ctx->eax.e;
             return;
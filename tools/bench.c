@@ -0,0 +1,380 @@
+// Command benchmark for fdc765.
+//
+// Synthesizes DSK and EDSK images in memory and times the commands a loader issues
+// through the public API, the way an emulator would: polling the status port before
+// every byte, or moving the execution phase with the block transfer functions.
+//
+//   bench [engine ...] [-t milliseconds]
+//
+// engine is default or direct, both are run if none is given.
+// Built with BENCH_COUNT_ALLOCS and the library linked in with --wrap=malloc,calloc,realloc
+// (make bench does both), the allocations made per command are reported as well.
+
+#include <fdc765.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef BENCH_COUNT_ALLOCS
+static uint64_t Allocations;
+
+void* __real_malloc(size_t);
+void* __real_calloc(size_t, size_t);
+void* __real_realloc(void*, size_t);
+
+void* __wrap_malloc(size_t size) {
+    Allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    Allocations++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    Allocations++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+#define NUM_TRACKS 40
+
+typedef enum {
+    BenchReadData,
+    BenchWriteData,
+    BenchReadTrack,
+    BenchReadID,
+    BenchSeek,
+    BenchSenseInterruptStatus
+}
+BenchCommand;
+
+typedef struct {
+    u765_Controller* Fdc;
+    bool Extended;
+    uint8_t Sectors;    // sectors per track
+    uint8_t N;
+    uint8_t Track;      // track the head was last moved to
+    uint8_t Buffer[65536];
+}
+Bench;
+
+static double TimeLimit = 0.2;  // seconds spent on each row
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t AllocationCount(void) {
+#ifdef BENCH_COUNT_ALLOCS
+    return Allocations;
+#else
+    return 0;
+#endif
+}
+
+// bytes of sector data stored in the image for size N, DSK images hold at most 6144
+static uint32_t StoredSize(bool Extended, uint8_t N) {
+    uint32_t size = 128u << N;
+    return !Extended && size >= 8192 ? 6144 : size;
+}
+
+// a single sided image of NUM_TRACKS tracks of Sectors sectors of size N
+static uint8_t* MakeImage(bool Extended, uint8_t Sectors, uint8_t N, size_t* Len) {
+    uint32_t const stored = StoredSize(Extended, N);
+    uint32_t const trackLen = 0x100 + Sectors * stored;
+    uint8_t* image;
+    uint8_t* track;
+    uint32_t t, s, i;
+
+    *Len = 0x100 + NUM_TRACKS * trackLen;
+    image = (uint8_t*)calloc(*Len, 1);
+
+    if (image == NULL) {
+        return NULL;
+    }
+
+    memcpy(image, Extended ? "EXTENDED CPC DSK File\r\nDisk-Info\r\n" : "MV - CPCEMU Disk-File\r\nDisk-Info\r\n", 34);
+    memcpy(image + 0x22, "fdc765 bench", 12);
+    image[0x30] = NUM_TRACKS;
+    image[0x31] = 1;
+
+    if (Extended) {
+        for (t = 0; t < NUM_TRACKS; t++) {
+            image[0x34 + t] = (uint8_t)(trackLen >> 8);
+        }
+    }
+    else {
+        image[0x32] = (uint8_t)trackLen;
+        image[0x33] = (uint8_t)(trackLen >> 8);
+    }
+
+    for (t = 0; t < NUM_TRACKS; t++) {
+        track = image + 0x100 + t * trackLen;
+        memcpy(track, "Track-Info\r\n", 12);
+        track[0x10] = (uint8_t)t;
+        track[0x14] = N;
+        track[0x15] = Sectors;
+        track[0x16] = 0x4e;
+        track[0x17] = 0xe5;
+
+        for (s = 0; s < Sectors; s++) {
+            track[0x18 + s * 8 + 0] = (uint8_t)t;
+            track[0x18 + s * 8 + 2] = (uint8_t)(s + 1);
+            track[0x18 + s * 8 + 3] = N;
+            track[0x18 + s * 8 + 6] = (uint8_t)stored;
+            track[0x18 + s * 8 + 7] = (uint8_t)(stored >> 8);
+        }
+
+        for (i = 0; i < Sectors * stored; i++) {
+            track[0x100 + i] = (uint8_t)(i * 7 + t);
+        }
+    }
+
+    return image;
+}
+
+static void SendCommand(Bench* b, uint8_t const* bytes, uint32_t len) {
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        while ((u765_StatusPortRead(b->Fdc) & 0xc0) != 0x80) {
+        }
+
+        u765_DataPortWrite(b->Fdc, bytes[i]);
+    }
+}
+
+// the execution phase, one status and one data access per byte unless Block is set
+static uint32_t ReadExecution(Bench* b, bool Block) {
+    uint32_t len = 0;
+
+    if (Block) {
+        return u765_DataPortReadBlock(b->Fdc, b->Buffer, sizeof(b->Buffer));
+    }
+
+    while ((u765_StatusPortRead(b->Fdc) & 0xe0) == 0xe0 && len < sizeof(b->Buffer)) {
+        b->Buffer[len++] = u765_DataPortRead(b->Fdc);
+    }
+
+    return len;
+}
+
+static uint32_t WriteExecution(Bench* b, uint32_t len, bool Block) {
+    uint32_t i = 0;
+
+    if (Block) {
+        return u765_DataPortWriteBlock(b->Fdc, b->Buffer, len);
+    }
+
+    while (i < len && (u765_StatusPortRead(b->Fdc) & 0xe0) == 0xa0) {
+        u765_DataPortWrite(b->Fdc, b->Buffer[i++]);
+    }
+
+    return i;
+}
+
+static void ReadResults(Bench* b) {
+    while ((u765_StatusPortRead(b->Fdc) & 0xe0) == 0xc0) {
+        u765_DataPortRead(b->Fdc);
+    }
+}
+
+// runs one command, returning the bytes moved in its execution phase
+static uint32_t RunCommand(Bench* b, BenchCommand Command, bool Multi, bool Block) {
+    uint8_t const eot = Multi ? b->Sectors : 1;
+    uint8_t cmd[9] = { 0, 0, b->Track, 0, 1, b->N, eot, 0x2a, 0xff };
+    uint32_t len = 0;
+
+    switch (Command) {
+    case BenchReadData:
+        cmd[0] = 0x46;
+        SendCommand(b, cmd, 9);
+        len = ReadExecution(b, Block);
+        break;
+    case BenchWriteData:
+        cmd[0] = 0x45;
+        SendCommand(b, cmd, 9);
+        len = WriteExecution(b, eot * StoredSize(false, b->N), Block);
+        break;
+    case BenchReadTrack:
+        cmd[0] = 0x42;
+        cmd[6] = b->Sectors;
+        SendCommand(b, cmd, 9);
+        len = ReadExecution(b, Block);
+        break;
+    case BenchReadID:
+        cmd[0] = 0x4a;
+        SendCommand(b, cmd, 2);
+        break;
+    case BenchSeek:
+        b->Track = b->Track == 0 ? NUM_TRACKS - 1 : 0;
+        cmd[0] = 0x0f;
+        cmd[2] = b->Track;
+        SendCommand(b, cmd, 3);
+        break;
+    case BenchSenseInterruptStatus:
+        cmd[0] = 0x08;
+        SendCommand(b, cmd, 1);
+        break;
+    }
+
+    ReadResults(b);
+    return len;
+}
+
+static char const* const CommandNames[] = {
+    "Read Data", "Write Data", "Read Track", "Read ID", "Seek", "Sense Interrupt Status"
+};
+
+// times Command until TimeLimit has passed. A Seek is always followed by the Sense Interrupt
+// Status that ends it and a Sense Interrupt Status follows a Seek, but only the command
+// named is timed
+static void BenchRow(Bench* b, char const* Engine, BenchCommand Command, bool Multi, bool Block) {
+    double elapsed = 0, start, t;
+    uint64_t commands = 0, bytes = 0, allocations = 0, a;
+
+    uint32_t const sectors = Command == BenchReadTrack || Multi ? b->Sectors : 1;
+    uint32_t const expected = Command == BenchWriteData ? sectors * StoredSize(false, b->N) :
+                              Command <= BenchReadTrack ? sectors << (7 + b->N) : 0;
+
+    // a write takes the DSK sector size whatever the image, and the track is cached from here on
+    if (RunCommand(b, Command, Multi, Block) != expected) {
+        fprintf(stderr, "%s moved an unexpected number of bytes\n", CommandNames[Command]);
+        exit(1);
+    }
+
+    start = Now();
+
+    while (Now() - start < TimeLimit) {
+        if (Command == BenchSenseInterruptStatus) {
+            RunCommand(b, BenchSeek, false, false);
+        }
+
+        a = AllocationCount();
+        t = Now();
+        bytes += RunCommand(b, Command, Multi, Block);
+        elapsed += Now() - t;
+        allocations += AllocationCount() - a;
+        commands++;
+
+        if (Command == BenchSeek) {
+            RunCommand(b, BenchSenseInterruptStatus, false, false);
+        }
+    }
+
+    printf("%-8s %-4s N=%u %-22s %-6s %-5s %12.0f", Engine, b->Extended ? "EDSK" : "DSK", b->N, CommandNames[Command],
+           Command <= BenchReadTrack ? (Multi || Command == BenchReadTrack ? "multi" : "single") : "",
+           Command <= BenchReadTrack ? (Block ? "block" : "byte") : "", commands / elapsed);
+
+    if (bytes != 0) {
+        printf(" %10.2f", elapsed * 1e9 / bytes);
+    }
+    else {
+        printf(" %10s", "-");
+    }
+
+#ifdef BENCH_COUNT_ALLOCS
+    printf(" %10.3f\n", (double)allocations / commands);
+#else
+    printf(" %10s\n", "-");
+#endif
+}
+
+static void BenchImage(char const* Engine, uint32_t EngineId, bool Extended, uint8_t N) {
+    static Bench b;
+    uint32_t const sectors = 4608 / StoredSize(Extended, N) >= 2 ? 4608 / StoredSize(Extended, N) : 2;
+    uint8_t* image;
+    size_t len;
+    BenchCommand command;
+    int multi, block;
+
+    b.Extended = Extended;
+    b.Sectors = (uint8_t)sectors;
+    b.N = N;
+    b.Track = 0;
+    image = MakeImage(Extended, b.Sectors, N, &len);
+    b.Fdc = u765_InitialiseEx(EngineId);
+
+    if (image == NULL || b.Fdc == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    u765_InsertDiskFromMemory(b.Fdc, image, len, 0, u765_InsertBorrow);
+    u765_SetMotorState(b.Fdc, 8);
+
+    if (!u765_DiskInserted(b.Fdc, 0)) {
+        fprintf(stderr, "image not accepted\n");
+        exit(1);
+    }
+
+    memset(b.Buffer, 0x5a, sizeof(b.Buffer));
+
+    for (command = BenchReadData; command <= BenchReadTrack; command++) {
+        for (multi = 0; multi < 2; multi++) {
+            if (command == BenchReadTrack && multi == 0) {
+                continue;
+            }
+
+            for (block = 0; block < 2; block++) {
+                BenchRow(&b, Engine, command, multi != 0, block != 0);
+            }
+        }
+    }
+
+    // the commands without an execution phase don't depend on the sector size
+    if (N == 2) {
+        for (command = BenchReadID; command <= BenchSenseInterruptStatus; command++) {
+            BenchRow(&b, Engine, command, false, false);
+        }
+    }
+
+    u765_Shutdown(b.Fdc);
+    free(image);
+}
+
+int main(int argc, char** argv) {
+    static char const* const names[] = { "default", "direct" };
+    char const* engines[8];
+    int numEngines = 0, i, e, extended;
+    uint8_t N;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            TimeLimit = atof(argv[++i]) / 1000;
+        }
+        else if (numEngines < 8) {
+            engines[numEngines++] = argv[i];
+        }
+    }
+
+    if (numEngines == 0) {
+        engines[numEngines++] = "default";
+        engines[numEngines++] = "direct";
+    }
+
+    printf("%-8s %-4s %-3s %-22s %-6s %-5s %12s %10s %10s\n", "engine", "disk", "N", "command", "", "io", "commands/s", "ns/byte", "allocs/cmd");
+
+    for (i = 0; i < numEngines; i++) {
+        for (e = 0; e < 2 && strcmp(engines[i], names[e]) != 0; e++) {
+        }
+
+        if (e == 2) {
+            fprintf(stderr, "unknown engine %s\n", engines[i]);
+            return 1;
+        }
+
+        for (extended = 0; extended < 2; extended++) {
+            for (N = 2; N <= 6; N++) {
+                BenchImage(names[e], e, extended != 0, N);
+            }
+        }
+    }
+
+    return 0;
+}
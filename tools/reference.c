@@ -0,0 +1,28 @@
+// The port as it was first committed, kept unchanged in tools/reference and built here with
+// its functions renamed, so that replay can run it next to the library to check that the
+// library still does what it did. Its include guard keeps the library's header out.
+
+#define u765_DataPortRead Reference_DataPortRead
+#define u765_DataPortWrite Reference_DataPortWrite
+#define u765_DiskInserted Reference_DiskInserted
+#define u765_EjectDisk Reference_EjectDisk
+#define u765_GetFDCState Reference_GetFDCState
+#define u765_GetMotorState Reference_GetMotorState
+#define u765_Initialise Reference_Initialise
+#define u765_InsertDisk Reference_InsertDisk
+#define u765_ResetDevice Reference_ResetDevice
+#define u765_SetActiveCallback Reference_SetActiveCallback
+#define u765_SetCommandCallback Reference_SetCommandCallback
+#define u765_SetMotorState Reference_SetMotorState
+#define u765_SetRandomMethod Reference_SetRandomMethod
+#define u765_Shutdown Reference_Shutdown
+#define u765_StatusPortRead Reference_StatusPortRead
+
+// it reads parts of registers it never set, such as the upper half of ECX when copying a track,
+// so its locals start zeroed for it to do the same on every run
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC optimize ("-ftrivial-auto-var-init=zero")
+#endif
+
+#include "reference/fdc765.h"
+#include "reference/fdc765.c"
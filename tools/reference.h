@@ -0,0 +1,23 @@
+// The original port built by reference.c, its controller left opaque. It has two units, takes
+// disks from files only, and its data port moves a byte at a time.
+
+#ifndef REFERENCE_H__
+#define REFERENCE_H__
+
+#include <fdc765.h>
+
+typedef struct Reference Reference;
+
+Reference* U765_FUNCTION(Reference_Initialise)(void);
+void U765_FUNCTION(Reference_Shutdown)(Reference* FdcHandle);
+void U765_FUNCTION(Reference_ResetDevice)(Reference* FdcHandle);
+void U765_FUNCTION(Reference_InsertDisk)(Reference* FdcHandle, char const* lpFilename, uint8_t Unit);
+void U765_FUNCTION(Reference_EjectDisk)(Reference* FdcHandle, uint8_t Unit);
+void U765_FUNCTION(Reference_SetMotorState)(Reference* FdcHandle, uint8_t Value);
+uint8_t U765_FUNCTION(Reference_StatusPortRead)(Reference* FdcHandle);
+uint8_t U765_FUNCTION(Reference_DataPortRead)(Reference* FdcHandle);
+void U765_FUNCTION(Reference_DataPortWrite)(Reference* FdcHandle, uint8_t DataByte);
+void U765_FUNCTION(Reference_SetRandomMethod)(Reference* FdcHandle, uint8_t RndMethod);
+void U765_FUNCTION(Reference_GetFDCState)(Reference* FdcHandle, u765_State* lpFDCState);
+
+#endif // REFERENCE_H__
@@ -0,0 +1,1288 @@
+// Trace replay for fdc765.
+//
+// Re-executes a trace recorded with u765_StartTrace against a fresh controller as fast as it
+// can, reporting the accesses that returned something else than when the trace was recorded
+// and the time the replay took. Built with U765_STATS, the counters of each command are
+// listed as well.
+//
+// In lockstep, the trace is replayed by the default engine while a direct engine controller is
+// sent the same calls, and checked against it after every port access and whenever a disk is
+// written back.
+//
+// In fuzz mode, the trace, if any, is replayed in lockstep, which then runs random streams of
+// commands against random DSK and EDSK images, one set of controllers per round seeded with the
+// seed given plus the round number. Every other round, the original port kept in
+// tools/reference is run in lockstep as well, the round sticking to what it carries out the way
+// the library does: two units, DSK images inserted from files, no block transfers, states,
+// Format Track or Scan commands. Any difference is reported, along with the seed that repeats
+// the round alone.
+//
+//   replay trace [default|direct|lockstep] [-n repeats]
+//   replay fuzz [trace] [-s seed] [-n rounds]
+
+#include <fdc765.h>
+#include "reference.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_REPORTED 10
+
+#define FUZZ_COMMANDS 2000      // commands sent in each round
+#define FUZZ_MAX_POLLS 1000000  // port accesses a command may take before the controller is reset
+#define FUZZ_MAX_IMAGES 16      // images inserted in each round, kept until it ends
+#define FUZZ_MAX_TRACKS 84
+#define FUZZ_MAX_SECTORS 12
+#define FUZZ_REFERENCE_MAX_N 5  // largest N sent to the original port, which doesn't keep transfers inside TrackBlock
+
+#define REFERENCE_FILE "fdc765-replay-%u.dsk"   // the disk in each unit of the original port
+#define ENGINE_LOCKSTEP 2   // the default engine checked against the direct one
+
+typedef struct {
+    uint8_t const* Data;
+    size_t Len;
+    size_t Pos;
+    bool Ok;
+}
+Trace;
+
+typedef struct {
+    uint8_t* Data;
+    size_t Len;
+}
+Image;
+
+// the controllers sent the same calls: the one replayed or fuzzed, and those checked against
+// it after every port access, a direct engine controller and the original port, when they run
+typedef struct {
+    u765_Controller* Fdc;
+    u765_Controller* Direct;
+    Reference* Ref;
+    uint64_t Step;              // port accesses made
+    Image WrittenBack[2][4];    // images Fdc and Direct wrote back for each unit since last checked
+    Image Inserted[4];          // image last inserted in each unit of Ref, what its file holds unless written to
+    uint8_t* Buffer;            // block transfers of Direct
+    uint32_t BufferLen;
+}
+Lockstep;
+
+typedef struct {
+    uint8_t Code;
+    uint8_t Params;
+    uint8_t Flags;  // which of MT, MF and SK the command takes
+}
+FuzzCommand;
+
+// controllers running random commands, with what was last seen of each unit so that the
+// parameters often name a sector that exists
+typedef struct {
+    Lockstep Run;
+    bool Reference;         // the round sticks to what the original port can do
+    uint32_t NumUnits;
+    uint8_t* Images[FUZZ_MAX_IMAGES];
+    uint32_t NumImages;
+    uint8_t Command[9];
+    uint32_t Written;       // execution phase bytes written for Command
+    uint8_t Track[4];       // track each unit was last sought to
+    uint8_t LastID[4][4];   // C, H, R, N last returned for each unit
+    uint64_t Commands;
+    uint64_t Accesses;
+    uint8_t Buffer[1024];
+}
+Fuzz;
+
+static uint64_t Mismatches;
+static uint32_t Random;
+
+static FuzzCommand const FuzzCommands[] = {
+    { 0x06, 8, 0xe0 },  // Read Data
+    { 0x0c, 8, 0xe0 },  // Read Deleted Data
+    { 0x05, 8, 0xc0 },  // Write Data
+    { 0x09, 8, 0xc0 },  // Write Deleted Data
+    { 0x02, 8, 0x60 },  // Read Track
+    { 0x0a, 1, 0x40 },  // Read ID
+    { 0x0d, 5, 0x40 },  // Format Track
+    { 0x11, 8, 0xe0 },  // Scan Equal
+    { 0x19, 8, 0xe0 },  // Scan Low Or Equal
+    { 0x1d, 8, 0xe0 },  // Scan High Or Equal
+    { 0x0f, 2, 0x00 },  // Seek
+    { 0x07, 1, 0x00 },  // Recalibrate
+    { 0x08, 0, 0x00 },  // Sense Interrupt Status
+    { 0x04, 1, 0x00 },  // Sense Drive Status
+    { 0x03, 2, 0x00 },  // Specify
+    { 0x10, 0, 0x00 }   // Version
+};
+
+#ifdef U765_STATS
+static u765_Stats Stats;
+
+static char const* const CommandNames[32] = {
+    NULL, NULL, "Read Track", "Specify", "Sense Drive Status", "Write Data", "Read Data", "Recalibrate",
+    "Sense Interrupt Status", "Write Deleted Data", "Read ID", NULL, "Read Deleted Data", "Format Track", NULL, "Seek",
+    "Version", "Scan Equal", NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, "Scan Low Or Equal", NULL, NULL, NULL, "Scan High Or Equal", NULL, NULL
+};
+
+static void AddStats(u765_Controller* fdc) {
+    u765_Stats stats;
+    int i;
+
+    u765_GetStats(fdc, &stats);
+
+    for (i = 0; i < 32; i++) {
+        Stats.Command[i].Commands += stats.Command[i].Commands;
+        Stats.Command[i].Revolutions += stats.Command[i].Revolutions;
+        Stats.Command[i].OverRuns += stats.Command[i].OverRuns;
+        Stats.Command[i].TrackCopies += stats.Command[i].TrackCopies;
+        Stats.Command[i].Bytes += stats.Command[i].Bytes;
+        Stats.Command[i].Nanoseconds += stats.Command[i].Nanoseconds;
+    }
+}
+
+static void PrintStats(void) {
+    u765_CommandStats* c;
+    int i;
+
+    printf("%-3s %-22s %10s %12s %11s %8s %11s %12s\n", "cmd", "", "commands", "bytes", "revolutions", "overruns", "track copies", "ms");
+
+    for (i = 0; i < 32; i++) {
+        c = &Stats.Command[i];
+
+        if (c->Commands != 0 || c->Nanoseconds != 0) {
+            printf("%3d %-22s %10u %12llu %11u %8u %11u %12.3f\n", i, CommandNames[i] != NULL ? CommandNames[i] : "Invalid", c->Commands,
+                   (unsigned long long)c->Bytes, c->Revolutions, c->OverRuns, c->TrackCopies, c->Nanoseconds / 1e6);
+        }
+    }
+}
+#endif
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t TraceByte(Trace* t) {
+    if (t->Pos >= t->Len) {
+        t->Ok = false;
+        return 0;
+    }
+
+    return t->Data[t->Pos++];
+}
+
+static uint64_t TraceNumber(Trace* t) {
+    uint64_t value = 0;
+    uint8_t b;
+    int shift = 0;
+
+    do {
+        b = TraceByte(t);
+        value |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+    }
+    while ((b & 0x80) != 0 && shift < 64);
+
+    return value;
+}
+
+// the next len bytes of the trace, NULL if it is shorter than that
+static uint8_t const* TraceBytes(Trace* t, uint64_t len) {
+    uint8_t const* data = t->Data + t->Pos;
+
+    if (len > t->Len - t->Pos) {
+        t->Ok = false;
+        return NULL;
+    }
+
+    t->Pos += (size_t)len;
+    return data;
+}
+
+static void Mismatch(size_t Pos, char const* What, uint8_t Recorded, uint8_t Replayed) {
+    if (Mismatches++ < MAX_REPORTED) {
+        printf("offset %zu: %s returned 0x%02x, 0x%02x was recorded\n", Pos, What, Replayed, Recorded);
+    }
+}
+
+static void BlockMismatch(size_t Pos, char const* What) {
+    if (Mismatches++ < MAX_REPORTED) {
+        printf("offset %zu: %s transferred something else than was recorded\n", Pos, What);
+    }
+}
+
+static void* Allocate(size_t Len) {
+    void* p = malloc(Len != 0 ? Len : 1);
+
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    return p;
+}
+
+// reports what differed in the controller checked, which is then left out for the rest of the
+// run, as everything after would differ as well
+static void LockstepMismatch(Lockstep* l, bool Ref, char const* What) {
+    if (Mismatches++ < MAX_REPORTED) {
+        printf("lockstep: access %llu, %s differs in the %s\n", (unsigned long long)l->Step, What, Ref ? "original port" : "direct engine");
+    }
+
+    if (Ref) {
+        Reference_Shutdown(l->Ref);
+        l->Ref = NULL;
+    }
+    else {
+        u765_Shutdown(l->Direct);
+        l->Direct = NULL;
+    }
+}
+
+// called with whether the direct engine returned the same, the rest of what the host can see is
+// compared here
+static void CheckDirect(Lockstep* l, bool Same, char const* What) {
+    u765_StateEx state, direct;
+
+    if (Same) {
+        u765_GetFDCStateEx(l->Fdc, &state);
+        u765_GetFDCStateEx(l->Direct, &direct);
+
+        if (memcmp(&state, &direct, sizeof(u765_StateEx)) != 0) {
+            Same = false;
+            What = "u765_StateEx";
+        }
+        else if (l->Fdc->FDCVector != l->Direct->FDCVector) {
+            Same = false;
+            What = "FDCVector";
+        }
+        else if (memcmp(l->Fdc->FDCResults, l->Direct->FDCResults, sizeof(l->Fdc->FDCResults)) != 0) {
+            Same = false;
+            What = "FDCResults";
+        }
+    }
+
+    if (!Same) {
+        LockstepMismatch(l, false, What);
+    }
+}
+
+static void CheckReference(Lockstep* l, bool Same, char const* What) {
+    u765_State state, ref;
+
+    if (Same) {
+        u765_GetFDCState(l->Fdc, &state);
+        Reference_GetFDCState(l->Ref, &ref);
+
+        if (memcmp(&state, &ref, sizeof(u765_State)) != 0) {
+            Same = false;
+            What = "u765_State";
+        }
+    }
+
+    if (!Same) {
+        LockstepMismatch(l, true, What);
+    }
+}
+
+static void WriteBack(void* User, uint8_t Unit, void const* Data, size_t Len) {
+    Image* image = &((Image*)User)[Unit];
+
+    free(image->Data);
+    image->Data = (uint8_t*)Allocate(Len);
+    image->Len = Len;
+    memcpy(image->Data, Data, Len);
+}
+
+// what the controllers wrote back of the disk just taken out of the unit, which the library
+// only does when it changed. the original port writes the whole image to its file from where
+// reading it left off, so the file then holds the image inserted followed by the one written
+static void CheckImages(Lockstep* l, uint8_t Unit) {
+    Image* fdc = &l->WrittenBack[0][Unit];
+    Image* direct = &l->WrittenBack[1][Unit];
+    Image* inserted = &l->Inserted[Unit];
+    char filename[32];
+    uint8_t* data;
+    size_t len;
+    FILE* f;
+    bool same;
+
+    if (l->Direct != NULL && (fdc->Len != direct->Len || (fdc->Len != 0 && memcmp(fdc->Data, direct->Data, fdc->Len) != 0))) {
+        LockstepMismatch(l, false, "the image written back");
+    }
+
+    if (l->Ref != NULL && inserted->Data != NULL) {
+        sprintf(filename, REFERENCE_FILE, Unit);
+        len = inserted->Len + fdc->Len;
+        data = (uint8_t*)Allocate(len + 1);
+        f = fopen(filename, "rb");
+        same = f != NULL && fread(data, 1, len + 1, f) == len && memcmp(data, inserted->Data, inserted->Len) == 0 &&
+            (fdc->Len == 0 || memcmp(data + inserted->Len, fdc->Data, fdc->Len) == 0);
+
+        if (f != NULL) {
+            fclose(f);
+        }
+
+        free(data);
+        remove(filename);
+
+        if (!same) {
+            LockstepMismatch(l, true, "the image written back");
+        }
+    }
+
+    free(fdc->Data);
+    free(direct->Data);
+    memset(fdc, 0, sizeof(*fdc));
+    memset(direct, 0, sizeof(*direct));
+    memset(inserted, 0, sizeof(*inserted));
+}
+
+static void LockstepStart(Lockstep* l, uint32_t Engine, uint32_t NumUnits, bool Direct, bool Ref) {
+    memset(l, 0, sizeof(*l));
+    l->Fdc = u765_InitialiseUnits(Engine, NumUnits);
+    l->Direct = Direct ? u765_InitialiseUnits(u765_EngineDirect, NumUnits) : NULL;
+    l->Ref = Ref ? Reference_Initialise() : NULL;
+
+    if (l->Fdc == NULL || (Direct && l->Direct == NULL) || (Ref && l->Ref == NULL)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    if (Direct || Ref) {
+        u765_SetWriteBackCallbackEx(l->Fdc, WriteBack, l->WrittenBack[0]);
+    }
+
+    if (Direct) {
+        u765_SetWriteBackCallbackEx(l->Direct, WriteBack, l->WrittenBack[1]);
+    }
+}
+
+static void LockstepShutdown(Lockstep* l) {
+    uint8_t unit;
+
+    u765_Shutdown(l->Fdc);
+
+    if (l->Direct != NULL) {
+        u765_Shutdown(l->Direct);
+    }
+
+    if (l->Ref != NULL) {
+        Reference_Shutdown(l->Ref);
+    }
+
+    l->Fdc = NULL;
+    l->Direct = NULL;
+    l->Ref = NULL;
+
+    for (unit = 0; unit < 4; unit++) {
+        free(l->WrittenBack[0][unit].Data);
+        free(l->WrittenBack[1][unit].Data);
+    }
+
+    free(l->Buffer);
+}
+
+// Shutdown writes back the disks still inserted, which are checked before it's done
+static void LockstepEnd(Lockstep* l) {
+    uint8_t unit;
+
+    if (l->Direct != NULL || l->Ref != NULL) {
+        for (unit = 0; unit < 4; unit++) {
+            u765_EjectDisk(l->Fdc, unit);
+
+            if (l->Direct != NULL) {
+                u765_EjectDisk(l->Direct, unit);
+            }
+
+            if (l->Ref != NULL && unit < 2) {
+                Reference_EjectDisk(l->Ref, unit);
+            }
+
+            CheckImages(l, unit);
+        }
+    }
+
+    LockstepShutdown(l);
+}
+
+static uint8_t LockstepStatusRead(Lockstep* l) {
+    uint8_t const value = u765_StatusPortRead(l->Fdc);
+
+    l->Step++;
+
+    if (l->Direct != NULL) {
+        CheckDirect(l, u765_StatusPortRead(l->Direct) == value, "u765_StatusPortRead");
+    }
+
+    if (l->Ref != NULL) {
+        CheckReference(l, Reference_StatusPortRead(l->Ref) == value, "u765_StatusPortRead");
+    }
+
+    return value;
+}
+
+static uint8_t LockstepDataRead(Lockstep* l) {
+    uint8_t const value = u765_DataPortRead(l->Fdc);
+
+    l->Step++;
+
+    if (l->Direct != NULL) {
+        CheckDirect(l, u765_DataPortRead(l->Direct) == value, "u765_DataPortRead");
+    }
+
+    if (l->Ref != NULL) {
+        CheckReference(l, Reference_DataPortRead(l->Ref) == value, "u765_DataPortRead");
+    }
+
+    return value;
+}
+
+static void LockstepDataWrite(Lockstep* l, uint8_t Value) {
+    u765_DataPortWrite(l->Fdc, Value);
+    l->Step++;
+
+    if (l->Direct != NULL) {
+        u765_DataPortWrite(l->Direct, Value);
+        CheckDirect(l, true, "u765_DataPortWrite");
+    }
+
+    if (l->Ref != NULL) {
+        Reference_DataPortWrite(l->Ref, Value);
+        CheckReference(l, true, "u765_DataPortWrite");
+    }
+}
+
+// the original port has no block transfers, they're only made without it
+static uint32_t LockstepReadBlock(Lockstep* l, uint8_t* Buffer, uint32_t MaxLen) {
+    uint32_t const len = u765_DataPortReadBlock(l->Fdc, Buffer, MaxLen);
+
+    l->Step++;
+
+    if (l->Direct != NULL) {
+        if (MaxLen > l->BufferLen) {
+            free(l->Buffer);
+            l->Buffer = (uint8_t*)Allocate(MaxLen);
+            l->BufferLen = MaxLen;
+        }
+
+        CheckDirect(l, u765_DataPortReadBlock(l->Direct, l->Buffer, MaxLen) == len && memcmp(l->Buffer, Buffer, len) == 0, "u765_DataPortReadBlock");
+    }
+
+    return len;
+}
+
+static uint32_t LockstepWriteBlock(Lockstep* l, uint8_t const* Buffer, uint32_t Len) {
+    uint32_t const len = u765_DataPortWriteBlock(l->Fdc, Buffer, Len);
+
+    l->Step++;
+
+    if (l->Direct != NULL) {
+        CheckDirect(l, u765_DataPortWriteBlock(l->Direct, Buffer, Len) == len, "u765_DataPortWriteBlock");
+    }
+
+    return len;
+}
+
+static void LockstepMotorState(Lockstep* l, uint8_t Value) {
+    u765_SetMotorState(l->Fdc, Value);
+
+    if (l->Direct != NULL) {
+        u765_SetMotorState(l->Direct, Value);
+    }
+
+    if (l->Ref != NULL) {
+        Reference_SetMotorState(l->Ref, Value);
+    }
+}
+
+static void LockstepReset(Lockstep* l) {
+    u765_ResetDevice(l->Fdc);
+
+    if (l->Direct != NULL) {
+        u765_ResetDevice(l->Direct);
+    }
+
+    if (l->Ref != NULL) {
+        Reference_ResetDevice(l->Ref);
+    }
+}
+
+static void LockstepRandomMethod(Lockstep* l, uint8_t Method) {
+    u765_SetRandomMethod(l->Fdc, Method);
+
+    if (l->Direct != NULL) {
+        u765_SetRandomMethod(l->Direct, Method);
+    }
+
+    if (l->Ref != NULL) {
+        Reference_SetRandomMethod(l->Ref, Method);
+    }
+}
+
+static void LockstepEject(Lockstep* l, uint8_t Unit) {
+    u765_EjectDisk(l->Fdc, Unit);
+
+    if (l->Direct != NULL) {
+        u765_EjectDisk(l->Direct, Unit);
+    }
+
+    if (l->Ref != NULL && Unit < 2) {
+        Reference_EjectDisk(l->Ref, Unit);
+    }
+
+    if (Unit < 4) {
+        CheckImages(l, Unit);
+    }
+}
+
+// the original port is given the image as a file, which it writes to
+static void LockstepInsert(Lockstep* l, uint8_t const* Data, size_t Len, uint8_t Unit, uint32_t Flags) {
+    char filename[32];
+    FILE* f;
+
+    LockstepEject(l, Unit);
+    u765_InsertDiskFromMemory(l->Fdc, Data, Len, Unit, Flags);
+
+    if (l->Direct != NULL) {
+        u765_InsertDiskFromMemory(l->Direct, Data, Len, Unit, Flags);
+    }
+
+    if (l->Ref != NULL && Unit < 2 && Data != NULL) {
+        sprintf(filename, REFERENCE_FILE, Unit);
+        f = fopen(filename, "wb");
+
+        if (f == NULL || fwrite(Data, 1, Len, f) != Len || fclose(f) != 0) {
+            fprintf(stderr, "can't write %s\n", filename);
+            exit(1);
+        }
+
+        Reference_InsertDisk(l->Ref, filename, Unit);
+        l->Inserted[Unit].Data = (uint8_t*)Data;
+        l->Inserted[Unit].Len = Len;
+    }
+}
+
+// the disks the state replaces are written back, and checked as if ejected
+static bool LockstepLoadState(Lockstep* l, uint8_t const* State, uint32_t Len) {
+    bool const ok = u765_LoadState(l->Fdc, State, Len);
+    uint8_t unit;
+
+    if (l->Direct != NULL) {
+        if (u765_LoadState(l->Direct, State, Len) != ok) {
+            LockstepMismatch(l, false, "u765_LoadState");
+        }
+        else {
+            for (unit = 0; unit < 4; unit++) {
+                CheckImages(l, unit);
+            }
+        }
+    }
+
+    return ok;
+}
+
+// replays the records of the trace once, returning the number of port accesses made
+static uint64_t Replay(Trace* t, uint32_t Engine, uint64_t* Cycles) {
+    Lockstep l;
+    uint8_t* buffer = NULL;
+    uint8_t const* data;
+    uint64_t accesses, len, maxLen;
+    uint32_t bufferLen = 0;
+    size_t start;
+    uint8_t type, unit, flags, value, got;
+
+    // in lockstep, the default engine is checked against the direct one
+    LockstepStart(&l, Engine == u765_EngineDirect ? u765_EngineDirect : u765_EngineDefault, t->Data[7], Engine == ENGINE_LOCKSTEP, false);
+    t->Pos = 8;
+    t->Ok = true;
+    *Cycles = 0;
+
+    while (t->Ok && t->Pos < t->Len) {
+        start = t->Pos;
+        type = TraceByte(t);
+
+        if ((type & 0x80) != 0) {
+            *Cycles += TraceNumber(t);
+        }
+
+        switch (type & 0x7f) {
+        case u765_TraceStatusRead:
+            value = TraceByte(t);
+            got = LockstepStatusRead(&l);
+            if (got != value && t->Ok) {
+                Mismatch(start, "u765_StatusPortRead", value, got);
+            }
+            break;
+        case u765_TraceDataRead:
+            value = TraceByte(t);
+            got = LockstepDataRead(&l);
+            if (got != value && t->Ok) {
+                Mismatch(start, "u765_DataPortRead", value, got);
+            }
+            break;
+        case u765_TraceDataWrite:
+            LockstepDataWrite(&l, TraceByte(t));
+            break;
+        case u765_TraceDataReadBlock:
+            maxLen = TraceNumber(t);
+            len = TraceNumber(t);
+            data = TraceBytes(t, len);
+
+            if (data == NULL || maxLen > 0xffffffff) {
+                t->Ok = false;
+                break;
+            }
+
+            if (maxLen > bufferLen) {
+                free(buffer);
+                bufferLen = (uint32_t)maxLen;
+                buffer = (uint8_t*)Allocate(bufferLen);
+            }
+
+            if (LockstepReadBlock(&l, buffer, (uint32_t)maxLen) != len || memcmp(buffer, data, (size_t)len) != 0) {
+                BlockMismatch(start, "u765_DataPortReadBlock");
+            }
+            break;
+        case u765_TraceDataWriteBlock:
+            maxLen = TraceNumber(t);
+            len = TraceNumber(t);
+            data = TraceBytes(t, maxLen);
+
+            if (data == NULL) {
+                break;
+            }
+
+            if (LockstepWriteBlock(&l, data, (uint32_t)maxLen) != len) {
+                BlockMismatch(start, "u765_DataPortWriteBlock");
+            }
+            break;
+        case u765_TraceMotorState:
+            LockstepMotorState(&l, TraceByte(t));
+            break;
+        case u765_TraceResetDevice:
+            LockstepReset(&l);
+            break;
+        case u765_TraceRandomMethod:
+            LockstepRandomMethod(&l, TraceByte(t));
+            break;
+        case u765_TraceInsertDisk:
+            unit = TraceByte(t);
+            flags = TraceByte(t);
+            len = TraceNumber(t);
+            data = TraceBytes(t, len);
+
+            if (data != NULL) {
+                LockstepInsert(&l, len != 0 ? data : NULL, (size_t)len, unit, flags);
+            }
+            break;
+        case u765_TraceEjectDisk:
+            LockstepEject(&l, TraceByte(t));
+            break;
+        case u765_TraceLoadState:
+            len = TraceNumber(t);
+            data = TraceBytes(t, len);
+
+            if (data != NULL && !LockstepLoadState(&l, data, (uint32_t)len)) {
+                printf("offset %zu: the state couldn't be loaded\n", start);
+            }
+            break;
+        default:
+            printf("offset %zu: unknown record %u\n", start, type);
+            t->Ok = false;
+            break;
+        }
+    }
+
+    if (!t->Ok) {
+        printf("the trace ends in the middle of a record\n");
+    }
+
+#ifdef U765_STATS
+    AddStats(l.Fdc);
+#endif
+
+    free(buffer);
+    accesses = l.Step;
+    LockstepEnd(&l);
+    return accesses;
+}
+
+static uint32_t NextRandom(void) {
+    Random ^= Random << 13;
+    Random ^= Random >> 17;
+    Random ^= Random << 5;
+    return Random;
+}
+
+static bool OneIn(uint32_t n) {
+    return NextRandom() % n == 0;
+}
+
+// a DSK or EDSK image of random geometry. EDSK tracks have their own sector size, and some are
+// unformatted, some sectors have their IDs or status bytes changed, and some are stored shorter
+// than their N or with several copies of weak data. The original port is only given DSK images,
+// as it lays EDSK tracks out again leaving the bytes after their sectors uninitialised. Their
+// sectors all have H 0 and never both DE and DD set, as a sector it randomises could be the
+// other head's or damaged, and it fetches the seed for that through the wrong pointer
+static uint8_t* FuzzImage(size_t* Len, bool Reference) {
+    static uint16_t stored[FUZZ_MAX_TRACKS][FUZZ_MAX_SECTORS];
+    static uint8_t numSectors[FUZZ_MAX_TRACKS], sizeN[FUZZ_MAX_TRACKS];
+    static uint32_t trackLen[FUZZ_MAX_TRACKS];
+    bool const extended = !Reference && OneIn(2);
+    uint32_t const tracks = 1 + NextRandom() % (FUZZ_MAX_TRACKS / 2), sides = 1 + NextRandom() % 2;
+    uint32_t const dskN = NextRandom() % 4, dskSectors = 1 + NextRandom() % 10;
+    uint32_t t, s, i, offset, len;
+    uint8_t* image;
+    uint8_t* track;
+    uint8_t* info;
+
+    *Len = 0x100;
+
+    for (t = 0; t < tracks * sides; t++) {
+        numSectors[t] = (uint8_t)(extended ? NextRandom() % (FUZZ_MAX_SECTORS + 1) : dskSectors);
+        sizeN[t] = (uint8_t)(extended ? NextRandom() % 6 : dskN);
+        trackLen[t] = 0x100;
+
+        if (extended && OneIn(8)) {
+            numSectors[t] = 0;
+            trackLen[t] = 0;    // unformatted
+        }
+
+        for (s = 0; s < numSectors[t]; s++) {
+            len = 128u << sizeN[t];
+
+            if (extended && OneIn(6)) {
+                len = OneIn(2) ? (NextRandom() % len) & ~127u : len * (2 + NextRandom() % 2);
+            }
+
+            if (trackLen[t] + len > 0xff00) {
+                numSectors[t] = (uint8_t)s;
+                break;
+            }
+
+            stored[t][s] = (uint16_t)len;
+            trackLen[t] += len;
+        }
+
+        trackLen[t] = (trackLen[t] + 0xff) & ~0xffu;
+        *Len += trackLen[t];
+    }
+
+    image = (uint8_t*)calloc(*Len, 1);
+
+    if (image == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    memcpy(image, extended ? "EXTENDED CPC DSK File\r\nDisk-Info\r\n" : "MV - CPCEMU Disk-File\r\nDisk-Info\r\n", 34);
+    image[0x30] = (uint8_t)tracks;
+    image[0x31] = (uint8_t)sides;
+
+    if (!extended) {
+        image[0x32] = (uint8_t)trackLen[0];
+        image[0x33] = (uint8_t)(trackLen[0] >> 8);
+    }
+
+    offset = 0x100;
+
+    for (t = 0; t < tracks * sides; t++) {
+        if (extended) {
+            image[0x34 + t] = (uint8_t)(trackLen[t] >> 8);
+        }
+
+        if (trackLen[t] == 0) {
+            continue;
+        }
+
+        track = image + offset;
+        memcpy(track, "Track-Info\r\n", 12);
+        track[0x10] = (uint8_t)(t / sides);
+        track[0x11] = (uint8_t)(t % sides);
+        track[0x14] = sizeN[t];
+        track[0x15] = numSectors[t];
+        track[0x16] = 0x4e;
+        track[0x17] = 0xe5;
+
+        for (s = 0; s < numSectors[t]; s++) {
+            info = track + 0x18 + s * 8;
+            info[0] = (uint8_t)(t / sides);
+            info[1] = (uint8_t)(Reference ? 0 : t % sides);
+            info[2] = (uint8_t)(s + 1);
+            info[3] = sizeN[t];
+
+            if (OneIn(10)) {
+                i = NextRandom() % 4;
+
+                if (!Reference || i != 1) {
+                    info[i] = (uint8_t)NextRandom();
+                }
+            }
+
+            if (OneIn(8)) {
+                info[4] = (uint8_t)(0x20 * (NextRandom() % 2) | 0x04 * (NextRandom() % 2) | NextRandom() % 2);   // DE, ND, MA
+                info[5] = (uint8_t)(0x20 * (NextRandom() % 2) | 0x40 * (NextRandom() % 2) | NextRandom() % 2);   // DD, CM, MD
+
+                if (Reference && (info[4] & 0x20) != 0) {
+                    info[5] &= ~0x20;
+                }
+            }
+
+            if (extended) {
+                info[6] = (uint8_t)stored[t][s];
+                info[7] = (uint8_t)(stored[t][s] >> 8);
+            }
+        }
+
+        for (i = 0x100; i < trackLen[t]; i++) {
+            track[i] = (uint8_t)NextRandom();
+        }
+
+        offset += trackLen[t];
+    }
+
+    return image;
+}
+
+static void FuzzInsert(Fuzz* z, uint8_t Unit) {
+    uint32_t flags = NextRandom() & (u765_InsertBorrow | u765_InsertWriteProtect);
+    size_t len;
+
+    if (z->NumImages == FUZZ_MAX_IMAGES) {
+        return;
+    }
+
+    z->Images[z->NumImages] = FuzzImage(&len, z->Reference);
+
+    if (z->Reference) {
+        flags &= ~u765_InsertWriteProtect;  // the original port only write protects EDSK images
+    }
+
+    // borrowed images stay the tool's until the round ends
+    LockstepInsert(&z->Run, z->Images[z->NumImages], len, Unit, flags);
+    z->NumImages++;
+}
+
+// saves the controllers and loads the state back, the engines have to have saved the same and
+// carry on from it alike
+static void FuzzReloadState(Fuzz* z) {
+    uint32_t const flags = NextRandom() % 2 != 0 ? u765_StateDiskDelta : u765_StateDefault;
+    uint32_t const len = u765_SaveState(z->Run.Fdc, NULL, 0, flags);
+    uint8_t* state;
+    uint8_t* direct;
+
+    if (len == 0) {
+        return;
+    }
+
+    state = (uint8_t*)Allocate(len);
+
+    if (u765_SaveState(z->Run.Fdc, state, len, flags) != len) {
+        free(state);
+        return;
+    }
+
+    if (z->Run.Direct != NULL) {
+        direct = (uint8_t*)Allocate(len);
+
+        if (u765_SaveState(z->Run.Direct, direct, len, flags) != len || memcmp(state, direct, len) != 0) {
+            LockstepMismatch(&z->Run, false, "u765_SaveState");
+        }
+
+        free(direct);
+    }
+
+    if (!LockstepLoadState(&z->Run, state, len)) {
+        printf("the state saved couldn't be loaded back\n");
+        Mismatches++;
+    }
+
+    free(state);
+}
+
+// the calls an application makes to a controller besides the ports, now and then, returning
+// whether it was reset, as a disk change does as well
+static bool FuzzEvent(Fuzz* z) {
+    switch (NextRandom() % 64) {
+    case 0:
+    case 1:
+        LockstepMotorState(&z->Run, OneIn(4) ? 0 : 8);
+        break;
+    case 2:
+        LockstepReset(&z->Run);
+        return true;
+    case 3:
+        LockstepRandomMethod(&z->Run, OneIn(4) ? 255 : (uint8_t)(NextRandom() % 3));
+        break;
+    case 4:
+        LockstepEject(&z->Run, (uint8_t)(NextRandom() % z->NumUnits));
+        return true;
+    case 5:
+        FuzzInsert(z, (uint8_t)(NextRandom() % z->NumUnits));
+        return true;
+    case 6:
+        if (!z->Reference) {
+            FuzzReloadState(z);
+        }
+        break;
+    }
+
+    return false;
+}
+
+// the next byte for the execution phase of the command: the sector IDs of a Format Track,
+// bytes that often match anything for a scan, and random data otherwise
+static uint8_t FuzzByte(Fuzz* z) {
+    uint32_t const i = z->Written++;
+
+    if ((z->Command[0] & 0x1f) == 0x0d && !OneIn(16)) {
+        switch (i % 4) {
+        case 0:
+            return z->Track[z->Command[1] & 3];
+        case 1:
+            return (z->Command[1] >> 2) & 1;
+        case 2:
+            return (uint8_t)(i / 4 + 1);
+        default:
+            return z->Command[2];
+        }
+    }
+
+    if ((z->Command[0] & 0x11) == 0x11 && OneIn(2)) {
+        return 0xff;
+    }
+
+    return (uint8_t)NextRandom();
+}
+
+// Format Track and the Scan commands, which the original port doesn't carry out
+static bool FuzzNewCommand(uint8_t Code) {
+    Code &= 0x1f;
+    return Code == 0x0d || Code == 0x11 || Code == 0x19 || Code == 0x1d;
+}
+
+// builds a random command, its parameters taken from the last IDs read half of the time
+static uint32_t FuzzBuild(Fuzz* z) {
+    FuzzCommand const* c;
+    uint8_t* cmd = z->Command;
+    uint8_t unit, head;
+    uint8_t const* id;
+
+    do {
+        c = &FuzzCommands[NextRandom() % (sizeof(FuzzCommands) / sizeof(FuzzCommands[0]))];
+    }
+    while (z->Reference && FuzzNewCommand(c->Code));
+
+    // the bytes of a command of the wrong length could start any other, so the original port
+    // isn't sent them
+    if (!z->Reference && OneIn(100)) {
+        cmd[0] = (uint8_t)NextRandom();     // most likely invalid, its length is up to the controller
+        return 1 + NextRandom() % 9;
+    }
+
+    unit = (uint8_t)(NextRandom() % 4);
+    head = (uint8_t)(NextRandom() % 2);
+    id = z->LastID[unit];
+    cmd[0] = (uint8_t)(c->Code | (NextRandom() & c->Flags));
+    cmd[1] = (uint8_t)(head << 2 | unit);
+
+    switch (c->Code) {
+    case 0x0d:
+        cmd[2] = OneIn(2) ? id[3] : (uint8_t)(NextRandom() % 7);    // N
+        cmd[3] = (uint8_t)(OneIn(10) ? NextRandom() : NextRandom() % (FUZZ_MAX_SECTORS + 1));  // SC
+        cmd[4] = (uint8_t)NextRandom();                             // GPL
+        cmd[5] = (uint8_t)NextRandom();                             // D
+        break;
+    case 0x0f:
+        cmd[2] = (uint8_t)(NextRandom() % (FUZZ_MAX_TRACKS / 2 + 2));
+        z->Track[unit] = cmd[2];
+        break;
+    case 0x07:
+        z->Track[unit] = 0;
+        break;
+    case 0x03:
+        cmd[1] = (uint8_t)NextRandom();
+        cmd[2] = (uint8_t)NextRandom();
+        break;
+    default:
+        if (c->Params < 8) {
+            break;
+        }
+
+        if (OneIn(2)) {
+            memcpy(&cmd[2], id, 4);
+        }
+        else {
+            cmd[2] = OneIn(8) ? (uint8_t)NextRandom() : z->Track[unit];
+            cmd[3] = OneIn(8) ? (uint8_t)NextRandom() : head;
+            cmd[4] = (uint8_t)(OneIn(10) ? NextRandom() : 1 + NextRandom() % FUZZ_MAX_SECTORS);
+            cmd[5] = (uint8_t)(OneIn(4) ? NextRandom() % 8 : id[3]);
+        }
+
+        cmd[6] = (uint8_t)(OneIn(8) ? NextRandom() : cmd[4] + NextRandom() % 4);   // EOT
+        cmd[7] = (uint8_t)NextRandom();                                             // GPL
+        cmd[8] = (uint8_t)(cmd[5] == 0 || OneIn(8) ? NextRandom() : 0xff);          // DTL
+
+        if ((c->Code & 0x11) == 0x11) {
+            cmd[8] = (uint8_t)(OneIn(8) ? NextRandom() : 1 + NextRandom() % 2);     // STP
+        }
+        break;
+    }
+
+    // the reads and writes the original port is sent are ones it carries out as the library does
+    if (z->Reference && c->Params == 8) {
+        if (cmd[5] > FUZZ_REFERENCE_MAX_N) {
+            cmd[5] %= FUZZ_REFERENCE_MAX_N + 1;
+        }
+
+        if (cmd[5] == 0 && cmd[8] == 0) {
+            cmd[8] = 0x80;  // the library takes a DTL of 0 as 128 bytes, the original port as none
+        }
+
+        if (c->Code == 0x02) {
+            cmd[3] = 0;     // Read Track takes any sector, but randomises those of another head
+        }
+    }
+
+    return 1 + c->Params;
+}
+
+// sends a random command and runs it to the end, reading and writing the data port byte by
+// byte or in blocks, and now and then idling or making another call in the middle of it
+static void FuzzRun(Fuzz* z) {
+    uint32_t const len = FuzzBuild(z);
+    uint8_t results[7];
+    uint32_t polls = 0, sent = 0, numResults = 0, block, written, i;
+    uint8_t msr, value;
+
+    z->Written = 0;
+    z->Commands++;
+
+    while (polls++ < FUZZ_MAX_POLLS) {
+        msr = LockstepStatusRead(&z->Run);
+        z->Accesses++;
+
+        if ((msr & 0x80) == 0) {
+            continue;
+        }
+
+        if ((msr & 0x10) == 0 && sent == len) {
+            break;      // back to the command phase
+        }
+
+        if (OneIn(512)) {
+            if (FuzzEvent(z) && z->Reference) {
+                sent = len;     // the rest of the command could start a Scan or Format Track
+            }
+            continue;
+        }
+
+        if (OneIn(256)) {
+            for (block = NextRandom() % 4096; block != 0; block--) {
+                LockstepStatusRead(&z->Run);    // the CPU is busy elsewhere
+                z->Accesses++;
+            }
+            continue;
+        }
+
+        if ((msr & 0x40) != 0) {
+            if ((msr & 0x20) != 0 && !z->Reference && OneIn(2)) {
+                block = 1 + NextRandom() % sizeof(z->Buffer);
+                LockstepReadBlock(&z->Run, z->Buffer, block);
+            }
+            else {
+                value = LockstepDataRead(&z->Run);
+
+                if ((msr & 0x20) == 0 && numResults < 7) {
+                    results[numResults++] = value;
+                }
+            }
+
+            sent = len;     // whatever wasn't sent isn't wanted any more
+        }
+        else if (sent < len) {
+            LockstepDataWrite(&z->Run, z->Command[sent++]);
+        }
+        else if ((msr & 0x20) != 0 && !z->Reference && OneIn(2)) {
+            written = z->Written;
+            block = 1 + NextRandom() % sizeof(z->Buffer);
+
+            for (i = 0; i < block; i++) {
+                z->Buffer[i] = FuzzByte(z);
+            }
+
+            z->Written = written + LockstepWriteBlock(&z->Run, z->Buffer, block);
+        }
+        else {
+            LockstepDataWrite(&z->Run, FuzzByte(z));
+        }
+
+        z->Accesses++;
+    }
+
+    if (polls > FUZZ_MAX_POLLS) {
+        LockstepReset(&z->Run);     // the command never ended
+    }
+
+    if (numResults == 7) {
+        memcpy(z->LastID[results[0] & 3], &results[3], 4);
+    }
+}
+
+// one round: controllers with a random number of units and images, sent FUZZ_COMMANDS random
+// commands, returning whether they never differed. Every other round runs the original port
+// as well, with the two units it has
+static bool FuzzRound(Fuzz* z, uint32_t Seed) {
+    uint64_t const mismatches = Mismatches;
+    uint32_t i;
+
+    Random = Seed != 0 ? Seed : 1;
+    memset(z, 0, sizeof(*z));
+    z->Reference = Seed % 2 == 0;
+    z->NumUnits = z->Reference ? 2 : 1 + NextRandom() % 4;
+    LockstepStart(&z->Run, u765_EngineDefault, z->NumUnits, true, z->Reference);
+
+    for (i = 0; i < z->NumUnits; i++) {
+        if (!OneIn(4)) {
+            FuzzInsert(z, (uint8_t)i);
+        }
+    }
+
+    LockstepMotorState(&z->Run, 8);
+
+    for (i = 0; i < FUZZ_COMMANDS; i++) {
+        if (OneIn(16)) {
+            FuzzEvent(z);
+        }
+
+        FuzzRun(z);
+    }
+
+#ifdef U765_STATS
+    AddStats(z->Run.Fdc);
+#endif
+
+    LockstepEnd(&z->Run);
+
+    for (i = 0; i < z->NumImages; i++) {
+        free(z->Images[i]);
+    }
+
+    return Mismatches == mismatches;
+}
+
+int main(int argc, char** argv) {
+    static char const* const names[] = { "default", "direct", "lockstep" };
+    static Fuzz z;
+    char const* filename = NULL;
+    uint32_t engine = u765_EngineDefault, repeats = 1, seed = 1, i, e;
+    uint64_t accesses = 0, cycles = 0, commands = 0;
+    uint8_t* data = NULL;
+    double start, elapsed;
+    bool fuzz = false, ok = true;
+    Trace t = { NULL, 0, 0, true };
+    FILE* f;
+    long len;
+
+    for (i = 1; i < (uint32_t)argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < (uint32_t)argc) {
+            repeats = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < (uint32_t)argc) {
+            seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "fuzz") == 0) {
+            fuzz = true;
+        }
+        else {
+            for (e = 0; e < 3 && strcmp(argv[i], names[e]) != 0; e++) {
+            }
+
+            if (e < 3) {
+                engine = e;
+            }
+            else {
+                filename = argv[i];
+            }
+        }
+    }
+
+    if (filename == NULL && !fuzz) {
+        fprintf(stderr, "usage: replay trace [default|direct|lockstep] [-n repeats]\n");
+        fprintf(stderr, "       replay fuzz [trace] [-s seed] [-n rounds]\n");
+        return 1;
+    }
+
+    if (fuzz) {
+        engine = ENGINE_LOCKSTEP;   // the engines are checked against each other
+    }
+
+    if (filename != NULL) {
+        f = fopen(filename, "rb");
+
+        if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 8 || fseek(f, 0, SEEK_SET) != 0) {
+            fprintf(stderr, "can't read %s\n", filename);
+            return 1;
+        }
+
+        data = (uint8_t*)malloc((size_t)len);
+
+        if (data == NULL || fread(data, 1, (size_t)len, f) != (size_t)len) {
+            fprintf(stderr, "can't read %s\n", filename);
+            return 1;
+        }
+
+        fclose(f);
+
+        if (memcmp(data, "U7TR", 4) != 0 || (data[4] | data[5] << 8) != 2) {
+            fprintf(stderr, "%s isn't a trace this replay understands\n", filename);
+            return 1;
+        }
+
+        t.Data = data;
+        t.Len = (size_t)len;
+
+        start = Now();
+
+        for (i = 0; i < (fuzz ? 1 : repeats); i++) {
+            accesses += Replay(&t, engine, &cycles);
+        }
+
+        elapsed = Now() - start;
+
+        printf("%s: %llu port accesses", names[engine], (unsigned long long)accesses);
+
+        if ((data[6] & u765_TraceCycles) != 0) {
+            printf(" over %llu cycles", (unsigned long long)cycles);
+        }
+
+        printf(" in %.3f s, %.1f ns per access, %llu mismatches\n", elapsed, accesses != 0 ? elapsed * 1e9 / accesses : 0.0, (unsigned long long)Mismatches);
+    }
+
+    if (fuzz) {
+        start = Now();
+        accesses = 0;
+
+        for (i = 0; i < repeats; i++) {
+            if (!FuzzRound(&z, seed + i)) {
+                printf("round %u differs, replay fuzz -s %u -n 1 runs it alone\n", i, seed + i);
+                ok = false;
+            }
+
+            accesses += z.Accesses;
+            commands += z.Commands;
+        }
+
+        printf("fuzz: %u rounds from seed %u, %llu commands, %llu port accesses in %.3f s, %s\n", repeats, seed,
+               (unsigned long long)commands, (unsigned long long)accesses, Now() - start, ok ? "no differences" : "the controllers differ");
+    }
+
+#ifdef U765_STATS
+    PrintStats();
+#endif
+
+    free(data);
+    return Mismatches != 0 || !t.Ok ? 2 : 0;
+}
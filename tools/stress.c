@@ -0,0 +1,385 @@
+// Thread stress test for fdc765.
+//
+// Runs a controller and a clone on each thread, reading and writing sectors of three disks:
+// one image only that thread uses, one application buffer every thread borrows, and one mapped
+// file all the clones share with the controller they were made from. That controller writes to
+// the file once the clones are made, and is shut down while the threads run. What each read
+// returns is checked against what the thread wrote, the borrowed buffer against a fresh copy
+// once the threads are done, and the file against what the controller wrote and nothing else.
+//
+//   stress [engine] [-t threads] [-n rounds]
+//
+// Building it with -fsanitize=thread (make stress TOOLFLAGS=-fsanitize=thread) reports any
+// access to memory the threads have in common that isn't synchronized.
+
+#include <fdc765.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_TRACKS 40
+#define NUM_SECTORS 9
+#define SECTOR_SIZE 512
+#define TRACK_SIZE (NUM_SECTORS * SECTOR_SIZE)
+#define MAX_THREADS 64
+#define SHARED_FILE "fdc765-stress.dsk"
+
+// a disk as a thread expects to read it back
+typedef struct {
+    u765_Controller* Fdc;
+    uint8_t Unit;
+    uint8_t Track;  // track the head was last moved to
+    uint8_t Data[NUM_TRACKS][TRACK_SIZE];
+}
+Disk;
+
+typedef struct {
+    pthread_t Thread;
+    uint32_t Index;
+    uint32_t Rounds;
+    uint32_t Random;
+    uint32_t Failures;
+    Disk Disks[3];          // own image, borrowed buffer, image shared by the clones
+    uint8_t Buffer[SECTOR_SIZE];
+}
+Worker;
+
+static uint8_t PatternByte(uint32_t Seed, uint32_t Track, uint32_t i) {
+    return (uint8_t)(i * 7 + Track + Seed * 13);
+}
+
+// a single sided DSK image of NUM_TRACKS tracks of NUM_SECTORS 512 byte sectors
+static uint8_t* MakeImage(uint32_t Seed, size_t* Len) {
+    uint32_t const trackLen = 0x100 + TRACK_SIZE;
+    uint8_t* image;
+    uint8_t* track;
+    uint32_t t, s, i;
+
+    *Len = 0x100 + NUM_TRACKS * trackLen;
+    image = (uint8_t*)calloc(*Len, 1);
+
+    if (image == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    memcpy(image, "MV - CPCEMU Disk-File\r\nDisk-Info\r\n", 34);
+    memcpy(image + 0x22, "fdc765 stress", 13);
+    image[0x30] = NUM_TRACKS;
+    image[0x31] = 1;
+    image[0x32] = (uint8_t)trackLen;
+    image[0x33] = (uint8_t)(trackLen >> 8);
+
+    for (t = 0; t < NUM_TRACKS; t++) {
+        track = image + 0x100 + t * trackLen;
+        memcpy(track, "Track-Info\r\n", 12);
+        track[0x10] = (uint8_t)t;
+        track[0x14] = 2;
+        track[0x15] = NUM_SECTORS;
+        track[0x16] = 0x4e;
+        track[0x17] = 0xe5;
+
+        for (s = 0; s < NUM_SECTORS; s++) {
+            track[0x18 + s * 8 + 0] = (uint8_t)t;
+            track[0x18 + s * 8 + 2] = (uint8_t)(s + 1);
+            track[0x18 + s * 8 + 3] = 2;
+        }
+
+        for (i = 0; i < TRACK_SIZE; i++) {
+            track[0x100 + i] = PatternByte(Seed, t, i);
+        }
+    }
+
+    return image;
+}
+
+static bool WriteFile(char const* Filename, uint8_t const* Data, size_t Len) {
+    FILE* f = fopen(Filename, "wb");
+    bool ok = f != NULL && fwrite(Data, 1, Len, f) == Len;
+
+    if (f != NULL && fclose(f) != 0) {
+        ok = false;
+    }
+
+    return ok;
+}
+
+static bool ReadFile(char const* Filename, uint8_t* Data, size_t Len) {
+    FILE* f = fopen(Filename, "rb");
+    bool ok = f != NULL && fread(Data, 1, Len, f) == Len;
+
+    if (f != NULL) {
+        fclose(f);
+    }
+
+    return ok;
+}
+
+static void ExpectImage(Disk* d, uint32_t Seed) {
+    uint32_t t, i;
+
+    for (t = 0; t < NUM_TRACKS; t++) {
+        for (i = 0; i < TRACK_SIZE; i++) {
+            d->Data[t][i] = PatternByte(Seed, t, i);
+        }
+    }
+}
+
+static uint32_t NextRandom(Worker* w) {
+    w->Random ^= w->Random << 13;
+    w->Random ^= w->Random >> 17;
+    w->Random ^= w->Random << 5;
+    return w->Random;
+}
+
+static void SendCommand(u765_Controller* fdc, uint8_t const* bytes, uint32_t len) {
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        while ((u765_StatusPortRead(fdc) & 0xc0) != 0x80) {
+        }
+
+        u765_DataPortWrite(fdc, bytes[i]);
+    }
+}
+
+// reads the result phase, true if ST1 and ST2 report no error. Without TC, a transfer always
+// ends with End of Cylinder and ST0 reporting an abnormal termination
+static bool ReadResults(u765_Controller* fdc) {
+    uint8_t results[7] = { 0 };
+    uint32_t len = 0;
+
+    while ((u765_StatusPortRead(fdc) & 0xe0) == 0xc0) {
+        results[len < 7 ? len++ : 6] = u765_DataPortRead(fdc);
+    }
+
+    return (results[1] & 0x7f) == 0 && results[2] == 0;
+}
+
+static void Fail(Worker* w, Disk* d, char const* What, uint8_t Sector) {
+    if (w->Failures++ == 0) {
+        fprintf(stderr, "thread %u: %s failed on unit %u track %u sector %u\n", w->Index, What, d->Unit, d->Track, Sector);
+    }
+}
+
+static void Seek(Disk* d, uint8_t Track) {
+    uint8_t const seek[3] = { 0x0f, d->Unit, Track };
+    uint8_t const sense[1] = { 0x08 };
+
+    SendCommand(d->Fdc, seek, 3);
+    ReadResults(d->Fdc);
+    SendCommand(d->Fdc, sense, 1);
+    ReadResults(d->Fdc);
+    d->Track = Track;
+}
+
+static void WriteSector(Worker* w, Disk* d, uint8_t Sector) {
+    uint8_t const cmd[9] = { 0x45, d->Unit, d->Track, 0, (uint8_t)(Sector + 1), 2, (uint8_t)(Sector + 1), 0x2a, 0xff };
+    uint32_t const seed = NextRandom(w);
+    uint32_t i, len;
+
+    for (i = 0; i < SECTOR_SIZE; i++) {
+        w->Buffer[i] = (uint8_t)(seed + i);
+    }
+
+    SendCommand(d->Fdc, cmd, 9);
+
+    len = u765_DataPortWriteBlock(d->Fdc, w->Buffer, SECTOR_SIZE);
+
+    if (!ReadResults(d->Fdc) || len != SECTOR_SIZE) {
+        Fail(w, d, "Write Data", Sector);
+        return;
+    }
+
+    memcpy(d->Data[d->Track] + Sector * SECTOR_SIZE, w->Buffer, SECTOR_SIZE);
+}
+
+static void ReadSector(Worker* w, Disk* d, uint8_t Sector) {
+    uint8_t const cmd[9] = { 0x46, d->Unit, d->Track, 0, (uint8_t)(Sector + 1), 2, (uint8_t)(Sector + 1), 0x2a, 0xff };
+    uint32_t len;
+
+    SendCommand(d->Fdc, cmd, 9);
+
+    len = u765_DataPortReadBlock(d->Fdc, w->Buffer, SECTOR_SIZE);
+
+    if (!ReadResults(d->Fdc) || len != SECTOR_SIZE) {
+        Fail(w, d, "Read Data", Sector);
+        return;
+    }
+
+    if (memcmp(d->Data[d->Track] + Sector * SECTOR_SIZE, w->Buffer, SECTOR_SIZE) != 0) {
+        Fail(w, d, "comparing the data read", Sector);
+    }
+}
+
+static void* Run(void* Arg) {
+    Worker* w = (Worker*)Arg;
+    Disk* d;
+    uint32_t round, r;
+
+    for (round = 0; round < w->Rounds; round++) {
+        r = NextRandom(w);
+        d = &w->Disks[r % 3];
+
+        if ((r >> 2) % 4 == 0) {
+            Seek(d, (uint8_t)((r >> 4) % NUM_TRACKS));
+        }
+
+        if ((r >> 10) % 3 == 0) {
+            WriteSector(w, d, (uint8_t)((r >> 12) % NUM_SECTORS));
+        }
+        else {
+            ReadSector(w, d, (uint8_t)((r >> 12) % NUM_SECTORS));
+        }
+    }
+
+    return NULL;
+}
+
+static u765_Controller* NewController(uint32_t Engine) {
+    u765_Controller* fdc = u765_InitialiseEx(Engine);
+
+    if (fdc == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    return fdc;
+}
+
+int main(int argc, char** argv) {
+    static char const* const names[] = { "default", "direct" };
+    static Worker workers[MAX_THREADS];
+    static Worker owner;
+    uint32_t engine = u765_EngineDefault, threads = 8, rounds = 20000, failures = 0, i, e, t;
+    u765_Controller* master;
+    uint8_t* borrowed;
+    uint8_t* original;
+    uint8_t* shared;
+    uint8_t* image;
+    size_t len;
+
+    for (i = 1; i < (uint32_t)argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < (uint32_t)argc) {
+            threads = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < (uint32_t)argc) {
+            rounds = (uint32_t)atoi(argv[++i]);
+        }
+        else {
+            for (e = 0; e < 2 && strcmp(argv[i], names[e]) != 0; e++) {
+            }
+
+            if (e == 2) {
+                fprintf(stderr, "usage: stress [default|direct] [-t threads] [-n rounds]\n");
+                return 1;
+            }
+
+            engine = e;
+        }
+    }
+
+    if (threads == 0 || threads > MAX_THREADS) {
+        fprintf(stderr, "between 1 and %u threads can be run\n", MAX_THREADS);
+        return 1;
+    }
+
+    borrowed = MakeImage(0, &len);
+    original = MakeImage(0, &len);
+    shared = MakeImage(1, &len);
+
+    if (!WriteFile(SHARED_FILE, shared, len)) {
+        fprintf(stderr, "%s couldn't be written\n", SHARED_FILE);
+        return 1;
+    }
+
+    master = NewController(engine);
+    u765_InsertDiskEx(master, SHARED_FILE, 0, u765_InsertMapped);
+    u765_SetMotorState(master, 8);
+
+    for (i = 0; i < threads; i++) {
+        Worker* w = &workers[i];
+
+        w->Index = i;
+        w->Rounds = rounds;
+        w->Random = 0x9e3779b9u * (i + 1);
+        image = MakeImage(i + 2, &len);
+
+        w->Disks[0].Fdc = NewController(engine);
+        w->Disks[0].Unit = 0;
+        u765_InsertDiskFromMemory(w->Disks[0].Fdc, image, len, 0, u765_InsertDefault);
+        free(image);
+        ExpectImage(&w->Disks[0], i + 2);
+
+        w->Disks[1].Fdc = w->Disks[0].Fdc;
+        w->Disks[1].Unit = 1;
+        u765_InsertDiskFromMemory(w->Disks[1].Fdc, borrowed, len, 1, u765_InsertBorrow);
+        ExpectImage(&w->Disks[1], 0);
+        u765_SetMotorState(w->Disks[0].Fdc, 8);
+
+        w->Disks[2].Fdc = u765_Clone(master);
+        w->Disks[2].Unit = 0;
+        ExpectImage(&w->Disks[2], 1);
+
+        if (w->Disks[2].Fdc == NULL || !u765_DiskInserted(w->Disks[0].Fdc, 0) || !u765_DiskInserted(w->Disks[1].Fdc, 1) ||
+            !u765_DiskInserted(w->Disks[2].Fdc, 0)) {
+            fprintf(stderr, "the disks couldn't be inserted\n");
+            return 1;
+        }
+    }
+
+    // the controller the clones were made from writes its own copies of the tracks, which go
+    // to the file only once the last clone is shut down
+    owner.Random = 0x2545f491u;
+    owner.Disks[0].Fdc = master;
+    owner.Disks[0].Unit = 0;
+    ExpectImage(&owner.Disks[0], 1);
+
+    for (t = 0; t < NUM_TRACKS; t += 4) {
+        Seek(&owner.Disks[0], (uint8_t)t);
+        WriteSector(&owner, &owner.Disks[0], (uint8_t)(t % NUM_SECTORS));
+    }
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].Thread, NULL, Run, &workers[i]) != 0) {
+            fprintf(stderr, "the threads couldn't be started\n");
+            return 1;
+        }
+    }
+
+    // the clones are left sharing the image between themselves
+    u765_Shutdown(master);
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].Thread, NULL);
+        failures += workers[i].Failures;
+
+        u765_Shutdown(workers[i].Disks[0].Fdc);
+        u765_Shutdown(workers[i].Disks[2].Fdc);
+    }
+
+    if (memcmp(borrowed, original, len) != 0) {
+        fprintf(stderr, "the borrowed image was written to\n");
+        failures++;
+    }
+
+    for (t = 0; t < NUM_TRACKS; t++) {
+        memcpy(shared + 0x100 + t * (0x100 + TRACK_SIZE) + 0x100, owner.Disks[0].Data[t], TRACK_SIZE);
+    }
+
+    if (!ReadFile(SHARED_FILE, original, len) || memcmp(original, shared, len) != 0) {
+        fprintf(stderr, "%s doesn't hold what was written to it\n", SHARED_FILE);
+        failures++;
+    }
+
+    failures += owner.Failures;
+    remove(SHARED_FILE);
+
+    printf("%s: %u threads, %u rounds each, %u failures\n", names[engine], threads, rounds, failures);
+
+    free(borrowed);
+    free(original);
+    free(shared);
+    return failures != 0 ? 2 : 0;
+}